@@ -0,0 +1,530 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Codec and mux/demux throughput benchmark
+ *
+ * Generates synthetic keyer traffic for each model and measures the frame
+ * decoder, the sequence encoder, and a running microkeyer daemon with a pty
+ * standing in for the device.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include "microkeyer.h"
+#include "ringbuf.h"
+#include "log.h"
+#include "encoder.h"
+#include "control.h"
+#include "decoder.h"
+#include "device.h"
+#include "spawn.h"
+
+#define STREAM_SEQUENCES 16384 /* Sequences in synthetic device stream */
+#define DECODE_CHUNK     1024  /* Frames per decoder call */
+#define MUX_TIMEOUT      10.0  /* Seconds to wait for data through the daemon */
+
+struct result {
+  double seconds;
+  unsigned long frames;
+  unsigned long bytes[CLIENT_CHANNELS];
+  int complete;
+};
+
+static const char cat_reply[] = "IF00014250000     +00000000002000000 ;FA00014250000;FB00007040000;MD2;";
+static const char cat_query[] = "IF;FA;FB;MD;";
+static const char fsk_text[] = "RYRYRY CQ TEST DE LA1ABC LA1ABC ";
+
+double bench_seconds = 1.0;
+const char *daemon_path = "./microkeyer";
+// Don't hold back bulk data, so that the daemon and not the link rate is measured
+const char *const daemon_args[] = {"-b", "1000000000", NULL};
+uint32_t rngstate = 2463534242U;
+
+/*
+ * Deterministic pseudo random numbers, so that every run sees the same
+ * traffic
+ */
+uint32_t rng()
+{
+  rngstate ^= rngstate << 13;
+  rngstate ^= rngstate >> 17;
+  rngstate ^= rngstate << 5;
+  return rngstate;
+}
+
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void print_header()
+{
+  printf("%-6s %-7s %12s %10s %10s %10s %10s %10s %10s %10s\n", "Model", "Test", "frames/s", "control", "radio1", "radio2", "winkey", "keyboard", "fsk1", "fsk2");
+}
+
+/*
+ * Print frames/s and bytes/s per channel
+ */
+void print_result(const struct model *m, const char *test, struct result *res)
+{
+  int c;
+
+  printf("%-6s %-7s %12.0f", m->name, test, res->frames / res->seconds);
+  for (c = 0; c < CLIENT_CHANNELS; c++)
+    printf(" %10.0f", res->bytes[c] / res->seconds);
+  printf("%s\n", res->complete ? "" : " (incomplete)");
+}
+
+/*
+ * Generate a device to computer stream of numseq sequences
+ *
+ * Radio channels carry CAT replies in bursts, Winkey sends status bytes,
+ * the control channel answers version requests, and flags toggle PTT and
+ * squelch. Only channels the model has are used. Returns the number of
+ * bytes in buf and the number of bytes per channel in expect.
+ */
+size_t make_device_stream(int model, unsigned char *buf, int numseq, unsigned long expect[CLIENT_CHANNELS])
+{
+  static const unsigned char version[] = {CONTROL_GET_VERSION, 'v', '1', '.', '0', CONTROL_GET_VERSION | CONTROL_END_COMMAND};
+  struct devseq ds;
+  size_t len = 0;
+  size_t catpos1 = 0, catpos2 = 0;
+  int burst1 = 0, burst2 = 0; // Bytes left of current CAT burst
+  int ctrlpos = -1;           // Position in version reply, -1 if none
+  int i;
+
+  memset(expect, 0, CLIENT_CHANNELS * sizeof(expect[0]));
+  for (i = 0; i < numseq; i++) {
+    devseq_init(&ds);
+    if (MODEL_HAS_RADIO1(model)) {
+      if (!burst1 && rng() % 4 == 0)
+	burst1 = 20 + rng() % 200;
+      for (; ds.n1 < 4 && burst1; burst1--)
+	ds.r1[ds.n1++] = cat_reply[catpos1++ % (sizeof(cat_reply) - 1)];
+    }
+    if (MODEL_HAS_RADIO2(model)) {
+      if (!burst2 && rng() % 6 == 0)
+	burst2 = 20 + rng() % 200;
+      for (; ds.n2 < 4 && burst2; burst2--)
+	ds.r2[ds.n2++] = cat_reply[catpos2++ % (sizeof(cat_reply) - 1)];
+    }
+    if (i % 16 == 0)
+      ds.flags = ((i / 16) % 2 ? FLAGS_IS_R2 : 0) | ((i / 32) % 2 ? FLAGS_ANY_PTT_ON | FLAGS_SQUELCH : FLAGS_CTS);
+    if (ctrlpos < 0 && i % 64 == 0)
+      ctrlpos = 0;
+    if (ctrlpos >= 0) {
+      ds.control = version[ctrlpos++];
+      if (ctrlpos == sizeof(version))
+	ctrlpos = -1;
+      expect[CLIENT_CONTROL]++;
+    }
+    if (MODEL_HAS_WINKEY(model) && i % 8 == 0) {
+      ds.winkey = 0xC0 | (i / 8) % 8; // Status byte
+      expect[CLIENT_WINKEY]++;
+    }
+    if (MODEL_HAS_KEYBOARD(model) && i % 128 == 0) {
+      ds.keyboard = 'a' + (i / 128) % 26;
+      expect[CLIENT_KEYBOARD]++;
+    }
+    expect[CLIENT_RADIO1] += ds.n1;
+    expect[CLIENT_RADIO2] += ds.n2;
+    len += device_encode(&ds, buf + len);
+  }
+
+  return len;
+}
+
+/*
+ * Top up the transmit queues with computer to device traffic
+ *
+ * Radio channels get CAT queries, FSK channels text, Winkey and control a
+ * command each, and the PTT flags are toggled. Returns bytes queued per
+ * channel in added.
+ */
+void fill_txqueues(int model, struct txqueues *q, int round, unsigned long added[CLIENT_CHANNELS])
+{
+  static const unsigned char control[] = {CONTROL_GET_VERSION, CONTROL_GET_VERSION | CONTROL_END_COMMAND};
+  static const unsigned char winkey[] = {0x02, 0x1C}; // Set 28 WPM
+
+  if (MODEL_HAS_RADIO1(model))
+    while (ringbuf_space(&q->radio1) >= sizeof(cat_query))
+      added[CLIENT_RADIO1] += ringbuf_put(&q->radio1, (const unsigned char *)cat_query, sizeof(cat_query) - 1);
+  if (MODEL_HAS_RADIO2(model))
+    while (ringbuf_space(&q->radio2) >= sizeof(cat_query))
+      added[CLIENT_RADIO2] += ringbuf_put(&q->radio2, (const unsigned char *)cat_query, sizeof(cat_query) - 1);
+  if (MODEL_HAS_FSK1(model))
+    added[CLIENT_FSK1] += ringbuf_put(&q->fsk1, (const unsigned char *)fsk_text, 8);
+  if (MODEL_HAS_FSK2(model))
+    added[CLIENT_FSK2] += ringbuf_put(&q->fsk2, (const unsigned char *)fsk_text, 8);
+  if (MODEL_HAS_WINKEY(model))
+    added[CLIENT_WINKEY] += ringbuf_put(&q->winkey, winkey, sizeof(winkey));
+  added[CLIENT_CONTROL] += ringbuf_put(&q->control, control, sizeof(control));
+  set_flags(q, FLAGS_R1_RTS | FLAGS_R2_RTS | ((round & 1) ? FLAGS_R1_PTT : 0));
+}
+
+/*
+ * Decoder throughput on a synthetic device stream
+ */
+void bench_decode(const struct model *m)
+{
+  unsigned char *buf = malloc(STREAM_SEQUENCES * 16);
+  unsigned char *data[DECODE_CHANNELS];
+  unsigned long expect[CLIENT_CHANNELS];
+  struct decoder dec;
+  struct decoded out;
+  struct result res;
+  size_t len, nframes, pos, n;
+  double start;
+  int c;
+
+  for (c = 0; c < DECODE_CHANNELS; c++)
+    data[c] = malloc(DECODE_CHUNK);
+  if (!buf || !data[DECODE_CHANNELS - 1]) {
+    perror("Can't allocate buffers");
+    exit(1);
+  }
+  len = make_device_stream(m->model, buf, STREAM_SEQUENCES, expect);
+  nframes = len / 4;
+
+  memset(&res, 0, sizeof(res));
+  decoder_init(&dec);
+  start = now();
+  do {
+    for (pos = 0; pos < nframes; pos += n) {
+      n = nframes - pos < DECODE_CHUNK ? nframes - pos : DECODE_CHUNK;
+      for (c = 0; c < DECODE_CHANNELS; c++) {
+	out.data[c] = data[c];
+	out.len[c] = 0;
+      }
+      if (decoder_check(buf + 4*pos, n) != n) {
+	fprintf(stderr, "Synthetic stream for %s is misframed\n", m->name);
+	exit(1);
+      }
+      decoder_run(&dec, buf + 4*pos, n, &out);
+      res.bytes[CLIENT_CONTROL] += out.len[DECODE_CONTROL];
+      res.bytes[CLIENT_RADIO1] += out.len[DECODE_R1];
+      res.bytes[CLIENT_RADIO2] += out.len[DECODE_R2];
+      res.bytes[CLIENT_WINKEY] += out.len[DECODE_WINKEY];
+      res.bytes[CLIENT_KEYBOARD] += out.len[DECODE_KEYBOARD];
+    }
+    res.frames += nframes;
+  } while ((res.seconds = now() - start) < bench_seconds);
+  res.complete = 1;
+  print_result(m, "decode", &res);
+
+  for (c = 0; c < DECODE_CHANNELS; c++)
+    free(data[c]);
+  free(buf);
+}
+
+/*
+ * Encoder throughput with all channels busy
+ */
+void bench_encode(const struct model *m)
+{
+  struct txqueues q;
+  struct control control;
+  struct scheduler sched = {.weight = {5, 5}, .backlog_limit = (size_t)-1, .starve_limit = 8}; // Never hold back bulk data
+  struct ringbuf out;
+  struct result res;
+  unsigned long added[CLIENT_CHANNELS];
+  size_t before[CLIENT_CHANNELS];
+  double start;
+  int round = 0;
+
+  txqueues_init(&q, 1024);
+  control_init(&control);
+  ringbuf_init(&out, 65536);
+
+  memset(&res, 0, sizeof(res));
+  start = now();
+  do {
+    memset(added, 0, sizeof(added));
+    fill_txqueues(m->model, &q, round++, added);
+    before[CLIENT_CONTROL] = ringbuf_used(&q.control) + ringbuf_used(&q.command);
+    before[CLIENT_RADIO1] = ringbuf_used(&q.radio1);
+    before[CLIENT_RADIO2] = ringbuf_used(&q.radio2);
+    before[CLIENT_WINKEY] = ringbuf_used(&q.winkey);
+    before[CLIENT_FSK1] = ringbuf_used(&q.fsk1);
+    before[CLIENT_FSK2] = ringbuf_used(&q.fsk2);
+    control_frame_pty(&control, &q, 0);
+    encode_sequences(&q, &out, &sched, 0);
+    res.bytes[CLIENT_CONTROL] += before[CLIENT_CONTROL] - ringbuf_used(&q.control) - ringbuf_used(&q.command);
+    res.bytes[CLIENT_RADIO1] += before[CLIENT_RADIO1] - ringbuf_used(&q.radio1);
+    res.bytes[CLIENT_RADIO2] += before[CLIENT_RADIO2] - ringbuf_used(&q.radio2);
+    res.bytes[CLIENT_WINKEY] += before[CLIENT_WINKEY] - ringbuf_used(&q.winkey);
+    res.bytes[CLIENT_FSK1] += before[CLIENT_FSK1] - ringbuf_used(&q.fsk1);
+    res.bytes[CLIENT_FSK2] += before[CLIENT_FSK2] - ringbuf_used(&q.fsk2);
+    res.frames += ringbuf_used(&out) / 4;
+    ringbuf_clear(&out);
+  } while ((res.seconds = now() - start) < bench_seconds);
+  res.complete = 1;
+  print_result(m, "encode", &res);
+
+  txqueues_free(&q);
+  ringbuf_free(&out);
+}
+
+/*
+ * Are all expected bytes received?
+ */
+int all_received(unsigned long got[CLIENT_CHANNELS], unsigned long expect[CLIENT_CHANNELS])
+{
+  int c;
+
+  for (c = 0; c < CLIENT_CHANNELS; c++)
+    if (got[c] < expect[c])
+      return 0;
+  return 1;
+}
+
+/*
+ * Device to client throughput through the daemon
+ */
+void bench_demux(const struct model *m)
+{
+  unsigned char *buf = malloc(STREAM_SEQUENCES * 16);
+  unsigned char rbuf[4096];
+  unsigned long expect[CLIENT_CHANNELS];
+  struct pollfd pfd[CLIENT_CHANNELS + 1];
+  struct result res;
+  int ptys[CLIENT_CHANNELS];
+  int device;
+  size_t len, sent = 0;
+  double start;
+  ssize_t n;
+  pid_t pid;
+  int c;
+
+  if (!buf) {
+    perror("Can't allocate buffer");
+    exit(1);
+  }
+  len = make_device_stream(m->model, buf, STREAM_SEQUENCES, expect);
+  device = open_device_pty();
+  pid = spawn_daemon(daemon_path, m->model, m->name, device, daemon_args, ptys);
+
+  memset(&res, 0, sizeof(res));
+  start = now();
+  while (!all_received(res.bytes, expect) && now() - start < MUX_TIMEOUT) {
+    pfd[CLIENT_CHANNELS].fd = device;
+    pfd[CLIENT_CHANNELS].events = sent < len ? POLLOUT : 0;
+    for (c = 0; c < CLIENT_CHANNELS; c++) {
+      pfd[c].fd = ptys[c];
+      pfd[c].events = POLLIN;
+    }
+    if (poll(pfd, CLIENT_CHANNELS + 1, 100) == -1 && errno != EINTR) {
+      perror("Error waiting for daemon");
+      exit(1);
+    }
+    if ((pfd[CLIENT_CHANNELS].revents & POLLOUT) && (n = write(device, buf + sent, len - sent)) > 0)
+      sent += n;
+    for (c = 0; c < CLIENT_CHANNELS; c++)
+      if ((pfd[c].revents & POLLIN) && (n = read(ptys[c], rbuf, sizeof(rbuf))) > 0)
+	res.bytes[c] += n;
+  }
+  res.seconds = now() - start;
+  res.frames = sent / 4;
+  res.complete = all_received(res.bytes, expect);
+  print_result(m, "demux", &res);
+
+  stop_daemon(pid, ptys);
+  close(device);
+  free(buf);
+}
+
+/*
+ * Client to device throughput through the daemon
+ */
+void bench_mux(const struct model *m)
+{
+  static const unsigned char control[] = {CONTROL_GET_VERSION, CONTROL_GET_VERSION | CONTROL_END_COMMAND};
+  static const unsigned char winkey[] = {0x02, 0x1C};
+  unsigned long expect[CLIENT_CHANNELS], sent[CLIENT_CHANNELS];
+  unsigned char *data[DEVICE_CHANNELS];
+  size_t len[DEVICE_CHANNELS];
+  struct device_decoder dd;
+  struct ringbuf rx;
+  struct pollfd pfd[CLIENT_CHANNELS + 1];
+  struct result res;
+  unsigned char frame[4];
+  char wbuf[1024];
+  int ptys[CLIENT_CHANNELS];
+  int device;
+  double start;
+  ssize_t n;
+  pid_t pid;
+  int c;
+
+  device = open_device_pty();
+  pid = spawn_daemon(daemon_path, m->model, m->name, device, daemon_args, ptys);
+  for (c = 0; c < DEVICE_CHANNELS; c++)
+    data[c] = malloc(4096);
+  ringbuf_init(&rx, 16384);
+  device_decoder_init(&dd);
+
+  memset(expect, 0, sizeof(expect));
+  expect[CLIENT_RADIO1] = ptys[CLIENT_RADIO1] >= 0 ? 65536 : 0;
+  expect[CLIENT_RADIO2] = ptys[CLIENT_RADIO2] >= 0 ? 65536 : 0;
+  expect[CLIENT_FSK1] = ptys[CLIENT_FSK1] >= 0 ? 4096 : 0;
+  expect[CLIENT_FSK2] = ptys[CLIENT_FSK2] >= 0 ? 4096 : 0;
+  expect[CLIENT_WINKEY] = ptys[CLIENT_WINKEY] >= 0 ? 4096 : 0;
+  expect[CLIENT_CONTROL] = 4096;
+  memset(sent, 0, sizeof(sent));
+
+  memset(&res, 0, sizeof(res));
+  start = now();
+  while (!all_received(res.bytes, expect) && now() - start < MUX_TIMEOUT) {
+    pfd[CLIENT_CHANNELS].fd = device;
+    pfd[CLIENT_CHANNELS].events = POLLIN;
+    for (c = 0; c < CLIENT_CHANNELS; c++) {
+      pfd[c].fd = ptys[c];
+      pfd[c].events = sent[c] < expect[c] ? POLLOUT : 0;
+    }
+    if (poll(pfd, CLIENT_CHANNELS + 1, 100) == -1 && errno != EINTR) {
+      perror("Error waiting for daemon");
+      exit(1);
+    }
+    for (c = 0; c < CLIENT_CHANNELS; c++) {
+      size_t want, i;
+
+      if (!(pfd[c].revents & POLLOUT))
+	continue;
+      want = expect[c] - sent[c] < sizeof(wbuf) ? expect[c] - sent[c] : sizeof(wbuf);
+      for (i = 0; i < want; i++) {
+	if (c == CLIENT_CONTROL)
+	  wbuf[i] = control[(sent[c] + i) % sizeof(control)];
+	else if (c == CLIENT_WINKEY)
+	  wbuf[i] = winkey[(sent[c] + i) % sizeof(winkey)];
+	else if (c == CLIENT_FSK1 || c == CLIENT_FSK2)
+	  wbuf[i] = fsk_text[(sent[c] + i) % (sizeof(fsk_text) - 1)];
+	else
+	  wbuf[i] = cat_query[(sent[c] + i) % (sizeof(cat_query) - 1)];
+      }
+      if ((n = write(ptys[c], wbuf, want)) > 0)
+	sent[c] += n;
+    }
+    if ((pfd[CLIENT_CHANNELS].revents & POLLIN) && ringbuf_read_fd(&rx, device) > 0) {
+      memset(len, 0, sizeof(len));
+      while (ringbuf_used(&rx) >= 4 && len[DEVICE_R1] < 4000 && len[DEVICE_R2] < 4000) {
+	ringbuf_get(&rx, frame, 4);
+	device_decode(&dd, frame, 1, data, len);
+	res.frames++;
+      }
+      res.bytes[CLIENT_RADIO1] += len[DEVICE_R1];
+      res.bytes[CLIENT_RADIO2] += len[DEVICE_R2];
+      res.bytes[CLIENT_CONTROL] += len[DEVICE_CONTROL];
+      res.bytes[CLIENT_WINKEY] += len[DEVICE_WINKEY];
+      res.bytes[CLIENT_FSK1] += len[DEVICE_FSK1];
+      res.bytes[CLIENT_FSK2] += len[DEVICE_FSK2];
+    }
+  }
+  res.seconds = now() - start;
+  res.complete = all_received(res.bytes, expect);
+  print_result(m, "mux", &res);
+
+  stop_daemon(pid, ptys);
+  close(device);
+  ringbuf_free(&rx);
+  for (c = 0; c < DEVICE_CHANNELS; c++)
+    free(data[c]);
+}
+
+void show_help()
+{
+  printf("Usage: microkeyer-bench [OPTIONS]\n");
+  printf("  -m, --model=MODEL       Only benchmark this model\n");
+  printf("  -t, --time=SECONDS      Run codec benchmarks for SECONDS each (default 1)\n");
+  printf("  -d, --daemon=PATH       Daemon for mux/demux benchmarks (default ./microkeyer)\n");
+  printf("  -n, --no-daemon         Skip mux/demux benchmarks\n");
+  printf("  -h, --help              Display this help text\n");
+  printf("\nReports frames/s and bytes/s per channel.\n");
+  exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+    {"model", required_argument, NULL, 'm'},
+    {"time", required_argument, NULL, 't'},
+    {"daemon", required_argument, NULL, 'd'},
+    {"no-daemon", no_argument, NULL, 'n'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *only = NULL;
+  int use_daemon = 1;
+  int option_index;
+  int i;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "m:t:d:nh", long_options, &option_index)) != -1) {
+    switch (c) {
+    case 'm':
+      only = optarg;
+      break;
+    case 't':
+      bench_seconds = atof(optarg);
+      break;
+    case 'd':
+      daemon_path = optarg;
+      break;
+    case 'n':
+      use_daemon = 0;
+      break;
+    default:
+      show_help();
+      break;
+    }
+  }
+  if (use_daemon && access(daemon_path, X_OK)) {
+    fprintf(stderr, "Can't run %s, skipping mux/demux benchmarks\n", daemon_path);
+    use_daemon = 0;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  print_header();
+  for (i = 0; i < nummodels; i++) {
+    if (only && strcasecmp(only, models[i].name))
+      continue;
+    bench_decode(&models[i]);
+    bench_encode(&models[i]);
+    if (use_daemon) {
+      bench_demux(&models[i]);
+      bench_mux(&models[i]);
+    }
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "capture.h"
+
+#define RECORD_SIZE(len) ((sizeof(struct capture_record) + (len) + 7) & ~(uint64_t)7)
+
+/*
+ * Create a capture file with a data area of the given size
+ *
+ * Print error message and exit on failure
+ */
+void capture_open(struct capture *cap, const char *filename, size_t size, int model, uint64_t now)
+{
+  struct timespec ts;
+  int err;
+
+  size &= ~(size_t)7;
+  if (size < 65536) {
+    fprintf(stderr, "Capture file must be at least 64 kB\n");
+    exit(1);
+  }
+  cap->mapsize = sizeof(struct capture_header) + size;
+  if ((cap->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+    perror("Can't create capture file");
+    exit(1);
+  }
+  // Allocate all blocks now, so that writing never fails or waits for the file system
+  if ((err = posix_fallocate(cap->fd, 0, cap->mapsize))) {
+    fprintf(stderr, "Can't allocate capture file: %s\n", strerror(err));
+    exit(1);
+  }
+  if ((cap->map = mmap(NULL, cap->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, cap->fd, 0)) == MAP_FAILED) {
+    perror("Can't map capture file");
+    exit(1);
+  }
+
+  cap->hdr = (struct capture_header *)cap->map;
+  cap->data = cap->map + sizeof(struct capture_header);
+  cap->start = now;
+  memset(cap->hdr, 0, sizeof(*cap->hdr));
+  memcpy(cap->hdr->magic, CAPTURE_MAGIC, sizeof(cap->hdr->magic));
+  cap->hdr->model = model;
+  cap->hdr->size = size;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  cap->hdr->realtime = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Offset of the record after the one at pos
+ *
+ * 0 if it is at the start of the data area, including when the record at
+ * pos ends where there is no room for another.
+ */
+static uint64_t next_record(const struct capture *cap, uint64_t pos)
+{
+  const struct capture_record *rec = (const struct capture_record *)(cap->data + pos);
+
+  if (cap->hdr->size - pos < sizeof(struct capture_record) || rec->direction == CAPTURE_WRAP)
+    return 0;
+  pos += RECORD_SIZE(rec->len);
+  return cap->hdr->size - pos < sizeof(struct capture_record) ? 0 : pos;
+}
+
+/*
+ * Drop the oldest records until the area from pos to end is free
+ */
+static void reclaim(struct capture *cap, uint64_t pos, uint64_t end)
+{
+  struct capture_header *hdr = cap->hdr;
+
+  while (hdr->wrapped && hdr->first >= pos && hdr->first < end)
+    if (!(hdr->first = next_record(cap, hdr->first)) && !pos)
+      break; // All of it is overwritten, so the new record is the oldest
+}
+
+/*
+ * Append a record of the data in iov
+ *
+ * Never fails. Data larger than the whole file is truncated.
+ */
+void capture_write(struct capture *cap, int direction, const struct iovec *iov, int iovcnt, uint64_t now)
+{
+  struct capture_header *hdr = cap->hdr;
+  struct capture_record *rec;
+  unsigned char *dst;
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (RECORD_SIZE(len) > hdr->size)
+    len = hdr->size - sizeof(struct capture_record);
+
+  if (hdr->next + RECORD_SIZE(len) > hdr->size) {
+    if (hdr->size - hdr->next >= sizeof(struct capture_record))
+      ((struct capture_record *)(cap->data + hdr->next))->direction = CAPTURE_WRAP;
+    if (!hdr->wrapped) {
+      hdr->wrapped = 1;
+      hdr->first = 0;
+    }
+    reclaim(cap, hdr->next, hdr->size);
+    hdr->next = 0;
+  }
+  reclaim(cap, hdr->next, hdr->next + RECORD_SIZE(len));
+
+  rec = (struct capture_record *)(cap->data + hdr->next);
+  rec->time = now - cap->start;
+  rec->len = len;
+  rec->direction = direction;
+  dst = (unsigned char *)(rec + 1);
+  for (i = 0; i < iovcnt && len; i++) {
+    size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+
+    memcpy(dst, iov[i].iov_base, n);
+    dst += n;
+    len -= n;
+  }
+  hdr->next += RECORD_SIZE(rec->len);
+
+  // Wrap as soon as no other record fits, so that first and next are
+  // always where a record starts
+  if (hdr->size - hdr->next < sizeof(struct capture_record)) {
+    if (!hdr->wrapped) {
+      hdr->wrapped = 1;
+      hdr->first = 0;
+    }
+    hdr->next = 0;
+  }
+}
+
+void capture_close(struct capture *cap)
+{
+  munmap(cap->map, cap->mapsize);
+  close(cap->fd);
+}
+
+/*
+ * Open a capture file for replay
+ *
+ * Print error message and exit on failure
+ */
+void replay_open(struct capture *cap, const char *filename)
+{
+  struct capture_header hdr;
+
+  if ((cap->fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1) {
+    perror("Can't open capture file");
+    exit(1);
+  }
+  if (read(cap->fd, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic))) {
+    fprintf(stderr, "%s is not a capture file\n", filename);
+    exit(1);
+  }
+  cap->mapsize = sizeof(hdr) + hdr.size;
+  if ((cap->map = mmap(NULL, cap->mapsize, PROT_READ, MAP_PRIVATE, cap->fd, 0)) == MAP_FAILED) {
+    perror("Can't map capture file");
+    exit(1);
+  }
+  cap->hdr = (struct capture_header *)cap->map;
+  cap->data = cap->map + sizeof(hdr);
+  cap->start = 0;
+  cap->pos = cap->hdr->wrapped ? cap->hdr->first : 0;
+  cap->passedwrap = !cap->hdr->wrapped;
+}
+
+/*
+ * Next record in capture order, NULL at the end
+ */
+const struct capture_record *replay_next(struct capture *cap, const unsigned char **data)
+{
+  const struct capture_record *rec;
+
+  for (;;) {
+    if (cap->passedwrap && cap->pos == cap->hdr->next)
+      return NULL;
+    if (cap->hdr->size - cap->pos < sizeof(struct capture_record) || ((const struct capture_record *)(cap->data + cap->pos))->direction == CAPTURE_WRAP) {
+      if (cap->passedwrap) // Corrupt file
+	return NULL;
+      cap->pos = 0;
+      cap->passedwrap = 1;
+      continue;
+    }
+    rec = (const struct capture_record *)(cap->data + cap->pos);
+    if (RECORD_SIZE(rec->len) > cap->hdr->size - cap->pos)
+      return NULL;
+    *data = (const unsigned char *)(rec + 1);
+    cap->pos += RECORD_SIZE(rec->len);
+    return rec;
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Raw device stream capture
+ *
+ * The file is preallocated and mapped into memory. Records are appended by
+ * copying, and when the file is full the oldest records are overwritten,
+ * so it always holds the most recent traffic.
+ *
+ * File layout: struct capture_header, then the data area. Each record in
+ * the data area is a struct capture_record followed by len bytes of data,
+ * padded to a multiple of 8 bytes. A record with direction CAPTURE_WRAP,
+ * or less than a record header left before the end of the data area, means
+ * that the next record is at the start of the data area.
+ */
+
+#define CAPTURE_MAGIC "MKCAP01"
+#define CAPTURE_RX    0    /* Device to computer */
+#define CAPTURE_TX    1    /* Computer to device */
+#define CAPTURE_WRAP  0xFF /* Continued at start of data area */
+
+struct capture_header {
+  char magic[8];
+  uint32_t model;    /* MODEL_* */
+  uint32_t wrapped;  /* Oldest records have been overwritten */
+  uint64_t size;     /* Size of data area */
+  uint64_t first;    /* Offset of oldest record in data area */
+  uint64_t next;     /* Offset of next record in data area */
+  uint64_t realtime; /* Wall clock time of capture start, ns since epoch */
+  uint64_t pad[2];   /* Header is 64 bytes */
+};
+
+struct capture_record {
+  uint64_t time;     /* ns since capture start */
+  uint32_t len;      /* Bytes of data */
+  uint8_t direction; /* CAPTURE_* */
+  uint8_t pad[3];
+};
+
+/*
+ * Open capture, for writing or replay
+ */
+struct capture {
+  int fd;
+  unsigned char *map;
+  size_t mapsize;
+  struct capture_header *hdr;
+  unsigned char *data;  /* Data area */
+  uint64_t start;       /* CLOCK_MONOTONIC at start of capture, ns */
+  uint64_t pos;         /* Replay: offset of next record */
+  int passedwrap;       /* Replay: wrapped around the end of the data area */
+};
+
+void capture_open(struct capture *cap, const char *filename, size_t size, int model, uint64_t now);
+void capture_write(struct capture *cap, int direction, const struct iovec *iov, int iovcnt, uint64_t now);
+void capture_close(struct capture *cap);
+void replay_open(struct capture *cap, const char *filename);
+const struct capture_record *replay_next(struct capture *cap, const unsigned char **data);
+
+#endif
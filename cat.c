@@ -0,0 +1,486 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "log.h"
+#include "cat.h"
+
+#define CIV_PREAMBLE 0xFE
+#define CIV_END      0xFD
+#define CIV_OK       0xFB
+#define CIV_NG       0xFA
+
+/*
+ * Frequency and mode reads of each protocol, cached unless others are
+ * given
+ */
+static const char *default_queries[] = {
+  "FA,FB,IF,MD,FR,FT", /* CAT_KENWOOD */
+  "FA,FB,IF,MD0",      /* CAT_YAESU */
+  "03,04"              /* CAT_ICOM: read frequency and mode */
+};
+
+/*
+ * Protocol by name, -1 if unknown
+ */
+int cat_protocol(const char *name)
+{
+  if (!strcasecmp(name, "kenwood"))
+    return CAT_KENWOOD;
+  if (!strcasecmp(name, "yaesu"))
+    return CAT_YAESU;
+  if (!strcasecmp(name, "icom"))
+    return CAT_ICOM;
+  return -1;
+}
+
+/*
+ * Value of a hex digit, -1 if it isn't one
+ */
+static int hexdigit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/*
+ * Parse a comma separated list of queries
+ *
+ * Kenwood and Yaesu queries are given without the ';', CI-V queries as
+ * the command and subcommand bytes in hex. Returns 0 on success, -1 on
+ * invalid list.
+ */
+static int parse_queries(struct cat *c, const char *list)
+{
+  struct cat_query *q;
+  int hi, lo;
+
+  c->numqueries = 0;
+  while (*list) {
+    if (c->numqueries == CAT_QUERIES)
+      return -1;
+    q = &c->queries[c->numqueries++];
+    q->len = 0;
+    for (; *list && *list != ','; list++) {
+      if (q->len == CAT_MAX_COMMAND - 2)
+	return -1;
+      if (c->protocol != CAT_ICOM) {
+	if (!isalnum((unsigned char)*list))
+	  return -1;
+	q->cmd[q->len++] = toupper((unsigned char)*list);
+      }
+      else {
+	if ((hi = hexdigit(list[0])) < 0 || (lo = hexdigit(list[1])) < 0)
+	  return -1;
+	q->cmd[q->len++] = hi << 4 | lo;
+	list++;
+      }
+    }
+    if (!q->len)
+      return -1;
+    if (c->protocol != CAT_ICOM)
+      q->cmd[q->len++] = ';';
+    if (*list)
+      list++;
+  }
+  return 0;
+}
+
+/*
+ * Set up sharing of a radio channel
+ *
+ * queries is a comma separated list of the queries to cache, NULL for the
+ * defaults of the protocol. Returns 0 on success, -1 on invalid list.
+ */
+int cat_init(struct cat *c, int protocol, uint64_t ttl, int numclients, const char *queries)
+{
+  memset(c, 0, sizeof(*c));
+  c->protocol = protocol;
+  c->ttl = ttl;
+  c->numclients = numclients;
+  return parse_queries(c, queries ? queries : default_queries[protocol]);
+}
+
+/*
+ * Length of the command name a Kenwood or Yaesu command or reply starts
+ * with
+ */
+static size_t name_length(const unsigned char *cmd, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len && cmd[i] >= 'A' && cmd[i] <= 'Z'; i++)
+    ;
+  return i;
+}
+
+/*
+ * Is this command one of the queries to cache?
+ */
+static int is_query(const struct cat *c, const unsigned char *cmd, size_t len)
+{
+  int i;
+
+  if (c->protocol == CAT_ICOM) { // Compare only command, subcommand and data
+    if (len < 6)
+      return 0;
+    cmd += 4;
+    len -= 5;
+  }
+  for (i = 0; i < c->numqueries; i++)
+    if (c->queries[i].len == len && !memcmp(c->queries[i].cmd, cmd, len))
+      return 1;
+  return 0;
+}
+
+/*
+ * Cached reply to a command, NULL if none
+ */
+static struct cat_entry *cache_find(struct cat *c, const unsigned char *cmd, size_t len)
+{
+  int i;
+
+  for (i = 0; i < CAT_CACHE; i++)
+    if (c->cache[i].time && c->cache[i].len == len && !memcmp(c->cache[i].cmd, cmd, len))
+      return &c->cache[i];
+  return NULL;
+}
+
+/*
+ * Keep a reply, in place of the oldest one if the cache is full
+ */
+static void cache_store(struct cat *c, const struct cat_request *req, const unsigned char *reply, size_t len, uint64_t now)
+{
+  struct cat_entry *e = cache_find(c, req->cmd, req->len);
+  int i;
+
+  if (!e) {
+    e = &c->cache[0];
+    for (i = 1; i < CAT_CACHE && e->time; i++)
+      if (c->cache[i].time < e->time)
+	e = &c->cache[i];
+  }
+  memcpy(e->cmd, req->cmd, req->len);
+  e->len = req->len;
+  memcpy(e->reply, reply, len);
+  e->replylen = len;
+  e->time = now;
+}
+
+/*
+ * Forget all cached replies
+ */
+void cat_flush(struct cat *c)
+{
+  int i;
+
+  for (i = 0; i < CAT_CACHE; i++)
+    c->cache[i].time = 0;
+}
+
+/*
+ * Start over with a client, when another takes its place
+ *
+ * What the last one was framing is dropped. Its commands are still in
+ * flight, so the replies are matched correctly, but go to nobody.
+ */
+void cat_forget(struct cat *c, int client)
+{
+  int i;
+
+  c->clients[client].len = 0;
+  c->clients[client].done = 0;
+  for (i = 0; i < c->numinflight; i++)
+    c->inflight[i].to &= ~(1U << client);
+}
+
+/*
+ * Remove a request from the in-flight table
+ */
+static void remove_request(struct cat *c, int i)
+{
+  c->numinflight--;
+  memmove(&c->inflight[i], &c->inflight[i + 1], (c->numinflight - i) * sizeof(c->inflight[0]));
+}
+
+/*
+ * Give up on commands whose reply is overdue
+ *
+ * Clients have their own timeouts, so nobody is told.
+ */
+static void expire(struct cat *c, uint64_t now)
+{
+  while (c->numinflight && c->inflight[0].due <= now) {
+    debugprintf(2, "No reply to CAT command.\n");
+    c->timeouts++;
+    remove_request(c, 0);
+  }
+}
+
+/*
+ * Send a framed command to the radio, or answer it from the cache
+ *
+ * Returns 1 and fills in r if it was answered from the cache, 0 if it was
+ * sent or joined the same query in flight, and -1 if there is no room for
+ * it in the queue.
+ */
+static int send_command(struct cat *c, int client, struct ringbuf *radio, uint64_t now, struct cat_reply *r)
+{
+  struct cat_client *cl = &c->clients[client];
+  struct cat_request *req;
+  struct cat_entry *e;
+  int cached = c->ttl && is_query(c, cl->cmd, cl->len);
+  int query;
+  int i;
+
+  expire(c, now);
+  if (cached) {
+    if ((e = cache_find(c, cl->cmd, cl->len)) && now - e->time < c->ttl) {
+      c->hits++;
+      r->to = 1U << client;
+      r->data = e->reply;
+      r->len = e->replylen;
+      return 1;
+    }
+    for (i = 0; i < c->numinflight; i++)
+      if (c->inflight[i].cached && c->inflight[i].len == cl->len && !memcmp(c->inflight[i].cmd, cl->cmd, cl->len)) {
+	c->joined++;
+	c->inflight[i].to |= 1U << client;
+	return 0;
+      }
+  }
+  if (ringbuf_space(radio) < cl->len)
+    return -1;
+
+  ringbuf_put(radio, cl->cmd, cl->len);
+  c->commands++;
+  // Only the queries are known to read the state of the radio, anything
+  // else may change it. A Kenwood or Yaesu command with nothing but its
+  // name may still be one that does, like TX; or UP;, and gets no reply.
+  query = is_query(c, cl->cmd, cl->len);
+  if (!query)
+    cat_flush(c);
+  if ((c->protocol == CAT_ICOM || query) && c->numinflight < CAT_INFLIGHT) {
+    req = &c->inflight[c->numinflight++];
+    memcpy(req->cmd, cl->cmd, cl->len);
+    req->len = cl->len;
+    req->to = 1U << client;
+    req->cached = cached;
+    req->due = now + CAT_REPLY_WAIT;
+  }
+  return 0;
+}
+
+/*
+ * Take bytes from a client until a whole command is framed
+ *
+ * Returns 1 if there is a command to send.
+ */
+static int frame_command(struct cat *c, struct cat_client *cl, struct ringbuf *in)
+{
+  unsigned char byte;
+  int civ = c->protocol == CAT_ICOM;
+
+  while (!cl->done && ringbuf_get(in, &byte, 1)) {
+    if (civ && cl->len < 2 && byte != CIV_PREAMBLE) {
+      c->discarded++;
+      cl->len = 0;
+      continue;
+    }
+    if ((civ && cl->len == 2 && byte == CIV_PREAMBLE) || (!civ && !cl->len && isspace(byte)))
+      continue; // Longer preamble, or line ends between commands
+    cl->cmd[cl->len++] = byte;
+    if (byte == (civ ? CIV_END : ';')) {
+      if (civ && cl->len < 6) {
+	c->discarded++;
+	cl->len = 0;
+      }
+      else
+	cl->done = 1;
+    }
+    else if (cl->len == CAT_MAX_COMMAND) {
+      debugprintf(2, "CAT command too long, discarded\n");
+      c->discarded++;
+      cl->len = 0;
+    }
+  }
+  return cl->done;
+}
+
+/*
+ * Frame the input from the clients into commands and send them
+ *
+ * Clients take turns, one command each. in holds the input of each client.
+ * A command that doesn't fit in the queue is kept until there is room for
+ * it, and input from its client is held back meanwhile. Returns 1 and
+ * fills in r when a command is answered from the cache, 0 when there is
+ * nothing more to send.
+ */
+int cat_frame(struct cat *c, struct ringbuf in[], struct ringbuf *radio, uint64_t now, struct cat_reply *r)
+{
+  int progress;
+  int client;
+  int res;
+  int i;
+
+  do {
+    progress = 0;
+    for (i = 0; i < c->numclients; i++) {
+      client = c->next;
+      if (!frame_command(c, &c->clients[client], &in[client])) {
+	c->next = (client + 1) % c->numclients;
+	continue;
+      }
+      if ((res = send_command(c, client, radio, now, r)) < 0)
+	return 0; // It's still this client's turn when there is room
+      c->clients[client].done = 0;
+      c->clients[client].len = 0;
+      c->next = (client + 1) % c->numclients;
+      if (res)
+	return 1;
+      progress = 1;
+    }
+  } while (progress);
+  return 0;
+}
+
+/*
+ * Is a command waiting for room in the queue?
+ */
+int cat_pending(const struct cat *c)
+{
+  int i;
+
+  for (i = 0; i < c->numclients; i++)
+    if (c->clients[i].done)
+      return 1;
+  return 0;
+}
+
+/*
+ * Find the command in flight a complete reply answers, -1 if none
+ *
+ * A CI-V command echoed back on the bus also goes to whoever sent it, but
+ * is still waiting for the reply. Kenwood and Yaesu errors have no name,
+ * and answer the oldest command.
+ */
+static int match_reply(struct cat *c, const unsigned char *reply, size_t len, int *echo)
+{
+  const struct cat_request *req;
+  size_t name = name_length(reply, len);
+  int i;
+
+  *echo = 0;
+  if (c->protocol != CAT_ICOM && name < 2)
+    return c->numinflight ? 0 : -1;
+  for (i = 0; i < c->numinflight; i++) {
+    req = &c->inflight[i];
+    if (c->protocol != CAT_ICOM) {
+      if (name_length(req->cmd, req->len) == name && !memcmp(req->cmd, reply, name))
+	return i;
+    }
+    else if (req->len == len && !memcmp(req->cmd, reply, len)) {
+      *echo = 1;
+      return i;
+    }
+    else if (len >= 6 && reply[2] == req->cmd[3] && reply[3] == req->cmd[2] && (reply[4] == req->cmd[4] || reply[4] == CIV_OK || reply[4] == CIV_NG))
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Route a complete reply, and cache it if it answers a query
+ *
+ * A reply nobody asked for may tell of a change, so what it might make
+ * stale is forgotten.
+ */
+static void route_reply(struct cat *c, uint64_t now, struct cat_reply *r)
+{
+  struct cat_request *req;
+  size_t name;
+  int echo;
+  int i;
+
+  r->data = c->reply;
+  r->len = c->replylen;
+  c->replylen = 0;
+
+  expire(c, now);
+  if ((i = match_reply(c, r->data, r->len, &echo)) < 0) {
+    debugprintf(7, "CAT reply nobody asked for, %zu bytes.\n", r->len);
+    c->unsolicited++;
+    r->to = CAT_ALL;
+    if (c->protocol == CAT_ICOM) {
+      cat_flush(c);
+      return;
+    }
+    name = name_length(r->data, r->len);
+    for (i = 0; i < CAT_CACHE; i++)
+      if (name_length(c->cache[i].cmd, c->cache[i].len) == name && !memcmp(c->cache[i].cmd, r->data, name))
+	c->cache[i].time = 0;
+    return;
+  }
+  req = &c->inflight[i];
+  r->to = req->to;
+  if (echo)
+    return;
+  c->replies++;
+  if (req->cached && (c->protocol == CAT_ICOM ? r->data[4] != CIV_NG : name_length(r->data, r->len) >= 2))
+    cache_store(c, req, r->data, r->len, now);
+  remove_request(c, i);
+}
+
+/*
+ * Take bytes from the radio until a reply is complete
+ *
+ * The bytes are consumed from *data. Returns 1 and fills in r when a reply
+ * is complete, or 0 when all bytes are consumed. CI-V bytes outside of
+ * frames are dropped.
+ */
+int cat_receive(struct cat *c, const unsigned char **data, size_t *len, uint64_t now, struct cat_reply *r)
+{
+  unsigned char byte;
+  int civ = c->protocol == CAT_ICOM;
+
+  while (*len) {
+    byte = *(*data)++;
+    (*len)--;
+    if (civ && c->replylen < 2 && byte != CIV_PREAMBLE) {
+      c->discarded++;
+      c->replylen = 0;
+      continue;
+    }
+    if (civ && c->replylen == 2 && byte == CIV_PREAMBLE)
+      continue;
+    c->reply[c->replylen++] = byte;
+    if (byte == (civ ? CIV_END : ';') || c->replylen == CAT_MAX_COMMAND) {
+      route_reply(c, now, r);
+      return 1;
+    }
+  }
+  return 0;
+}
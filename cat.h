@@ -0,0 +1,114 @@
+#ifndef _CAT_H
+#define _CAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ringbuf.h"
+
+/*
+ * Sharing of a radio's CAT port between several clients
+ *
+ * Commands from each client are framed as a whole before they are queued
+ * for the radio, and clients take turns, so commands from different
+ * clients are never mixed up. Replies are matched to the oldest command in
+ * flight they answer: for Kenwood and Yaesu by the command name the reply
+ * starts with, for Icom CI-V by the addresses and the command byte. Replies
+ * nobody asked for, e.g. in auto information or transceive mode, go to all
+ * clients.
+ *
+ * Replies to the read queries configured for the protocol are kept, and
+ * the same query is answered from the cache until the reply is older than
+ * the TTL. A query already on its way to the radio isn't sent again, and
+ * its reply goes to everyone who asked. Any other command may change the
+ * state of the radio, and empties the cache. Kenwood and Yaesu don't
+ * answer commands that set something, so only their queries wait for a
+ * reply, and the reply to any other read goes to all clients.
+ */
+
+#define CAT_CLIENTS     16   /* Ptys and socket clients sharing a radio channel */
+#define CAT_MAX_COMMAND 128  /* Longest command or reply */
+#define CAT_INFLIGHT    16   /* Commands waiting for a reply */
+#define CAT_QUERIES     16   /* Read queries that are cached */
+#define CAT_CACHE       16   /* Replies kept */
+#define CAT_REPLY_WAIT  500000000ULL /* How long to wait for a reply, ns */
+
+/*
+ * Protocols
+ */
+#define CAT_KENWOOD 0 /* Text commands ending with ';' */
+#define CAT_YAESU   1 /* Kenwood framing, other queries */
+#define CAT_ICOM    2 /* CI-V frames, FE FE to from command ... FD */
+
+#define CAT_ALL ((1U << CAT_CLIENTS) - 1) /* Reply goes to all clients */
+
+struct cat_request {
+  unsigned char cmd[CAT_MAX_COMMAND];
+  size_t len;
+  unsigned int to;               /* Bit per client waiting for the reply */
+  int cached;                    /* Reply goes in the cache */
+  uint64_t due;                  /* When to give up waiting for the reply */
+};
+
+/*
+ * A command whose reply is cached, without CI-V preamble, addresses and
+ * end byte
+ */
+struct cat_query {
+  unsigned char cmd[CAT_MAX_COMMAND];
+  size_t len;
+};
+
+struct cat_entry {
+  unsigned char cmd[CAT_MAX_COMMAND];
+  size_t len;
+  unsigned char reply[CAT_MAX_COMMAND];
+  size_t replylen;
+  uint64_t time;                 /* When the reply came, 0 if unused */
+};
+
+struct cat_client {
+  unsigned char cmd[CAT_MAX_COMMAND]; /* Command being framed */
+  size_t len;
+  int done;                      /* Framed, waiting for room in the queue */
+};
+
+/*
+ * A reply for one or more clients
+ */
+struct cat_reply {
+  unsigned int to;               /* Bit per client */
+  const unsigned char *data;     /* Valid until next call */
+  size_t len;
+};
+
+struct cat {
+  int protocol;                  /* CAT_* */
+  uint64_t ttl;                  /* How long replies are cached, ns, 0 for not at all */
+  struct cat_query queries[CAT_QUERIES];
+  int numqueries;
+  struct cat_entry cache[CAT_CACHE];
+  struct cat_client clients[CAT_CLIENTS];
+  int numclients;
+  int next;                      /* Client whose turn it is */
+  struct cat_request inflight[CAT_INFLIGHT]; /* Oldest first */
+  int numinflight;
+  unsigned char reply[CAT_MAX_COMMAND]; /* Reply being received from the radio */
+  size_t replylen;
+  unsigned long commands;        /* Commands sent to the radio */
+  unsigned long hits;            /* Queries answered from the cache */
+  unsigned long joined;          /* Queries that waited for the same query in flight */
+  unsigned long replies;         /* Replies matched to a command */
+  unsigned long unsolicited;     /* Replies nobody asked for */
+  unsigned long timeouts;        /* Commands given up on */
+  unsigned long discarded;       /* Malformed commands and stray bytes */
+};
+
+int cat_protocol(const char *name);
+int cat_init(struct cat *c, int protocol, uint64_t ttl, int numclients, const char *queries);
+int cat_frame(struct cat *c, struct ringbuf in[], struct ringbuf *radio, uint64_t now, struct cat_reply *r);
+int cat_pending(const struct cat *c);
+int cat_receive(struct cat *c, const unsigned char **data, size_t *len, uint64_t now, struct cat_reply *r);
+void cat_flush(struct cat *c);
+void cat_forget(struct cat *c, int client);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks of the parts that can be run without a device
+ *
+ * Capture round trip: writes numbered records into a capture ring, replays
+ * it and checks that the newest records come back, in order and without
+ * gaps, and that the ring was filled as far as the record size allows.
+ * Record sizes include ones that exactly tile the data area and ones that
+ * leave a tail too short for a record header.
+ *
+ * CAT cache: checks that a command that isn't a query, even one with
+ * nothing but its name, empties the cache and isn't waiting for a reply.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "capture.h"
+#include "ringbuf.h"
+#include "cat.h"
+
+#define CHECK_SIZE 65536 /* Data area of the capture */
+#define RECORD_HEADER sizeof(struct capture_record)
+
+/*
+ * Write count records of len bytes, and check what is replayed
+ *
+ * Returns 0 if all is well, 1 if not.
+ */
+int check_round_trip(const char *path, size_t len, uint32_t count)
+{
+  struct capture cap;
+  const struct capture_record *rec;
+  const unsigned char *data;
+  unsigned char payload[256];
+  struct iovec iov = {payload, len};
+  size_t recsize = (RECORD_HEADER + len + 7) & ~(size_t)7;
+  uint32_t expected = count < CHECK_SIZE / recsize ? count : CHECK_SIZE / recsize;
+  uint32_t seq = 0;
+  uint32_t got = 0;
+  uint32_t i;
+
+  capture_open(&cap, path, CHECK_SIZE, 0, 0);
+  memset(payload, 0, sizeof(payload));
+  for (i = 0; i < count; i++) {
+    memcpy(payload, &i, sizeof(i));
+    capture_write(&cap, CAPTURE_TX, &iov, 1, i);
+  }
+  capture_close(&cap);
+
+  replay_open(&cap, path);
+  while ((rec = replay_next(&cap, &data))) {
+    memcpy(&seq, data, sizeof(seq));
+    if (rec->len != len || seq != count - expected + got || rec->time != seq) {
+      printf("len %zu count %u: record %u is %u, expected %u\n", len, count, got, seq, count - expected + got);
+      capture_close(&cap);
+      return 1;
+    }
+    got++;
+  }
+  capture_close(&cap);
+  if (got != expected) {
+    printf("len %zu count %u: replayed %u records, expected %u\n", len, count, got, expected);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Pass a command from the client to the radio
+ *
+ * Returns what was sent to the radio, "" if it was answered from the
+ * cache.
+ */
+static const char *cat_command(struct cat *c, struct ringbuf *in, struct ringbuf *radio, const char *cmd, uint64_t now)
+{
+  static char sent[CAT_MAX_COMMAND + 1];
+  struct cat_reply r;
+  size_t len;
+
+  ringbuf_put(in, (const unsigned char *)cmd, strlen(cmd));
+  while (cat_frame(c, in, radio, now, &r))
+    ;
+  len = ringbuf_get(radio, (unsigned char *)sent, CAT_MAX_COMMAND);
+  sent[len] = '\0';
+  return sent;
+}
+
+/*
+ * Pass a reply from the radio to the client
+ */
+static void cat_answer(struct cat *c, const char *reply, uint64_t now)
+{
+  const unsigned char *data = (const unsigned char *)reply;
+  size_t len = strlen(reply);
+  struct cat_reply r;
+
+  while (cat_receive(c, &data, &len, now, &r))
+    ;
+}
+
+/*
+ * Check that a frequency change between two reads makes the second one go
+ * to the radio
+ *
+ * Returns 0 if all is well, 1 if not.
+ */
+int check_cat_flush(void)
+{
+  static struct cat c;
+  struct ringbuf in, radio;
+  uint64_t now = 1000000000;
+  const char *sent;
+  int failed = 0;
+
+  ringbuf_init(&in, 1024);
+  ringbuf_init(&radio, 1024);
+  cat_init(&c, CAT_KENWOOD, 1000000000, 1, NULL);
+
+  cat_command(&c, &in, &radio, "FA;", now);
+  cat_answer(&c, "FA00014074000;", now + 1000);
+  if (*cat_command(&c, &in, &radio, "FA;", now + 2000)) {
+    printf("CAT: FA; not answered from the cache\n");
+    failed = 1;
+  }
+  cat_command(&c, &in, &radio, "UP;", now + 3000);
+  if (c.numinflight) {
+    printf("CAT: UP; is waiting for a reply\n");
+    failed = 1;
+  }
+  if (strcmp(sent = cat_command(&c, &in, &radio, "FA;", now + 4000), "FA;")) {
+    printf("CAT: FA; after UP; sent \"%s\", expected \"FA;\"\n", sent);
+    failed = 1;
+  }
+
+  ringbuf_free(&in);
+  ringbuf_free(&radio);
+  return failed;
+}
+
+int main(int argc, char *argv[])
+{
+  static const size_t lens[] = {8, 16, 20, 24, 40, 100, 248};
+  static const uint32_t counts[] = {1, 1000, 2047, 2048, 2049, 4096, 4097, 10000};
+  char path[] = "/tmp/microkeyer-check-XXXXXX";
+  int failed = 0;
+  int fd;
+  size_t i, j;
+
+  if ((fd = mkstemp(path)) == -1) {
+    perror("Can't create capture file");
+    exit(1);
+  }
+  close(fd);
+  for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    for (j = 0; j < sizeof(counts) / sizeof(counts[0]); j++)
+      failed |= check_round_trip(path, lens[i], counts[j]);
+  unlink(path);
+  printf("Capture round trip: %s\n", failed ? "FAILED" : "ok");
+  if (check_cat_flush()) {
+    printf("CAT cache: FAILED\n");
+    failed = 1;
+  }
+  else
+    printf("CAT cache: ok\n");
+  return failed;
+}
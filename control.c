@@ -0,0 +1,278 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "microkeyer.h"
+#include "log.h"
+#include "control.h"
+
+/*
+ * Length of a command from the computer, 0 if it is only known from the
+ * end byte
+ */
+int control_command_length(unsigned char cmd)
+{
+  switch (cmd) {
+  case CONTROL_NOP:
+    return 1;
+  case CONTROL_SET_R1_RADIO_CHANNEL:
+  case CONTROL_SET_R2_RADIO_CHANNEL:
+  case CONTROL_SET_R1_FSK_CHANNEL:
+  case CONTROL_SET_R2_FSK_CHANNEL:
+    return 5; // Divisor LSB, MSB and SS byte may be anything
+  case CONTROL_GET_VERSION:
+  case CONTROL_START_BOOTLOADER:
+  case CONTROL_ARE_YOU_THERE:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Length of a reply from the device, 0 if it is only known from the end
+ * byte
+ */
+static int reply_length(unsigned char cmd)
+{
+  switch (cmd) {
+  case CONTROL_SET_R1_RADIO_CHANNEL:
+  case CONTROL_SET_R2_RADIO_CHANNEL:
+  case CONTROL_SET_R1_FSK_CHANNEL:
+  case CONTROL_SET_R2_FSK_CHANNEL:
+    return 5; // Echo of the command
+  case CONTROL_ARE_YOU_THERE:
+    return 2;
+  case CONTROL_COMMAND_NOT_SUPPORTED:
+    return 3; // The command byte that wasn't supported
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Is this a whole, well formed command?
+ *
+ * Only commands framed by their end byte can't contain it.
+ */
+static int command_valid(const unsigned char *cmd, size_t len)
+{
+  int fixed;
+
+  if (!len || len > CONTROL_MAX_COMMAND || (cmd[0] & CONTROL_END_COMMAND))
+    return 0;
+  if ((fixed = control_command_length(cmd[0])))
+    return len == (size_t)fixed && (len == 1 || cmd[len - 1] == (cmd[0] | CONTROL_END_COMMAND));
+  return len >= 2 && cmd[len - 1] == (cmd[0] | CONTROL_END_COMMAND);
+}
+
+void control_init(struct control *c)
+{
+  memset(c, 0, sizeof(*c));
+}
+
+/*
+ * Queue a whole command and wait for the reply
+ *
+ * NOPs aren't answered, so they aren't waited for. If too many commands
+ * are in flight, commands from the control pty are sent without waiting
+ * for the reply, which then goes to the pty as if nobody asked for it.
+ * Returns 0 on success, -1 if the command is malformed or there is no room
+ * for it.
+ */
+int control_send(struct control *c, struct txqueues *q, const unsigned char *cmd, size_t len, int from, uint64_t now)
+{
+  struct control_request *req;
+
+  if (!command_valid(cmd, len) || !command_room(q, len))
+    return -1;
+  if (cmd[0] != CONTROL_NOP) {
+    if (c->numinflight < CONTROL_INFLIGHT) {
+      req = &c->inflight[c->numinflight++];
+      req->cmd = cmd[0];
+      req->from = from;
+      req->due = now + CONTROL_REPLY_WAIT;
+    }
+    else if (from != COMMAND_FROM_PTY)
+      return -1;
+  }
+  queue_command(q, cmd, len);
+  c->commands++;
+  debugprintf(7, "Control command %02x, %zu bytes, %i in flight.\n", cmd[0], len, c->numinflight);
+  return 0;
+}
+
+/*
+ * Frame the bytes written to the control pty into commands and queue them
+ *
+ * Bytes that can't start a command are discarded. A command that doesn't
+ * fit in the queue is kept until there is room for it, and input from the
+ * pty is held back meanwhile.
+ */
+void control_frame_pty(struct control *c, struct txqueues *q, uint64_t now)
+{
+  unsigned char data;
+  int fixed;
+
+  for (;;) {
+    if (c->ptydone) {
+      if (control_send(c, q, c->pty, c->ptylen, COMMAND_FROM_PTY, now))
+	return;
+      c->ptydone = 0;
+      c->ptylen = 0;
+    }
+    if (!ringbuf_get(&q->control, &data, 1))
+      return;
+    if (!c->ptylen && (data & CONTROL_END_COMMAND)) {
+      debugprintf(2, "Byte %02x from control pty is not a command, discarded\n", data);
+      c->discarded++;
+      continue;
+    }
+    c->pty[c->ptylen++] = data;
+    fixed = control_command_length(c->pty[0]);
+    if (fixed ? c->ptylen == (size_t)fixed : c->ptylen > 1 && data == (c->pty[0] | CONTROL_END_COMMAND)) {
+      if (command_valid(c->pty, c->ptylen))
+	c->ptydone = 1;
+      else {
+	debugprintf(2, "Malformed command %02x from control pty discarded\n", c->pty[0]);
+	c->discarded++;
+	c->ptylen = 0;
+      }
+    }
+    else if (c->ptylen == CONTROL_MAX_COMMAND) {
+      debugprintf(2, "Command %02x from control pty too long, discarded\n", c->pty[0]);
+      c->discarded++;
+      c->ptylen = 0;
+    }
+  }
+}
+
+/*
+ * Remove a request from the in-flight table
+ */
+static void remove_request(struct control *c, int i)
+{
+  c->numinflight--;
+  memmove(&c->inflight[i], &c->inflight[i + 1], (c->numinflight - i) * sizeof(c->inflight[0]));
+}
+
+/*
+ * Find who a complete reply is for
+ */
+static void match_reply(struct control *c, struct control_reply *r)
+{
+  int i;
+
+  r->to = COMMAND_FROM_PTY;
+  r->status = REPLY_OK;
+  r->cmd = c->reply[0];
+  r->data = c->reply;
+  r->len = c->replylen;
+  if (r->cmd == CONTROL_COMMAND_NOT_SUPPORTED && r->len == 3) {
+    r->status = REPLY_UNSUPPORTED;
+    r->cmd = c->reply[1];
+  }
+  c->replylen = 0;
+
+  for (i = 0; i < c->numinflight; i++)
+    if (c->inflight[i].cmd == r->cmd)
+      break;
+  if (i == c->numinflight) {
+    debugprintf(7, "Control message %02x from device not asked for.\n", c->reply[0]);
+    c->unsolicited++;
+    return;
+  }
+  r->to = c->inflight[i].from;
+  if (r->status == REPLY_UNSUPPORTED)
+    c->unsupported++;
+  else
+    c->replies++;
+  remove_request(c, i);
+}
+
+/*
+ * Take control channel bytes from the device until a reply is complete
+ *
+ * The bytes are consumed from *data. Returns 1 and fills in r when a reply
+ * is complete, or 0 when all bytes are consumed. Bytes that can't start a
+ * reply are passed on to the control pty one by one.
+ */
+int control_receive(struct control *c, const unsigned char **data, size_t *len, struct control_reply *r)
+{
+  unsigned char byte;
+  int fixed;
+
+  while (*len) {
+    byte = *(*data)++;
+    (*len)--;
+    c->reply[c->replylen++] = byte;
+    if (c->replylen == 1 && (byte & CONTROL_END_COMMAND)) {
+      match_reply(c, r);
+      return 1;
+    }
+    fixed = reply_length(c->reply[0]);
+    if ((fixed ? c->replylen == (size_t)fixed : c->replylen > 1 && byte == (c->reply[0] | CONTROL_END_COMMAND)) || c->replylen == CONTROL_MAX_COMMAND) {
+      match_reply(c, r);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Give up on the oldest command if its reply is overdue
+ *
+ * Returns 1 and fills in r if a command was given up on, 0 otherwise.
+ */
+int control_expire(struct control *c, uint64_t now, struct control_reply *r)
+{
+  if (!c->numinflight || c->inflight[0].due > now)
+    return 0;
+  debugprintf(2, "No reply to control command %02x.\n", c->inflight[0].cmd);
+  r->to = c->inflight[0].from;
+  r->status = REPLY_TIMEOUT;
+  r->cmd = c->inflight[0].cmd;
+  r->data = NULL;
+  r->len = 0;
+  c->timeouts++;
+  remove_request(c, 0);
+  return 1;
+}
+
+/*
+ * When the oldest command in flight is given up on, 0 if none
+ */
+uint64_t control_deadline(const struct control *c)
+{
+  return c->numinflight ? c->inflight[0].due : 0;
+}
+
+/*
+ * Drop replies to a client that has gone away
+ *
+ * The commands are still in flight, so the replies are matched correctly.
+ */
+void control_forget(struct control *c, int from)
+{
+  int i;
+
+  for (i = 0; i < c->numinflight; i++)
+    if (c->inflight[i].from == from)
+      c->inflight[i].from = COMMAND_FROM_GONE;
+}
@@ -0,0 +1,92 @@
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "encoder.h"
+
+/*
+ * Control channel command engine
+ *
+ * Commands come from the control pty, from command socket clients and
+ * from the daemon itself. Each is framed as a whole before it is queued,
+ * so the device is told exactly where it starts and ends, and several can
+ * be in flight at once. Replies from the device are matched to the oldest
+ * command in flight with the same command byte, or for
+ * CONTROL_COMMAND_NOT_SUPPORTED, the byte it names. Replies nobody asked
+ * for go to the control pty.
+ *
+ * Most commands end with the command byte with CONTROL_END_COMMAND set,
+ * but commands with a fixed length may contain that byte, and are framed
+ * by length instead.
+ */
+
+#define CONTROL_MAX_COMMAND 256        /* Longest command or reply */
+#define CONTROL_INFLIGHT    32         /* Commands waiting for a reply */
+#define CONTROL_REPLY_WAIT  1000000000ULL /* How long to wait for a reply, ns */
+
+/*
+ * Who a command is from, and who gets the reply
+ *
+ * Command socket clients are numbered from 0.
+ */
+#define COMMAND_FROM_PTY    -1
+#define COMMAND_FROM_DAEMON -2
+#define COMMAND_FROM_GONE   -3 /* Client has disconnected, drop the reply */
+
+/*
+ * Outcome of a command
+ *
+ * On the command socket, each command written as one message is answered
+ * by one message: the status, the command byte, and for REPLY_OK and
+ * REPLY_UNSUPPORTED the whole reply from the device. Replies may come
+ * in a different order than the commands when their command bytes differ.
+ */
+#define REPLY_OK          0 /* Device replied */
+#define REPLY_UNSUPPORTED 1 /* Device replied CONTROL_COMMAND_NOT_SUPPORTED */
+#define REPLY_TIMEOUT     2 /* No reply in time */
+#define REPLY_REJECTED    3 /* Malformed command, or no room to queue it */
+
+struct control_request {
+  unsigned char cmd;             /* Command byte */
+  int from;                      /* COMMAND_FROM_* or client number */
+  uint64_t due;                  /* When to give up waiting for the reply */
+};
+
+/*
+ * A finished command, or data the device sent unasked
+ */
+struct control_reply {
+  int to;                        /* COMMAND_FROM_* or client number */
+  int status;                    /* REPLY_* */
+  unsigned char cmd;             /* Command byte */
+  const unsigned char *data;     /* Reply from the device, valid until next call */
+  size_t len;
+};
+
+struct control {
+  struct control_request inflight[CONTROL_INFLIGHT]; /* Oldest first */
+  int numinflight;
+  unsigned char pty[CONTROL_MAX_COMMAND];   /* Command being framed from the control pty */
+  size_t ptylen;
+  int ptydone;                              /* Framed, waiting for room in the queue */
+  unsigned char reply[CONTROL_MAX_COMMAND]; /* Reply being received from the device */
+  size_t replylen;
+  unsigned long commands;        /* Commands queued */
+  unsigned long replies;         /* Replies matched to a command */
+  unsigned long unsupported;     /* Commands the device didn't support */
+  unsigned long timeouts;        /* Commands given up on */
+  unsigned long unsolicited;     /* Messages from the device nobody asked for */
+  unsigned long discarded;       /* Malformed commands from the control pty */
+};
+
+int control_command_length(unsigned char cmd);
+void control_init(struct control *c);
+int control_send(struct control *c, struct txqueues *q, const unsigned char *cmd, size_t len, int from, uint64_t now);
+void control_frame_pty(struct control *c, struct txqueues *q, uint64_t now);
+int control_receive(struct control *c, const unsigned char **data, size_t *len, struct control_reply *r);
+int control_expire(struct control *c, uint64_t now, struct control_reply *r);
+uint64_t control_deadline(const struct control *c);
+void control_forget(struct control *c, int from);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "microkeyer.h"
+#include "decoder.h"
+
+#define DECODE_DISCARD   DECODE_CHANNELS /* Scratch slot for unused bytes */
+#define SEQUENCE_UNKNOWN 5               /* Position lost, wait for next sequence */
+
+/*
+ * Bit 7 of each byte of well framed frames, clear in the synchro byte and
+ * set in the three payload bytes
+ */
+#define FRAME_MARKS_4 0xEEEEU     /* 4 frames, 16 bytes */
+#define FRAME_MARKS_8 0xEEEEEEEEU /* 8 frames, 32 bytes */
+
+/*
+ * What a synchro byte says about the rest of its frame
+ */
+struct synchro {
+  unsigned char valid[3];  /* R1, R2 and shared byte valid (0 or 1) */
+  unsigned char msb[3];    /* Bit 7 of R1, R2 and shared byte (0x00 or 0x80) */
+  unsigned char sequence;  /* Frame continues a sequence (0 or 1) */
+};
+
+static struct synchro synchro_table[128];
+
+/*
+ * Where the shared byte goes, by position in sequence
+ */
+static const unsigned char shared_channel[6] = {
+  DECODE_DISCARD,  /* FLAGS, kept in state word */
+  DECODE_CONTROL,
+  DECODE_WINKEY,
+  DECODE_KEYBOARD,
+  DECODE_DISCARD,  /* Should not happen, max 4 frames per sequence */
+  DECODE_DISCARD   /* SEQUENCE_UNKNOWN */
+};
+
+static size_t (*check_frames)(const unsigned char *buf, size_t nframes);
+
+/*
+ * Fill in the synchro byte table
+ */
+static void synchro_table_init()
+{
+  int i;
+
+  for (i = 0; i < 128; i++) {
+    synchro_table[i].valid[0] = (i & SYNCHRO_VALID_R1) ? 1 : 0;
+    synchro_table[i].valid[1] = (i & SYNCHRO_VALID_R2) ? 1 : 0;
+    synchro_table[i].valid[2] = (i & SYNCHRO_VALID_SHARED) ? 1 : 0;
+    synchro_table[i].msb[0] = (i & SYNCHRO_MSB_R1) ? 0x80 : 0x00;
+    synchro_table[i].msb[1] = (i & SYNCHRO_MSB_R2) ? 0x80 : 0x00;
+    synchro_table[i].msb[2] = (i & SYNCHRO_MSB_SHARED) ? 0x80 : 0x00;
+    synchro_table[i].sequence = (i & SYNCHRO_SEQUENCE) ? 1 : 0;
+  }
+}
+
+/*
+ * Count well framed frames, one at a time
+ */
+static size_t check_frames_scalar(const unsigned char *buf, size_t nframes)
+{
+  size_t i;
+
+  for (i = 0; i < nframes; i++, buf += 4)
+    if ((buf[0] & 0x80) || !(buf[1] & buf[2] & buf[3] & 0x80))
+      break;
+  return i;
+}
+
+#ifdef __SSE2__
+/*
+ * Count well framed frames, 4 at a time
+ */
+static size_t check_frames_sse2(const unsigned char *buf, size_t nframes)
+{
+  unsigned int bad;
+  size_t i;
+
+  for (i = 0; i + 4 <= nframes; i += 4, buf += 16) {
+    bad = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)buf)) ^ FRAME_MARKS_4;
+    if (bad)
+      return i + __builtin_ctz(bad) / 4;
+  }
+  return i + check_frames_scalar(buf, nframes - i);
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_CHECK
+/*
+ * Count well framed frames, 8 at a time
+ *
+ * Only called if the CPU has AVX2.
+ */
+__attribute__((target("avx2")))
+static size_t check_frames_avx2(const unsigned char *buf, size_t nframes)
+{
+  unsigned int bad;
+  size_t i;
+
+  for (i = 0; i + 8 <= nframes; i += 8, buf += 32) {
+    bad = (unsigned int)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)buf)) ^ FRAME_MARKS_8;
+    if (bad)
+      return i + __builtin_ctz(bad) / 4;
+  }
+  return i + check_frames_scalar(buf, nframes - i);
+}
+#endif
+
+void decoder_init(struct decoder *dec)
+{
+  if (!synchro_table[SYNCHRO_VALID_R1].valid[0])
+    synchro_table_init();
+  if (!check_frames) {
+    check_frames = check_frames_scalar;
+#ifdef __SSE2__
+    check_frames = check_frames_sse2;
+#endif
+#ifdef HAVE_AVX2_CHECK
+    if (__builtin_cpu_supports("avx2"))
+      check_frames = check_frames_avx2;
+#endif
+  }
+  dec->sequencepos = 0;
+  dec->flags = 0;
+  dec->synced = 1;
+  dec->overlong = 0;
+  dec->resyncs = 0;
+  dec->skipped = 0;
+}
+
+/*
+ * Count the well framed frames at the start of buf
+ *
+ * Only the synchro byte of a frame has bit 7 clear. A lost or duplicated
+ * byte shows up as a frame where that isn't so, at the latest one frame
+ * later.
+ */
+size_t decoder_check(const unsigned char *buf, size_t nframes)
+{
+  return check_frames(buf, nframes);
+}
+
+/*
+ * Find where the next frame may start after a framing error at buf[0]
+ *
+ * That is the next synchro byte followed by three payload bytes, or one
+ * that still may be when buf ends first. Returns the number of bytes to
+ * skip, at least 1. The position in the sequence is lost, so shared bytes
+ * are discarded until the next sequence starts.
+ */
+size_t decoder_resync(struct decoder *dec, const unsigned char *buf, size_t len)
+{
+  size_t i, j;
+
+  if (dec->synced) {
+    dec->synced = 0;
+    dec->resyncs++;
+  }
+  dec->sequencepos = SEQUENCE_UNKNOWN;
+  for (i = 1; i < len; i++) {
+    if (buf[i] & 0x80)
+      continue;
+    for (j = 1; j < 4 && i + j < len && (buf[i + j] & 0x80); j++)
+      ;
+    if (j == 4 || i + j == len)
+      break;
+  }
+  dec->skipped += i;
+  return i;
+}
+
+/*
+ * Decode a batch of 4 octet frames
+ *
+ * Payload bytes are scattered into the per-channel arrays of out, which are
+ * appended to. Every byte is written to its array whether it is valid or
+ * not, and the length is only advanced for valid ones, so there are no data
+ * dependent branches in the loop. The frames must have passed
+ * decoder_check().
+ */
+void decoder_run(struct decoder *dec, const unsigned char *buf, size_t nframes, struct decoded *out)
+{
+  unsigned char discard[1];
+  unsigned char *data[DECODE_CHANNELS + 1];
+  size_t len[DECODE_CHANNELS + 1];
+  unsigned int pos = dec->sequencepos;
+  uint32_t flags = dec->flags;
+  unsigned long overlong = dec->overlong;
+  size_t i;
+  int c;
+
+  for (c = 0; c < DECODE_CHANNELS; c++) {
+    data[c] = out->data[c];
+    len[c] = out->len[c];
+  }
+  data[DECODE_DISCARD] = discard;
+  len[DECODE_DISCARD] = 0;
+
+  for (i = 0; i < nframes; i++, buf += 4) {
+    const struct synchro *s = &synchro_table[buf[0] & 0x7F];
+    unsigned char shared;
+    unsigned int target;
+    unsigned int valid;
+    unsigned int shift;
+    uint32_t mask;
+
+    // A frame with SYNCHRO_SEQUENCE cleared starts a new sequence
+    pos &= -(unsigned int)s->sequence;
+
+    data[DECODE_R1][len[DECODE_R1]] = (buf[1] & 0x7F) | s->msb[0];
+    len[DECODE_R1] += s->valid[0];
+    data[DECODE_R2][len[DECODE_R2]] = (buf[2] & 0x7F) | s->msb[1];
+    len[DECODE_R2] += s->valid[1];
+
+    // The control byte is always valid, but NOPs from the device are ignored
+    shared = (buf[3] & 0x7F) | s->msb[2];
+    target = shared_channel[pos];
+    valid = (s->valid[2] | (pos == 1)) & (target != DECODE_DISCARD) & ((target != DECODE_CONTROL) | (shared != 0));
+    data[target][len[target]] = shared;
+    len[target] += valid;
+
+    // Fold FLAGS into the state word, R1 or R2 half selected by FLAGS_IS_R2
+    shift = shared & FLAGS_IS_R2; // 0 or 8
+    mask = (uint32_t)0xFF << shift;
+    mask &= -(uint32_t)(s->valid[2] & (pos == 0));
+    flags = (flags & ~mask) | (((uint32_t)(shared & ~FLAGS_IS_R2) << shift) & mask);
+
+    overlong += (pos == 4);
+    pos += (pos < 4);
+  }
+  if (nframes)
+    dec->synced = 1;
+
+  for (c = 0; c < DECODE_CHANNELS; c++)
+    out->len[c] = len[c];
+  dec->sequencepos = pos;
+  dec->flags = flags;
+  dec->overlong = overlong;
+}
@@ -0,0 +1,52 @@
+#ifndef _DECODER_H
+#define _DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Channels in decoder output
+ */
+#define DECODE_R1        0
+#define DECODE_R2        1
+#define DECODE_CONTROL   2
+#define DECODE_WINKEY    3
+#define DECODE_KEYBOARD  4
+#define DECODE_CHANNELS  5
+
+/*
+ * Flag state word: flags byte from the device for R1 in bits 0-7 and for R2
+ * in bits 8-15, FLAGS_IS_R2 masked out
+ */
+#define DECODER_FLAGS_R1(flags) ((flags) & 0xFF)
+#define DECODER_FLAGS_R2(flags) (((flags) >> 8) & 0xFF)
+
+/*
+ * Decoder state carried from one batch of frames to the next
+ */
+struct decoder {
+  unsigned int sequencepos; /* Position of next frame in its sequence */
+  uint32_t flags;           /* Flag state word */
+  int synced;               /* Last frame was well framed */
+  unsigned long overlong;   /* Frames beyond the 4th in a sequence */
+  unsigned long resyncs;    /* Times framing was lost */
+  unsigned long skipped;    /* Bytes skipped to find the next frame */
+};
+
+/*
+ * Decoder output, one array per channel
+ *
+ * Output is appended to the arrays, so each must have room for as many
+ * more bytes as there are frames in the batch.
+ */
+struct decoded {
+  unsigned char *data[DECODE_CHANNELS];
+  size_t len[DECODE_CHANNELS];
+};
+
+void decoder_init(struct decoder *dec);
+size_t decoder_check(const unsigned char *buf, size_t nframes);
+size_t decoder_resync(struct decoder *dec, const unsigned char *buf, size_t len);
+void decoder_run(struct decoder *dec, const unsigned char *buf, size_t nframes, struct decoded *out);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "microkeyer.h"
+#include "device.h"
+
+/*
+ * Empty sequence, no channels valid
+ */
+void devseq_init(struct devseq *ds)
+{
+  ds->n1 = 0;
+  ds->n2 = 0;
+  ds->flags = -1;
+  ds->control = -1;
+  ds->winkey = -1;
+  ds->keyboard = -1;
+}
+
+/*
+ * Encode a sequence as the device would send it
+ *
+ * Only as many frames as necessary are used. The control slot is always
+ * present in sequences of 2 or more frames, so it carries a NOP if there is
+ * no control data. Returns the number of bytes written to buf (max 16).
+ */
+size_t device_encode(const struct devseq *ds, unsigned char *buf)
+{
+  int shared[4];
+  int numframes = 1;
+  int i;
+
+  shared[0] = ds->flags;
+  shared[1] = ds->control;
+  shared[2] = ds->winkey;
+  shared[3] = ds->keyboard;
+  for (i = 1; i < 4; i++)
+    if (shared[i] >= 0)
+      numframes = i + 1;
+  if (ds->n1 > numframes)
+    numframes = ds->n1;
+  if (ds->n2 > numframes)
+    numframes = ds->n2;
+
+  for (i = 0; i < numframes; i++) {
+    unsigned char *frame = buf + 4*i;
+
+    frame[0] = i ? SYNCHRO_SEQUENCE : 0x00;
+    frame[1] = 0x80;
+    frame[2] = 0x80;
+    frame[3] = 0x80;
+    if (i < ds->n1) {
+      frame[0] |= SYNCHRO_VALID_R1 | ((ds->r1[i] & 0x80) ? SYNCHRO_MSB_R1 : 0x00);
+      frame[1] |= ds->r1[i];
+    }
+    if (i < ds->n2) {
+      frame[0] |= SYNCHRO_VALID_R2 | ((ds->r2[i] & 0x80) ? SYNCHRO_MSB_R2 : 0x00);
+      frame[2] |= ds->r2[i];
+    }
+    if (shared[i] >= 0) {
+      frame[0] |= SYNCHRO_VALID_SHARED | ((shared[i] & 0x80) ? SYNCHRO_MSB_SHARED : 0x00);
+      frame[3] |= shared[i];
+    }
+  }
+
+  return numframes * 4;
+}
+
+void device_decoder_init(struct device_decoder *dd)
+{
+  dd->sequencepos = 0;
+  dd->flags = 0;
+  dd->flagframes = 0;
+}
+
+/*
+ * Decode frames as the device would receive them
+ *
+ * Frame 0 of a sequence carries FLAGS, frame 1 control, frame 2 Winkey and
+ * frames 3 and 4 FSK1 and FSK2. Both radio channels have a byte in each
+ * frame. The control byte is always taken, but NOPs are dropped. Output is
+ * appended to the per-channel arrays.
+ */
+void device_decode(struct device_decoder *dd, const unsigned char *buf, size_t nframes, unsigned char *data[DEVICE_CHANNELS], size_t len[DEVICE_CHANNELS])
+{
+  static const int shared_channel[5] = {-1, DEVICE_CONTROL, DEVICE_WINKEY, DEVICE_FSK1, DEVICE_FSK2};
+  size_t i;
+
+  for (i = 0; i < nframes; i++, buf += 4) {
+    unsigned char shared;
+
+    if (!(buf[0] & 0xC0))
+      dd->sequencepos = 0;
+    if (buf[0] & SYNCHRO_VALID_R1)
+      data[DEVICE_R1][len[DEVICE_R1]++] = (buf[1] & 0x7F) | ((buf[0] & SYNCHRO_MSB_R1) ? 0x80 : 0x00);
+    if (buf[0] & SYNCHRO_VALID_R2)
+      data[DEVICE_R2][len[DEVICE_R2]++] = (buf[2] & 0x7F) | ((buf[0] & SYNCHRO_MSB_R2) ? 0x80 : 0x00);
+    shared = (buf[3] & 0x7F) | ((buf[0] & SYNCHRO_MSB_SHARED) ? 0x80 : 0x00);
+    if (dd->sequencepos == 0 && (buf[0] & SYNCHRO_VALID_SHARED)) {
+      dd->flags = shared;
+      dd->flagframes++;
+    }
+    else if (dd->sequencepos == 1) {
+      if (shared) // Start and end bytes of commands are not marked valid
+	data[DEVICE_CONTROL][len[DEVICE_CONTROL]++] = shared;
+    }
+    else if (dd->sequencepos < 5 && (buf[0] & SYNCHRO_VALID_SHARED))
+      data[shared_channel[dd->sequencepos]][len[shared_channel[dd->sequencepos]]++] = shared;
+    dd->sequencepos++;
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef _DEVICE_H
+#define _DEVICE_H
+
+#include <stddef.h>
+
+/*
+ * Device side of the protocol, for tools that stand in for a keyer
+ */
+
+/*
+ * Contents of one sequence from device to computer
+ *
+ * The radio channels carry up to one byte per frame. Unused shared channel
+ * slots are -1.
+ */
+struct devseq {
+  unsigned char r1[4];
+  int n1;
+  unsigned char r2[4];
+  int n2;
+  int flags;    /* FLAGS_* byte, FLAGS_IS_R2 selects radio */
+  int control;
+  int winkey;
+  int keyboard;
+};
+
+/*
+ * Channels in sequences from computer to device
+ */
+#define DEVICE_R1       0
+#define DEVICE_R2       1
+#define DEVICE_CONTROL  2
+#define DEVICE_WINKEY   3
+#define DEVICE_FSK1     4
+#define DEVICE_FSK2     5
+#define DEVICE_CHANNELS 6
+
+/*
+ * State for decoding sequences from computer to device
+ */
+struct device_decoder {
+  unsigned int sequencepos; /* Position of next frame in its sequence */
+  unsigned char flags;      /* Last FLAGS_* byte received */
+  unsigned long flagframes; /* Number of FLAGS bytes received */
+};
+
+void devseq_init(struct devseq *ds);
+size_t device_encode(const struct devseq *ds, unsigned char *buf);
+void device_decoder_init(struct device_decoder *dd);
+void device_decode(struct device_decoder *dd, const unsigned char *buf, size_t nframes, unsigned char *data[DEVICE_CHANNELS], size_t len[DEVICE_CHANNELS]);
+
+#endif
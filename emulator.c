@@ -0,0 +1,834 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * microKEYER emulator
+ *
+ * Stands in for a keyer on a pty. Radio and Winkey data is echoed, or
+ * answered from a script, control commands are answered, and FLAGS are
+ * reported. The link is paced at the keyer's line rate.
+ *
+ * Unless only the emulator is asked for, the daemon is started on the pty,
+ * and numbered probes are sent through it on each channel to measure round
+ * trip latency and count lost and corrupted data.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "microkeyer.h"
+#include "ringbuf.h"
+#include "decoder.h"
+#include "control.h"
+#include "device.h"
+#include "spawn.h"
+
+#define EMU_BUF_SIZE    16384     /* Must be a power of two */
+#define LINK_BURST      64        /* Bytes the link may pass back to back */
+#define FLAGS_INTERVAL  100000000ULL /* ns between unsolicited FLAGS */
+#define EMU_VERSION     "EMU 1.0" /* Answer to CONTROL_GET_VERSION */
+#define MAX_SCRIPT      256       /* Lines in a reply script */
+#define MAX_LINE        256       /* Length of CAT commands and control commands */
+#define DRAIN_NS        500000000ULL /* Time to wait for probes in flight at the end */
+
+#define PROBE_LEN       10        /* "P%08X;" */
+#define MAX_OUTSTANDING 1024      /* Probes in flight per channel */
+#define HIST_BUCKETS    10000     /* Latency histogram buckets */
+#define HIST_NS         10000ULL  /* Width of a bucket, 10 us */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/*
+ * One direction of the serial link
+ */
+struct link {
+  uint64_t busy; /* When the bytes passed so far have been sent at link rate */
+  int active;    /* Bytes are on their way */
+};
+
+/*
+ * Reading a stream of probes
+ */
+struct probe_parser {
+  char text[PROBE_LEN + 1];
+  size_t len;
+  uint32_t expect;        /* Next sequence number expected */
+  unsigned long received;
+  unsigned long lost;
+  unsigned long corrupt;
+};
+
+/*
+ * Latency distribution
+ */
+struct histogram {
+  unsigned long count[HIST_BUCKETS + 1]; /* Last bucket is overflow */
+  unsigned long total;
+  uint64_t max;
+};
+
+/*
+ * Probes through one client channel
+ */
+struct prober {
+  int fd;                           /* Client pty */
+  const char *name;
+  int control;                      /* Probes are CONTROL_ARE_YOU_THERE commands */
+  uint32_t next;                    /* Sequence number of next probe */
+  uint64_t sent[MAX_OUTSTANDING];   /* When probes were queued */
+  struct ringbuf out;               /* Not yet written to the pty */
+  struct probe_parser parser;
+  struct histogram hist;
+};
+
+/*
+ * The emulated device
+ */
+struct emulator {
+  int fd;                              /* Device side of the pty pair */
+  int model;
+  struct link up;                      /* Device to computer */
+  struct link down;                    /* Computer to device */
+  struct ringbuf rx;                   /* Frames from computer, not yet decoded */
+  struct ringbuf tx;                   /* Frames to computer, not yet sent */
+  struct ringbuf out[DECODE_CHANNELS]; /* Data for the computer, not yet framed */
+  struct device_decoder dd;
+  unsigned char hostflags;             /* Last FLAGS from computer */
+  int flagsdue;                        /* Bit 0: R1 FLAGS due, bit 1: R2 */
+  uint64_t nextflags;                  /* When to report FLAGS again */
+  unsigned char cmd[MAX_LINE];         /* Control command being received */
+  size_t cmdlen;
+  char line[2][MAX_LINE];              /* CAT command being received per radio */
+  size_t linelen[2];
+  struct prober *fsk[2];               /* Probes expected on FSK channels, or NULL */
+};
+
+/*
+ * Scripted radio replies
+ */
+struct reply {
+  char *query;
+  char *answer;
+};
+
+struct reply script[MAX_SCRIPT];
+int scriptlen = 0;
+int fullspeed = 0;
+volatile sig_atomic_t stop = 0;
+
+uint64_t monotonic_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t link_ns(size_t bytes)
+{
+  return (uint64_t)bytes * 1000000000ULL / KEYER_BYTES_PER_SEC;
+}
+
+/*
+ * Number of bytes the link has sent and not yet passed on
+ *
+ * A link that was idle starts sending now.
+ */
+size_t link_allowance(struct link *l, uint64_t now)
+{
+  if (fullspeed)
+    return EMU_BUF_SIZE;
+  if (!l->active) {
+    l->busy = now;
+    l->active = 1;
+  }
+  if (now <= l->busy)
+    return 0;
+  return MIN((now - l->busy) * KEYER_BYTES_PER_SEC / 1000000000ULL, EMU_BUF_SIZE);
+}
+
+/*
+ * May bytes be passed on?
+ *
+ * They are passed on in chunks of up to LINK_BURST bytes, like a USB
+ * serial converter does
+ */
+int link_ready(struct link *l, size_t allowance, size_t pending)
+{
+  return allowance && (fullspeed || allowance >= MIN(pending, LINK_BURST));
+}
+
+/*
+ * When the next chunk will have been sent
+ */
+uint64_t link_next(struct link *l, size_t pending)
+{
+  return l->busy + link_ns(MIN(pending, LINK_BURST));
+}
+
+void link_consume(struct link *l, size_t bytes)
+{
+  l->busy += link_ns(bytes);
+}
+
+void link_idle(struct link *l)
+{
+  l->active = 0;
+}
+
+/*
+ * Feed one byte of a probe stream to a parser
+ *
+ * Returns 1 and the sequence number when a well formed probe is complete.
+ * Malformed and out of order probes are counted as corrupted, and skipped
+ * sequence numbers as lost.
+ */
+int probe_parse(struct probe_parser *p, unsigned char c, uint32_t *seq)
+{
+  char *end;
+
+  if (c != ';') {
+    if (p->len == PROBE_LEN - 1) {
+      p->corrupt++;
+      p->len = 0;
+    }
+    p->text[p->len++] = c;
+    return 0;
+  }
+  p->text[p->len] = '\0';
+  if (p->len != PROBE_LEN - 1 || p->text[0] != 'P') {
+    p->corrupt++;
+    p->len = 0;
+    return 0;
+  }
+  p->len = 0;
+  *seq = strtoul(p->text + 1, &end, 16);
+  if (*end || (int32_t)(*seq - p->expect) < 0) {
+    p->corrupt++;
+    return 0;
+  }
+  p->lost += *seq - p->expect;
+  p->expect = *seq + 1;
+  p->received++;
+  return 1;
+}
+
+void histogram_add(struct histogram *h, uint64_t ns)
+{
+  uint64_t bucket = ns / HIST_NS;
+
+  h->count[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS]++;
+  h->total++;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+/*
+ * Upper bound of the given percentile, in ns
+ */
+uint64_t histogram_percentile(struct histogram *h, double pct)
+{
+  unsigned long target = h->total * pct / 100.0;
+  unsigned long sum = 0;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    sum += h->count[i];
+    if (sum > target)
+      return (i + 1) * HIST_NS;
+  }
+  return h->max;
+}
+
+void prober_init(struct prober *p, int fd, const char *name, int control)
+{
+  p->fd = fd;
+  p->name = name;
+  p->control = control;
+  p->next = 0;
+  ringbuf_init(&p->out, EMU_BUF_SIZE);
+  memset(&p->parser, 0, sizeof(p->parser));
+  memset(&p->hist, 0, sizeof(p->hist));
+}
+
+/*
+ * Queue the next probe, unless too many are in flight
+ *
+ * Probes are numbered text, except on the control channel, where presence
+ * checks are sent. Their answers can't be told apart, so they are assumed
+ * to arrive in order.
+ */
+void prober_send(struct prober *p, uint64_t now)
+{
+  static const unsigned char command[] = {CONTROL_ARE_YOU_THERE, CONTROL_ARE_YOU_THERE | CONTROL_END_COMMAND};
+  char text[PROBE_LEN + 1];
+
+  if (p->next - p->parser.expect >= MAX_OUTSTANDING || ringbuf_space(&p->out) < PROBE_LEN)
+    return;
+  if (p->control)
+    ringbuf_put(&p->out, command, sizeof(command));
+  else {
+    snprintf(text, sizeof(text), "P%08X;", p->next);
+    ringbuf_put(&p->out, (unsigned char *)text, PROBE_LEN);
+  }
+  p->sent[p->next % MAX_OUTSTANDING] = now;
+  p->next++;
+}
+
+/*
+ * Probes coming back, or arriving at the device for one way channels
+ */
+void prober_receive(struct prober *p, const unsigned char *buf, size_t len, uint64_t now)
+{
+  uint32_t seq;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (p->control) {
+      if (buf[i] != (CONTROL_ARE_YOU_THERE | CONTROL_END_COMMAND) || p->parser.expect == p->next)
+	continue;
+      seq = p->parser.expect++;
+      p->parser.received++;
+    }
+    else if (!probe_parse(&p->parser, buf[i], &seq))
+      continue;
+    if (p->next - seq <= MAX_OUTSTANDING)
+      histogram_add(&p->hist, now - p->sent[seq % MAX_OUTSTANDING]);
+  }
+}
+
+void prober_read(struct prober *p, uint64_t now)
+{
+  unsigned char buf[4096];
+  ssize_t res;
+
+  if ((res = read(p->fd, buf, sizeof(buf))) > 0)
+    prober_receive(p, buf, res, now);
+}
+
+void prober_write(struct prober *p)
+{
+  if (ringbuf_write_fd(&p->out, p->fd) == -1 && errno != EAGAIN && errno != EINTR)
+    perror("Error writing probe");
+}
+
+/*
+ * Read a reply script
+ *
+ * Each line holds a CAT command and the reply to it, separated by
+ * whitespace, e.g. "FA; FA00014250000;". Print error message and exit on
+ * failure.
+ */
+void read_script(const char *filename)
+{
+  char line[2*MAX_LINE];
+  char query[MAX_LINE], answer[MAX_LINE];
+  FILE *f;
+
+  if (!(f = fopen(filename, "r"))) {
+    perror("Can't open script");
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' || sscanf(line, "%255s %255s", query, answer) != 2)
+      continue;
+    if (scriptlen == MAX_SCRIPT) {
+      fprintf(stderr, "Too many lines in script\n");
+      exit(1);
+    }
+    script[scriptlen].query = strdup(query);
+    script[scriptlen].answer = strdup(answer);
+    scriptlen++;
+  }
+  fclose(f);
+}
+
+void emulator_init(struct emulator *emu, int fd, int model)
+{
+  int c;
+
+  emu->fd = fd;
+  emu->model = model;
+  emu->up.active = 0;
+  emu->down.active = 0;
+  ringbuf_init(&emu->rx, EMU_BUF_SIZE);
+  ringbuf_init(&emu->tx, EMU_BUF_SIZE);
+  for (c = 0; c < DECODE_CHANNELS; c++)
+    ringbuf_init(&emu->out[c], EMU_BUF_SIZE);
+  device_decoder_init(&emu->dd);
+  emu->hostflags = FLAGS_R1_RTS | FLAGS_R2_RTS;
+  emu->flagsdue = 0;
+  emu->nextflags = 0;
+  emu->cmdlen = 0;
+  emu->linelen[0] = 0;
+  emu->linelen[1] = 0;
+  emu->fsk[0] = NULL;
+  emu->fsk[1] = NULL;
+}
+
+/*
+ * Byte on a radio channel
+ *
+ * Without a script, everything is echoed back as it arrives. With a
+ * script, complete commands are answered from it, and other commands are
+ * echoed.
+ */
+void emulator_radio(struct emulator *emu, int radio, unsigned char data)
+{
+  struct ringbuf *out = &emu->out[radio ? DECODE_R2 : DECODE_R1];
+  char *line = emu->line[radio];
+  size_t *len = &emu->linelen[radio];
+  int i;
+
+  if (!scriptlen) {
+    ringbuf_put(out, &data, 1);
+    return;
+  }
+  line[(*len)++] = data;
+  if (data != ';' && *len < MAX_LINE - 1)
+    return;
+  line[*len] = '\0';
+  for (i = 0; i < scriptlen; i++)
+    if (!strcmp(line, script[i].query))
+      break;
+  if (i < scriptlen)
+    ringbuf_put(out, (unsigned char *)script[i].answer, strlen(script[i].answer));
+  else
+    ringbuf_put(out, (unsigned char *)line, *len);
+  *len = 0;
+}
+
+/*
+ * Byte on the control channel
+ *
+ * Commands start with the command byte and end with the same byte with
+ * CONTROL_END_COMMAND set, or after a fixed number of bytes for commands
+ * that may contain it. Version requests and presence checks are answered,
+ * and other commands are echoed as acknowledgement.
+ */
+void emulator_control(struct emulator *emu, unsigned char data)
+{
+  struct ringbuf *out = &emu->out[DECODE_CONTROL];
+  unsigned char end;
+  int fixed;
+
+  if (!emu->cmdlen && (data == CONTROL_NOP || (data & CONTROL_END_COMMAND)))
+    return;
+  emu->cmd[emu->cmdlen++] = data;
+  fixed = control_command_length(emu->cmd[0]);
+  if (fixed ? emu->cmdlen == (size_t)fixed : emu->cmdlen > 1 && data == (emu->cmd[0] | CONTROL_END_COMMAND)) {
+    switch (emu->cmd[0]) {
+    case CONTROL_GET_VERSION:
+      end = CONTROL_GET_VERSION | CONTROL_END_COMMAND;
+      ringbuf_put(out, emu->cmd, 1);
+      ringbuf_put(out, (const unsigned char *)EMU_VERSION, strlen(EMU_VERSION));
+      ringbuf_put(out, &end, 1);
+      break;
+    default: // Including CONTROL_ARE_YOU_THERE
+      ringbuf_put(out, emu->cmd, emu->cmdlen);
+      break;
+    }
+    emu->cmdlen = 0;
+  }
+  else if (emu->cmdlen == MAX_LINE) {
+    fprintf(stderr, "Control command too long, discarded\n");
+    emu->cmdlen = 0;
+  }
+}
+
+/*
+ * FLAGS byte the device reports for a radio
+ *
+ * CTS follows the computer's RTS, and PTT from either radio is reported
+ */
+unsigned char emulator_flags(struct emulator *emu, int radio)
+{
+  unsigned char flags = radio ? FLAGS_IS_R2 : 0;
+
+  if (emu->hostflags & (radio ? FLAGS_R2_RTS : FLAGS_R1_RTS))
+    flags |= FLAGS_CTS;
+  if (emu->hostflags & (FLAGS_R1_PTT | FLAGS_R2_PTT))
+    flags |= FLAGS_ANY_PTT_ON;
+  return flags;
+}
+
+/*
+ * Bytes from the computer waiting in the pty
+ */
+size_t emulator_waiting(struct emulator *emu)
+{
+  int avail = 0;
+
+  if (ioctl(emu->fd, FIONREAD, &avail) == -1)
+    return 0;
+  return avail;
+}
+
+/*
+ * Read what the link has passed from the computer and act on it
+ */
+void emulator_receive(struct emulator *emu, uint64_t now)
+{
+  unsigned char buf[EMU_BUF_SIZE];
+  unsigned char *data[DEVICE_CHANNELS];
+  unsigned char bytes[DEVICE_CHANNELS][EMU_BUF_SIZE / 4];
+  size_t len[DEVICE_CHANNELS];
+  size_t waiting = emulator_waiting(emu);
+  size_t allowance, nframes, i;
+  ssize_t res;
+  int c;
+
+  if (!waiting) {
+    link_idle(&emu->down);
+    return;
+  }
+  allowance = link_allowance(&emu->down, now);
+  if (!link_ready(&emu->down, allowance, waiting))
+    return;
+  if ((res = read(emu->fd, buf, MIN(MIN(allowance, waiting), ringbuf_space(&emu->rx)))) <= 0) {
+    if (res == -1 && errno != EAGAIN && errno != EINTR && errno != EIO)
+      perror("Error reading from computer");
+    return;
+  }
+  link_consume(&emu->down, res);
+  ringbuf_put(&emu->rx, buf, res);
+
+  nframes = ringbuf_used(&emu->rx) / 4;
+  ringbuf_get(&emu->rx, buf, nframes * 4);
+  for (c = 0; c < DEVICE_CHANNELS; c++) {
+    data[c] = bytes[c];
+    len[c] = 0;
+  }
+  device_decode(&emu->dd, buf, nframes, data, len);
+
+  for (i = 0; i < len[DEVICE_R1]; i++)
+    emulator_radio(emu, 0, data[DEVICE_R1][i]);
+  for (i = 0; i < len[DEVICE_R2]; i++)
+    emulator_radio(emu, 1, data[DEVICE_R2][i]);
+  for (i = 0; i < len[DEVICE_CONTROL]; i++)
+    emulator_control(emu, data[DEVICE_CONTROL][i]);
+  ringbuf_put(&emu->out[DECODE_WINKEY], data[DEVICE_WINKEY], len[DEVICE_WINKEY]);
+  for (c = 0; c < 2; c++)
+    if (emu->fsk[c])
+      prober_receive(emu->fsk[c], data[c ? DEVICE_FSK2 : DEVICE_FSK1], len[c ? DEVICE_FSK2 : DEVICE_FSK1], now);
+  if (emu->dd.flags != emu->hostflags) {
+    emu->hostflags = emu->dd.flags;
+    emu->flagsdue = MODEL_HAS_RADIO2(emu->model) ? 3 : 1;
+  }
+}
+
+/*
+ * Frame queued data into sequences and send what the link lets through
+ */
+void emulator_send(struct emulator *emu, uint64_t now)
+{
+  struct devseq ds;
+  unsigned char buf[16];
+  unsigned char data;
+  unsigned char *ptr;
+  size_t allowance, len;
+  ssize_t res;
+  int c;
+
+  if (now >= emu->nextflags) {
+    emu->flagsdue = MODEL_HAS_RADIO2(emu->model) ? 3 : 1;
+    emu->nextflags = now + FLAGS_INTERVAL;
+  }
+
+  while (ringbuf_space(&emu->tx) >= sizeof(buf)) {
+    devseq_init(&ds);
+    while (ds.n1 < 4 && ringbuf_get(&emu->out[DECODE_R1], &data, 1))
+      ds.r1[ds.n1++] = data;
+    while (ds.n2 < 4 && ringbuf_get(&emu->out[DECODE_R2], &data, 1))
+      ds.r2[ds.n2++] = data;
+    if (ringbuf_get(&emu->out[DECODE_CONTROL], &data, 1))
+      ds.control = data;
+    if (ringbuf_get(&emu->out[DECODE_WINKEY], &data, 1))
+      ds.winkey = data;
+    if (ringbuf_get(&emu->out[DECODE_KEYBOARD], &data, 1))
+      ds.keyboard = data;
+    if (emu->flagsdue) {
+      c = (emu->flagsdue & 1) ? 0 : 1;
+      ds.flags = emulator_flags(emu, c);
+      emu->flagsdue &= ~(1 << c);
+    }
+    if (!ds.n1 && !ds.n2 && ds.control < 0 && ds.winkey < 0 && ds.keyboard < 0 && ds.flags < 0)
+      break;
+    len = device_encode(&ds, buf);
+    ringbuf_put(&emu->tx, buf, len);
+  }
+
+  if (!ringbuf_used(&emu->tx)) {
+    link_idle(&emu->up);
+    return;
+  }
+  allowance = link_allowance(&emu->up, now);
+  if (!link_ready(&emu->up, allowance, ringbuf_used(&emu->tx)))
+    return;
+  while (allowance && (len = ringbuf_contig(&emu->tx, &ptr))) {
+    if ((res = write(emu->fd, ptr, MIN(len, allowance))) <= 0) {
+      if (res == -1 && errno != EAGAIN && errno != EINTR && errno != EIO)
+	perror("Error writing to computer");
+      break;
+    }
+    ringbuf_skip(&emu->tx, res);
+    link_consume(&emu->up, res);
+    allowance -= res;
+  }
+}
+
+/*
+ * Set up polling of the device side of the pty
+ *
+ * While the link is busy, the emulator wakes up when the next chunk has
+ * been sent instead of when the pty is ready
+ */
+void emulator_poll(struct emulator *emu, struct pollfd *pfd, uint64_t *wake)
+{
+  pfd->fd = emu->fd;
+  pfd->events = 0;
+  if (fullspeed || !emu->down.active)
+    pfd->events |= POLLIN;
+  else
+    *wake = MIN(*wake, link_next(&emu->down, emulator_waiting(emu)));
+  if (ringbuf_used(&emu->tx)) {
+    if (fullspeed)
+      pfd->events |= POLLOUT;
+    else
+      *wake = MIN(*wake, link_next(&emu->up, ringbuf_used(&emu->tx)));
+  }
+  *wake = MIN(*wake, emu->nextflags);
+}
+
+void print_report(struct prober *probers, int numprobers, double elapsed)
+{
+  int i;
+
+  printf("After %.0f s:\n", elapsed);
+  printf("%-8s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n", "Channel", "sent", "received", "lost", "corrupt", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  for (i = 0; i < numprobers; i++) {
+    struct prober *p = &probers[i];
+
+    printf("%-8s %10lu %10lu %8lu %8lu %8llu %8llu %8llu %8llu %8llu\n", p->name, (unsigned long)p->next, p->parser.received, p->parser.lost, p->parser.corrupt,
+	   (unsigned long long)histogram_percentile(&p->hist, 50) / 1000, (unsigned long long)histogram_percentile(&p->hist, 90) / 1000,
+	   (unsigned long long)histogram_percentile(&p->hist, 99) / 1000, (unsigned long long)histogram_percentile(&p->hist, 99.9) / 1000,
+	   (unsigned long long)p->hist.max / 1000);
+  }
+  fflush(stdout);
+}
+
+void handle_stop(int signum)
+{
+  stop = 1;
+}
+
+void show_help()
+{
+  printf("Usage: microkeyer-emu [OPTIONS]\n");
+  printf("  -m, --model=MODEL       Emulate MODEL (default MK2R)\n");
+  printf("  -e, --emulator-only     Only emulate the device, print its pty name\n");
+  printf("  -d, --daemon=PATH       Daemon to test (default ./microkeyer)\n");
+  printf("  -s, --script=FILE       Answer CAT commands from FILE\n");
+  printf("  -r, --rate=N            Send N probes/s on each channel (default 10)\n");
+  printf("  -t, --time=SECONDS      Stop after SECONDS, 0 to run until interrupted\n");
+  printf("                          (default 10)\n");
+  printf("  -i, --interval=SECONDS  Report every SECONDS (default 60)\n");
+  printf("  -f, --full-speed        Don't pace the link at 230400 baud\n");
+  printf("  -h, --help              Display this help text\n");
+  printf("\nScript lines hold a command and its reply, e.g. \"FA; FA00014250000;\".\n");
+  printf("Commands not in the script, and all Winkey data, are echoed.\n");
+  exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+    {"model", required_argument, NULL, 'm'},
+    {"emulator-only", no_argument, NULL, 'e'},
+    {"daemon", required_argument, NULL, 'd'},
+    {"script", required_argument, NULL, 's'},
+    {"rate", required_argument, NULL, 'r'},
+    {"time", required_argument, NULL, 't'},
+    {"interval", required_argument, NULL, 'i'},
+    {"full-speed", no_argument, NULL, 'f'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  static struct emulator emu;
+  static struct prober probers[CLIENT_CHANNELS];
+  const char *modelname = "MK2R";
+  const char *daemon_path = "./microkeyer";
+  int emulator_only = 0;
+  double rate = 10, duration = 10, interval = 60;
+  struct pollfd pfd[CLIENT_CHANNELS + 1];
+  int ptys[CLIENT_CHANNELS];
+  struct sigaction sa;
+  uint64_t start, now, nextprobe, nextreport, end;
+  pid_t pid = 0;
+  int numprobers = 0;
+  int option_index;
+  int model;
+  int device, slave;
+  int c, i;
+
+  while ((c = getopt_long(argc, argv, "m:ed:s:r:t:i:fh", long_options, &option_index)) != -1) {
+    switch (c) {
+    case 'm':
+      modelname = optarg;
+      break;
+    case 'e':
+      emulator_only = 1;
+      break;
+    case 'd':
+      daemon_path = optarg;
+      break;
+    case 's':
+      read_script(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 't':
+      duration = atof(optarg);
+      break;
+    case 'i':
+      interval = atof(optarg);
+      break;
+    case 'f':
+      fullspeed = 1;
+      break;
+    default:
+      show_help();
+      break;
+    }
+  }
+  if ((model = model_lookup(modelname)) == MODEL_UNSUPPORTED) {
+    fprintf(stderr, "Unknown model: %s\n", modelname);
+    exit(1);
+  }
+  if (rate <= 0 || interval <= 0) {
+    fprintf(stderr, "Rate and interval must be positive\n");
+    exit(1);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  device = open_device_pty();
+  // Keep the slave open, so that the device side doesn't hang up while the
+  // daemon is not running
+  if ((slave = open(ptsname(device), O_RDWR | O_NOCTTY)) == -1) {
+    perror("Can't open device pty");
+    exit(1);
+  }
+  emulator_init(&emu, device, model);
+
+  if (emulator_only) {
+    printf("Device: %s\n", ptsname(device));
+    fflush(stdout);
+  }
+  else {
+    pid = spawn_daemon(daemon_path, model, modelname, device, NULL, ptys);
+    for (c = 0; c < CLIENT_CHANNELS; c++) {
+      if (ptys[c] < 0 || c == CLIENT_KEYBOARD)
+	continue;
+      prober_init(&probers[numprobers], ptys[c], client_names[c], c == CLIENT_CONTROL);
+      if (c == CLIENT_FSK1)
+	emu.fsk[0] = &probers[numprobers];
+      if (c == CLIENT_FSK2)
+	emu.fsk[1] = &probers[numprobers];
+      numprobers++;
+    }
+  }
+
+  start = now = monotonic_ns();
+  nextprobe = start;
+  nextreport = start + interval * 1e9;
+  end = duration > 0 ? start + duration * 1e9 : UINT64_MAX - DRAIN_NS;
+  // Let probes in flight come back before the final count
+  while (now < end + (numprobers ? DRAIN_NS : 0)) {
+    uint64_t wake = end + DRAIN_NS;
+    struct timespec timeout;
+
+    if (stop && end > now)
+      end = now;
+    emulator_poll(&emu, &pfd[0], &wake);
+    for (i = 0; i < numprobers; i++) {
+      pfd[i + 1].fd = probers[i].fd;
+      pfd[i + 1].events = POLLIN | (ringbuf_used(&probers[i].out) ? POLLOUT : 0);
+    }
+    if (numprobers && now < end) {
+      wake = MIN(wake, nextprobe);
+      wake = MIN(wake, nextreport);
+    }
+
+    timeout.tv_sec = wake > now ? (wake - now) / 1000000000ULL : 0;
+    timeout.tv_nsec = wake > now ? (wake - now) % 1000000000ULL : 0;
+    if (ppoll(pfd, numprobers + 1, &timeout, NULL) == -1 && errno != EINTR) {
+      perror("Error waiting for input");
+      exit(1);
+    }
+    now = monotonic_ns();
+
+    if ((pfd[0].revents & POLLIN) || emu.down.active)
+      emulator_receive(&emu, now);
+    emulator_send(&emu, now);
+    for (i = 0; i < numprobers; i++) {
+      if (pfd[i + 1].revents & POLLIN)
+	prober_read(&probers[i], now);
+      if (pfd[i + 1].revents & POLLOUT)
+	prober_write(&probers[i]);
+    }
+
+    if (numprobers && now >= nextprobe && now < end) {
+      for (i = 0; i < numprobers; i++) {
+	prober_send(&probers[i], now);
+	prober_write(&probers[i]);
+      }
+      nextprobe += 1e9 / rate;
+    }
+    if (numprobers && now >= nextreport && now < end) {
+      print_report(probers, numprobers, (now - start) / 1e9);
+      nextreport += interval * 1e9;
+    }
+  }
+
+  if (numprobers) {
+    print_report(probers, numprobers, (now - start) / 1e9);
+    stop_daemon(pid, ptys);
+  }
+  close(slave);
+  close(device);
+
+  return 0;
+}
@@ -0,0 +1,394 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+#include "encoder.h"
+
+/*
+ * Allocate queues of the given size, must be a power of two
+ *
+ * Flags start out with RTS inactive. Whole control commands get a queue
+ * of their own.
+ */
+void txqueues_init(struct txqueues *q, size_t size)
+{
+  ringbuf_init(&q->control, size);
+  ringbuf_init(&q->radio1, size);
+  ringbuf_init(&q->radio2, size);
+  ringbuf_init(&q->fsk1, size);
+  ringbuf_init(&q->fsk2, size);
+  ringbuf_init(&q->winkey, size);
+  ringbuf_init(&q->command, COMMAND_QUEUE_SIZE);
+  q->cmdhead = 0;
+  q->cmdtail = 0;
+  q->cmdsent = 0;
+  q->flags = FLAGS_R1_RTS | FLAGS_R2_RTS;
+  q->flagschanged = 0;
+  q->flagsqueued = 0;
+  q->keyflags = 0;
+}
+
+void txqueues_free(struct txqueues *q)
+{
+  ringbuf_free(&q->control);
+  ringbuf_free(&q->radio1);
+  ringbuf_free(&q->radio2);
+  ringbuf_free(&q->fsk1);
+  ringbuf_free(&q->fsk2);
+  ringbuf_free(&q->winkey);
+  ringbuf_free(&q->command);
+}
+
+/*
+ * Is there room for another control command of len bytes?
+ */
+int command_room(struct txqueues *q, size_t len)
+{
+  return q->cmdhead - __atomic_load_n(&q->cmdtail, __ATOMIC_ACQUIRE) < COMMAND_SLOTS && ringbuf_space(&q->command) >= len;
+}
+
+/*
+ * Queue a whole control command
+ *
+ * Commands are sent one after the other, and since their lengths are
+ * known, the first and last byte are marked without looking at the data.
+ * The caller must check that there is room for it.
+ */
+void queue_command(struct txqueues *q, const unsigned char *cmd, size_t len)
+{
+  q->cmdlen[q->cmdhead & (COMMAND_SLOTS - 1)] = len;
+  ringbuf_put(&q->command, cmd, len);
+  __atomic_store_n(&q->cmdhead, q->cmdhead + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Initialize a new sequence of (up to) 5 frames
+ *
+ * No flags set, no channels valid
+ */
+void sequence_init(sequence_t seq)
+{
+  int i;
+
+  for (i = 0; i < 20; i++)
+    seq[i] = 0x80;
+  for (i = 4; i < 20; i += 4)
+    seq[i] = 0x40;
+  seq[0] = 0x08; // Valid flags in first frame
+  seq[20] = 0;
+}
+
+/*
+ * Set RTS flags in a sequence
+ */
+void sequence_set_rts(sequence_t seq, int radio)
+{
+  if (radio == 1)
+    seq[3] |= FLAGS_R1_RTS;
+  else if (radio == 2)
+    seq[3] |= FLAGS_R2_RTS;
+  if (seq[20] < 1)
+    seq[20] = 1;
+}
+
+/*
+ * Set PTT flags in a sequence
+ */
+void sequence_set_ptt(sequence_t seq, int radio)
+{
+  if (radio == 1)
+    seq[3] |= FLAGS_R1_PTT;
+  else if (radio == 2)
+    seq[3] |= FLAGS_R2_PTT;
+  if (seq[20] < 1)
+    seq[20] = 1;
+}
+
+/*
+ * Set FSK EXT flags in a sequence
+ */
+void sequence_set_fsk_ext(sequence_t seq, int radio)
+{
+  if (radio == 1)
+    seq[3] |= FLAGS_R1_FSK_EXT;
+  else if (radio == 2)
+    seq[3] |= FLAGS_R2_FSK_EXT;
+  if (seq[20] < 1)
+    seq[20] = 1;
+}
+
+/*
+ * Set CW flags in a sequence
+ */
+void sequence_set_cw(sequence_t seq, int radio)
+{
+  if (radio == 1)
+    seq[3] |= FLAGS_R1_CW;
+  else if (radio == 2) {
+    seq[3] |= FLAGS_R2_CW;
+    seq[0] |= SYNCHRO_MSB_SHARED; // Bit 7 of the flags byte
+  }
+  if (seq[20] < 1)
+    seq[20] = 1;
+}
+
+/*
+ * Set all flags in a sequence from a FLAGS_* byte
+ */
+void sequence_set_flags(sequence_t seq, unsigned char flags)
+{
+  seq[3] |= flags;
+  if (flags & 0x80)
+    seq[0] |= SYNCHRO_MSB_SHARED;
+  if (seq[20] < 1)
+    seq[20] = 1;
+}
+
+/*
+ * Set radio channel byte in a given frame (0-4)
+ */
+void sequence_set_radio(sequence_t seq, int radio, int frame, unsigned char data)
+{
+  seq[radio + 4*frame] = 0x80 | data;
+  if (radio == 1)
+    seq[4*frame] |= ((data & 0x080) ? SYNCHRO_MSB_R1 : 0x00) | SYNCHRO_VALID_R1;
+  else if (radio == 2)
+    seq[4*frame] |= ((data & 0x080) ? SYNCHRO_MSB_R2 : 0x00) | SYNCHRO_VALID_R2;
+  if (seq[20] < frame + 1)
+    seq[20] = frame + 1;
+}
+
+/*
+ * Set control channel byte
+ */
+void sequence_set_control(sequence_t seq, unsigned char data, int valid)
+{
+  seq[7] = 0x80 | data;
+  seq[4] |= ((data & 0x080) ? SYNCHRO_MSB_SHARED : 0x00);
+  if (valid) // First and last byte in a command are marked as invalid
+    seq[4] |= SYNCHRO_VALID_SHARED;
+  if (seq[20] < 2)
+    seq[20] = 2;
+}
+
+/*
+ * Set Winkey channel byte
+ */
+void sequence_set_winkey(sequence_t seq, unsigned char data)
+{
+  seq[11] = 0x80 | data;
+  seq[8] |= ((data & 0x080) ? SYNCHRO_MSB_SHARED : 0x00) | SYNCHRO_VALID_SHARED;
+  if (seq[20] < 3)
+    seq[20] = 3;
+}
+
+/*
+ * Set FSK channel byte for given radio
+ */
+void sequence_set_fsk(sequence_t seq, int radio, unsigned char data)
+{
+  seq[11 + radio*4] = 0x80 | data;
+  seq[8 + radio*4] |= ((data & 0x080) ? SYNCHRO_MSB_SHARED : 0x00) | SYNCHRO_VALID_SHARED;
+  if (seq[20] < 3 + radio)
+    seq[20] = 3 + radio;
+}
+
+/*
+ * How many frames in the sequence are used?
+ */
+int frames_in_sequence(sequence_t seq)
+{
+  return seq[20];
+}
+
+/*
+ * Queue a sequence for sending
+ *
+ * Only the minimum number of frames necessary from a sequence are actually
+ * sent. The caller must make sure there is room for a full sequence.
+ */
+void send_sequence(struct ringbuf *out, sequence_t seq)
+{
+  int numframes = frames_in_sequence(seq);
+
+  if (LOG_ENABLED(5)) {
+    int i;
+
+    debugprintf(5, "Sending %i frames:\n", numframes);
+    for (i = 0; i < 20; i += 4)
+      debugprintf(5, "%02x %02x %02x %02x\n", seq[i], seq[i+1], seq[i+2], seq[i+3]);
+  }
+
+  ringbuf_put(out, seq, numframes*4);
+}
+
+/*
+ * Is there latency critical data waiting to be sent?
+ */
+int urgent_pending(struct txqueues *q)
+{
+  return __atomic_load_n(&q->flagschanged, __ATOMIC_ACQUIRE) || __atomic_load_n(&q->cmdhead, __ATOMIC_ACQUIRE) != __atomic_load_n(&q->cmdtail, __ATOMIC_ACQUIRE) || ringbuf_used(&q->winkey);
+}
+
+/*
+ * Is there bulk data waiting to be sent?
+ */
+int bulk_pending(struct txqueues *q)
+{
+  return ringbuf_used(&q->radio1) || ringbuf_used(&q->radio2) || ringbuf_used(&q->fsk1) || ringbuf_used(&q->fsk2);
+}
+
+/*
+ * Fill a sequence with queued data
+ *
+ * Latency critical data is always included. If bulk is set, the radio
+ * channels get up to their weight in bytes (max one in each of the 5
+ * frames) and the FSK channels their one slot each. Otherwise, radio data
+ * only rides along in the frames that are sent anyway. Returns the number
+ * of frames used.
+ *
+ * Takes data from the queues, so it must only be called by the thread
+ * removing from them.
+ */
+int pack_sequence(sequence_t seq, struct txqueues *q, struct scheduler *sched, int bulk)
+{
+  unsigned char data;
+  unsigned char flags;
+  int flagschanged;
+  size_t len;
+  int frame;
+  int numframes;
+
+  // Flags changed from here on are sent in the next sequence
+  flagschanged = __atomic_exchange_n(&q->flagschanged, 0, __ATOMIC_ACQUIRE);
+  flags = __atomic_load_n(&q->flags, __ATOMIC_RELAXED) | q->keyflags;
+
+  sequence_init(seq);
+  if (__atomic_load_n(&q->cmdhead, __ATOMIC_ACQUIRE) != q->cmdtail && ringbuf_get(&q->command, &data, 1)) {
+    // First and last byte in a command are marked as invalid
+    len = q->cmdlen[q->cmdtail & (COMMAND_SLOTS - 1)];
+    sequence_set_control(seq, data, q->cmdsent && q->cmdsent < len - 1);
+    if (++q->cmdsent == len) {
+      q->cmdsent = 0;
+      __atomic_store_n(&q->cmdtail, q->cmdtail + 1, __ATOMIC_RELEASE);
+    }
+  }
+  if (ringbuf_get(&q->winkey, &data, 1))
+    sequence_set_winkey(seq, data);
+  if (flagschanged)
+    sequence_set_flags(seq, flags);
+
+  numframes = bulk ? 5 : frames_in_sequence(seq);
+  for (frame = 0; frame < numframes; frame++) {
+    if (frame < sched->weight[0] && ringbuf_get(&q->radio1, &data, 1))
+      sequence_set_radio(seq, 1, frame, data);
+    if (frame < sched->weight[1] && ringbuf_get(&q->radio2, &data, 1))
+      sequence_set_radio(seq, 2, frame, data);
+  }
+  if (bulk && ringbuf_get(&q->fsk1, &data, 1))
+    sequence_set_fsk(seq, 1, data);
+  if (bulk && ringbuf_get(&q->fsk2, &data, 1))
+    sequence_set_fsk(seq, 2, data);
+
+  // Set flags whenever sending a sequence
+  if (frames_in_sequence(seq))
+    sequence_set_flags(seq, flags);
+
+  return frames_in_sequence(seq);
+}
+
+/*
+ * Change the flags sent to the device
+ *
+ * A change is sent in the next sequence, even if there is no data to send
+ */
+void set_flags(struct txqueues *q, unsigned char flags)
+{
+  if (flags != q->flags) {
+    __atomic_store_n(&q->flags, flags, __ATOMIC_RELAXED);
+    resend_flags(q);
+  }
+}
+
+/*
+ * Send the flags in the next sequence, even if they haven't changed
+ */
+void resend_flags(struct txqueues *q)
+{
+  q->flagsqueued++;
+  __atomic_store_n(&q->flagschanged, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Change the flags keyed by the thread removing from the queues
+ *
+ * They are sent together with the flags set by the thread adding to them,
+ * and a change is sent in the next sequence, like with set_flags().
+ */
+void set_keyflags(struct txqueues *q, unsigned char keyflags)
+{
+  if (keyflags != q->keyflags) {
+    q->keyflags = keyflags;
+    __atomic_store_n(&q->flagschanged, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Running count of everything queued for the device
+ *
+ * Only for the thread adding to the queues, to tell whether anything has
+ * been queued since it last looked.
+ */
+unsigned long txqueues_queued(const struct txqueues *q)
+{
+  return q->radio1.head + q->radio2.head + q->fsk1.head + q->fsk2.head + q->winkey.head + q->cmdhead + q->flagsqueued;
+}
+
+/*
+ * Pack queued data into consecutive sequences
+ *
+ * Latency critical data is packed as long as there is room in the output
+ * buffer. Bulk data is packed while the device backlog (bytes written to
+ * the device but not yet sent, plus what is in out) is below the limit,
+ * or when it has been held back for starve_limit sequences in a row.
+ * Returns the number of bytes of link time to wait before bulk data that
+ * has been held back can be sent, or 0 if nothing is held back.
+ */
+size_t encode_sequences(struct txqueues *q, struct ringbuf *out, struct scheduler *sched, size_t backlog)
+{
+  sequence_t seq;
+  int bulk;
+
+  while (ringbuf_space(out) >= 20) {
+    bulk = backlog + ringbuf_used(out) < sched->backlog_limit || sched->starved >= sched->starve_limit;
+    if (!urgent_pending(q) && (!bulk || !bulk_pending(q)))
+      break;
+    if (!bulk && bulk_pending(q))
+      sched->starved++;
+    else
+      sched->starved = 0;
+    sched->frames += pack_sequence(seq, q, sched, bulk);
+    sched->sequences++;
+    send_sequence(out, seq);
+  }
+
+  if (!bulk_pending(q) || backlog + ringbuf_used(out) < sched->backlog_limit)
+    return 0;
+  return backlog + ringbuf_used(out) - sched->backlog_limit + 1;
+}
@@ -0,0 +1,80 @@
+#ifndef _ENCODER_H
+#define _ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "microkeyer.h"
+#include "ringbuf.h"
+
+#define COMMAND_QUEUE_SIZE 1024 /* Bytes of whole control commands, must be a power of two */
+#define COMMAND_SLOTS      64   /* Whole control commands, must be a power of two */
+
+/*
+ * Data read from ptys, waiting to be sent to the device
+ *
+ * One thread may queue data and commands and set flags while another
+ * packs them into sequences.
+ */
+struct txqueues {
+  struct ringbuf control;       /* Raw input from the control pty, not yet framed */
+  struct ringbuf radio1;
+  struct ringbuf radio2;
+  struct ringbuf fsk1;
+  struct ringbuf fsk2;
+  struct ringbuf winkey;
+  struct ringbuf command;       /* Whole control commands, back to back */
+  uint16_t cmdlen[COMMAND_SLOTS]; /* Length of each command in command */
+  unsigned int cmdhead;         /* Next free slot, free running */
+  unsigned int cmdtail;         /* Command being sent, free running */
+  size_t cmdsent;               /* Bytes of that command sent */
+  unsigned char flags;          /* FLAGS_* to send to the device */
+  int flagschanged;             /* Flags must be sent as soon as possible */
+  unsigned long flagsqueued;    /* Times flags have been queued for sending */
+  unsigned char keyflags;       /* FLAGS_* keyed by the thread removing from the queues */
+};
+
+/*
+ * Outbound scheduling
+ *
+ * Control, Winkey and flag changes are latency critical and are sent as
+ * soon as they are queued. Bulk data (radio and FSK channels) is only
+ * encoded while the amount of data waiting to be sent to the device is
+ * below backlog_limit, so latency critical data never has to wait behind
+ * more than that.
+ */
+struct scheduler {
+  int weight[2];        /* Max bytes per sequence from radio1 and radio2 */
+  size_t backlog_limit; /* Bytes waiting for the device before bulk is held back */
+  int starve_limit;     /* Max consecutive sequences bulk may be held back */
+  int starved;          /* Consecutive sequences bulk has been held back */
+  uint64_t link_idle;   /* When everything written will have left at link rate */
+  unsigned long sequences; /* Sequences packed */
+  unsigned long frames;    /* Frames in those sequences */
+};
+
+void txqueues_init(struct txqueues *q, size_t size);
+void txqueues_free(struct txqueues *q);
+int command_room(struct txqueues *q, size_t len);
+void queue_command(struct txqueues *q, const unsigned char *cmd, size_t len);
+void sequence_init(sequence_t seq);
+void sequence_set_rts(sequence_t seq, int radio);
+void sequence_set_ptt(sequence_t seq, int radio);
+void sequence_set_fsk_ext(sequence_t seq, int radio);
+void sequence_set_cw(sequence_t seq, int radio);
+void sequence_set_flags(sequence_t seq, unsigned char flags);
+void sequence_set_radio(sequence_t seq, int radio, int frame, unsigned char data);
+void sequence_set_control(sequence_t seq, unsigned char data, int valid);
+void sequence_set_winkey(sequence_t seq, unsigned char data);
+void sequence_set_fsk(sequence_t seq, int radio, unsigned char data);
+int frames_in_sequence(sequence_t seq);
+void send_sequence(struct ringbuf *out, sequence_t seq);
+int urgent_pending(struct txqueues *q);
+int bulk_pending(struct txqueues *q);
+int pack_sequence(sequence_t seq, struct txqueues *q, struct scheduler *sched, int bulk);
+void set_flags(struct txqueues *q, unsigned char flags);
+void resend_flags(struct txqueues *q);
+void set_keyflags(struct txqueues *q, unsigned char keyflags);
+unsigned long txqueues_queued(const struct txqueues *q);
+size_t encode_sequences(struct txqueues *q, struct ringbuf *out, struct scheduler *sched, size_t backlog);
+
+#endif
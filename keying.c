@@ -0,0 +1,273 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "log.h"
+#include "keying.h"
+
+#define CHAR_ELEMENTS 32 /* Most elements one character can take */
+
+#define ITA2_LTRS 0x1F
+#define ITA2_FIGS 0x1B
+
+/*
+ * Morse code of each character, NULL if it has none
+ */
+static const char *morse[128] = {
+  ['A'] = ".-", ['B'] = "-...", ['C'] = "-.-.", ['D'] = "-..", ['E'] = ".",
+  ['F'] = "..-.", ['G'] = "--.", ['H'] = "....", ['I'] = "..", ['J'] = ".---",
+  ['K'] = "-.-", ['L'] = ".-..", ['M'] = "--", ['N'] = "-.", ['O'] = "---",
+  ['P'] = ".--.", ['Q'] = "--.-", ['R'] = ".-.", ['S'] = "...", ['T'] = "-",
+  ['U'] = "..-", ['V'] = "...-", ['W'] = ".--", ['X'] = "-..-", ['Y'] = "-.--",
+  ['Z'] = "--..",
+  ['0'] = "-----", ['1'] = ".----", ['2'] = "..---", ['3'] = "...--",
+  ['4'] = "....-", ['5'] = ".....", ['6'] = "-....", ['7'] = "--...",
+  ['8'] = "---..", ['9'] = "----.",
+  ['.'] = ".-.-.-", [','] = "--..--", ['?'] = "..--..", ['/'] = "-..-.",
+  ['='] = "-...-", ['+'] = ".-.-.", ['-'] = "-....-", ['('] = "-.--.",
+  [')'] = "-.--.-", ['\''] = ".----.", ['"'] = ".-..-.", [':'] = "---...",
+  [';'] = "-.-.-.", ['@'] = ".--.-.", ['!'] = "-.-.--", ['&'] = ".-..."
+};
+
+/*
+ * ITA2 (US TTY) characters by code in letters and figures shift, 0 where
+ * there is none
+ */
+static const char letters[32] = "\0E\nA SIU\rDRJNFCKTZLWHYPQOBG\0MXV\0";
+static const char figures[32] = "\0" "3\n- \a87\r$4',!:(5\")2#6019?&\0./;\0";
+
+/*
+ * Mode by name, -1 if unknown
+ */
+int keying_mode(const char *name)
+{
+  if (!strcasecmp(name, "cw"))
+    return KEYING_CW;
+  if (!strcasecmp(name, "fsk"))
+    return KEYING_FSK;
+  return -1;
+}
+
+/*
+ * Set up keying
+ *
+ * speed is WPM for CW and baud for FSK, weight is the CW weighting in
+ * percent of a dit and its gap. Returns 0 on success, -1 if out of range.
+ */
+int keying_init(struct keying *k, int mode, double speed, int weight)
+{
+  memset(k, 0, sizeof(*k));
+  k->mode = mode;
+  k->figures = -1;
+  if (mode == KEYING_CW) {
+    if (speed < 5 || speed > 99 || weight < 25 || weight > 75)
+      return -1;
+    k->unit = 1200000000 / speed;
+    k->weight = ((int64_t)weight - 50) * (int64_t)k->unit / 50;
+  }
+  else {
+    if (speed < 10 || speed > 300)
+      return -1;
+    k->unit = 1000000000 / speed;
+  }
+  return 0;
+}
+
+/*
+ * Queue an element, or lengthen the last one if the key stays the same
+ */
+static void add_element(struct keying *k, uint64_t len, int down)
+{
+  struct keying_element *e;
+
+  if (k->head != k->tail) {
+    e = &k->elements[(k->head - 1) & (KEYING_ELEMENTS - 1)];
+    if (e->down == down) {
+      e->len += len;
+      return;
+    }
+  }
+  e = &k->elements[k->head & (KEYING_ELEMENTS - 1)];
+  e->len = len;
+  e->down = down;
+  k->head++;
+}
+
+/*
+ * Queue a dit or dah and the gap after it
+ */
+static void add_mark(struct keying *k, char mark)
+{
+  add_element(k, (mark == '-' ? 3 : 1) * k->unit + k->weight, 1);
+  add_element(k, k->unit - k->weight, 0);
+}
+
+/*
+ * Queue a CW character
+ *
+ * The gap after the last element is made a letter gap, and a space makes
+ * it a word gap. Returns 0 if the character can't be sent.
+ */
+static int add_cw(struct keying *k, unsigned char c)
+{
+  const char *code;
+
+  if (c == '[' || c == ']') {
+    if (k->raw)
+      add_element(k, 2 * k->unit, 0);
+    k->raw = c == '[';
+    return 1;
+  }
+  if (k->raw) {
+    if (c == '.' || c == '-')
+      add_mark(k, c);
+    else if (c == ' ')
+      add_element(k, 2 * k->unit, 0);
+    else
+      return 0;
+    return 1;
+  }
+  if (isspace(c)) {
+    add_element(k, 4 * k->unit, 0);
+    return 1;
+  }
+  if (c >= 128 || !(code = morse[toupper(c)]))
+    return 0;
+  for (; *code; code++)
+    add_mark(k, *code);
+  add_element(k, 2 * k->unit, 0);
+  return 1;
+}
+
+/*
+ * Queue an ITA2 code with start and stop bits
+ */
+static void add_code(struct keying *k, int code)
+{
+  int i;
+
+  add_element(k, k->unit, 1); // Start bit is space
+  for (i = 0; i < 5; i++)
+    add_element(k, k->unit, !(code & 1 << i));
+  add_element(k, k->unit * 3 / 2, 0);
+}
+
+/*
+ * Queue an FSK character, shifting first if needed
+ *
+ * A transmission starts with a shift, as the receiver's is unknown.
+ * Returns 0 if the character can't be sent.
+ */
+static int add_fsk(struct keying *k, unsigned char c)
+{
+  int code;
+
+  if (c == '\r')
+    return 1;
+  if (c == '\n') { // End lines with CR LF, which are in both shifts
+    if (k->figures < 0)
+      add_code(k, ITA2_LTRS);
+    k->figures = k->figures == 1;
+    add_code(k, 0x08);
+    add_code(k, 0x02);
+    return 1;
+  }
+  c = toupper(c);
+  for (code = 1; code < 31; code++) {
+    if (code == ITA2_FIGS) // Shifts are only sent as needed
+      continue;
+    if (letters[code] == c) {
+      if (letters[code] == figures[code] && k->figures >= 0)
+	break;
+      if (k->figures != 0)
+	add_code(k, ITA2_LTRS);
+      k->figures = 0;
+      break;
+    }
+    if (figures[code] == c) {
+      if (k->figures != 1)
+	add_code(k, ITA2_FIGS);
+      k->figures = 1;
+      break;
+    }
+  }
+  if (code == 31)
+    return 0;
+  add_code(k, code);
+  return 1;
+}
+
+/*
+ * Turn text into elements while there is room for them
+ *
+ * Returns the number of bytes taken from in.
+ */
+size_t keying_feed(struct keying *k, struct ringbuf *in)
+{
+  unsigned char c;
+  size_t taken = 0;
+  int sent;
+
+  while (KEYING_ELEMENTS - (k->head - k->tail) >= CHAR_ELEMENTS && ringbuf_get(in, &c, 1)) {
+    taken++;
+    sent = k->mode == KEYING_CW ? add_cw(k, c) : add_fsk(k, c);
+    if (sent)
+      k->chars++;
+    else {
+      debugprintf(2, "Can't key character 0x%02x, skipped\n", c);
+      k->unknown++;
+    }
+  }
+  return taken;
+}
+
+/*
+ * Start the elements that are due
+ *
+ * An idle keyer starts right away. If an edge is more than a unit late,
+ * the rest are timed from now instead, so they aren't squeezed together to
+ * catch up. Returns 1 if the key is down.
+ */
+int keying_run(struct keying *k, uint64_t now)
+{
+  struct keying_element *e;
+  uint64_t late;
+
+  if (!k->due && k->head != k->tail)
+    k->due = now;
+  while (k->due && k->due <= now) {
+    late = now - k->due;
+    if (k->head == k->tail) {
+      k->down = 0;
+      k->due = 0;
+      k->figures = -1;
+      break;
+    }
+    e = &k->elements[k->tail++ & (KEYING_ELEMENTS - 1)];
+    k->edges++;
+    k->late += late;
+    if (late > k->latemax)
+      k->latemax = late;
+    k->down = e->down;
+    k->due = (late > k->unit ? now : k->due) + e->len;
+  }
+  return k->down;
+}
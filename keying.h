@@ -0,0 +1,58 @@
+#ifndef _KEYING_H
+#define _KEYING_H
+
+#include <stdint.h>
+#include "ringbuf.h"
+
+/*
+ * Host generated CW and FSK keying
+ *
+ * Text is turned into a queue of key down and key up elements, each with
+ * its length in ns. Elements are timed from when the previous one was due
+ * to end, not from when it actually ended, so lateness doesn't add up over
+ * a transmission.
+ *
+ * CW is timed by the PARIS standard, with one dit lasting 1.2 s / WPM. The
+ * weighting moves time from each key up to the key down before it, 50
+ * being the standard 1:1. Elements can also be given directly between [ and
+ * ], with . for a dit, - for a dah and space for a letter gap, e.g. [...-.-]
+ * for SK.
+ *
+ * FSK is sent as ITA2 (US TTY) with one start bit, five data bits and 1.5
+ * stop bits. Key down is space, so the key is up (mark) while idle.
+ */
+
+#define KEYING_CW  0
+#define KEYING_FSK 1
+
+#define KEYING_ELEMENTS 256 /* Queued elements, must be a power of two */
+
+struct keying_element {
+  uint64_t len;                  /* ns */
+  int down;                      /* Key down */
+};
+
+struct keying {
+  int mode;                      /* KEYING_* */
+  uint64_t unit;                 /* CW dit or FSK bit, ns */
+  int64_t weight;                /* CW key down time added to each element, ns */
+  struct keying_element elements[KEYING_ELEMENTS];
+  unsigned int head;             /* Free running */
+  unsigned int tail;
+  int raw;                       /* CW: between [ and ] */
+  int figures;                   /* FSK: in figures shift */
+  int down;                      /* Key is down */
+  uint64_t due;                  /* When the current element ends, 0 if idle */
+  unsigned long chars;           /* Characters sent */
+  unsigned long unknown;         /* Characters that can't be sent */
+  unsigned long edges;           /* Elements started on time or late */
+  uint64_t late;                 /* Total lateness, ns */
+  uint64_t latemax;              /* ns */
+};
+
+int keying_mode(const char *name);
+int keying_init(struct keying *k, int mode, double speed, int weight);
+size_t keying_feed(struct keying *k, struct ringbuf *in);
+int keying_run(struct keying *k, uint64_t now);
+
+#endif
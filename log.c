@@ -0,0 +1,398 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include "log.h"
+
+// Type an argument is passed as
+enum logarg_type {
+  LOGARG_NONE,
+  LOGARG_INT,
+  LOGARG_LONG,
+  LOGARG_LLONG,
+  LOGARG_SIZE,
+  LOGARG_INTMAX,
+  LOGARG_PTRDIFF,
+  LOGARG_DOUBLE,
+  LOGARG_STRING,
+  LOGARG_POINTER
+};
+
+union logarg {
+  unsigned long long u;
+  double d;
+  const void *p;
+};
+
+struct logrecord {
+  atomic_size_t seq;             // Ring position this slot is ready for
+  const char *format;
+  int nargs;
+  union logarg args[LOG_MAX_ARGS];
+  char strings[LOG_STRING_SPACE];
+};
+
+int verbosity = 0;
+
+static struct logrecord ring[LOG_RECORDS];
+static atomic_size_t head;       // Next slot to claim by a writer
+static size_t tail;              // Next slot to print, owned by the log thread
+static atomic_ulong lost;        // Records dropped because the ring was full
+static atomic_int stopping;
+static atomic_int sleeping;      // Log thread found the ring empty and waits to be woken
+static int wakefd = -1;          // Wakes the log thread
+static pthread_t thread;
+static int running = 0;
+
+/*
+ * Find the end of a conversion specification
+ *
+ * Returns a pointer to the conversion character and sets *type to how the
+ * argument is passed. The spec starts at the character after '%'.
+ */
+static const char *parse_conversion(const char *spec, enum logarg_type *type)
+{
+  enum logarg_type length = LOGARG_INT;
+
+  while (*spec && strchr("-+ #0", *spec))
+    spec++;
+  while (*spec && strchr("0123456789.", *spec))
+    spec++;
+  switch (*spec) {
+  case 'h':
+    spec += spec[1] == 'h' ? 2 : 1;
+    break;
+  case 'l':
+    if (spec[1] == 'l') {
+      length = LOGARG_LLONG;
+      spec += 2;
+    }
+    else {
+      length = LOGARG_LONG;
+      spec++;
+    }
+    break;
+  case 'z':
+    length = LOGARG_SIZE;
+    spec++;
+    break;
+  case 'j':
+    length = LOGARG_INTMAX;
+    spec++;
+    break;
+  case 't':
+    length = LOGARG_PTRDIFF;
+    spec++;
+    break;
+  }
+
+  if (*spec && strchr("diouxXc", *spec))
+    *type = length;
+  else if (*spec && strchr("eEfFgGaA", *spec))
+    *type = LOGARG_DOUBLE;
+  else if (*spec == 's')
+    *type = LOGARG_STRING;
+  else if (*spec == 'p')
+    *type = LOGARG_POINTER;
+  else
+    *type = LOGARG_NONE;
+  return spec;
+}
+
+/*
+ * Wake the log thread
+ */
+static void log_wakeup(void)
+{
+  uint64_t one = 1;
+
+  if (write(wakefd, &one, sizeof(one)) == -1)
+    perror("Can't wake log thread");
+}
+
+/*
+ * Queue a record for the log thread
+ *
+ * Safe to call from any thread. Never blocks: if the ring is full, the
+ * record is dropped and counted.
+ */
+void log_record(const char *format, ...)
+{
+  struct logrecord *r;
+  size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+  size_t strpos = 0;
+  const char *p;
+  va_list ap;
+
+  // Claim a slot
+  for (;;) {
+    size_t seq;
+
+    r = &ring[pos & (LOG_RECORDS - 1)];
+    seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+	break;
+    }
+    else if ((ptrdiff_t)(seq - pos) < 0) {
+      atomic_fetch_add_explicit(&lost, 1, memory_order_relaxed);
+      return;
+    }
+    else
+      pos = atomic_load_explicit(&head, memory_order_relaxed);
+  }
+
+  // Copy the arguments
+  r->format = format;
+  r->nargs = 0;
+  va_start(ap, format);
+  for (p = strchr(format, '%'); p && r->nargs < LOG_MAX_ARGS; p = strchr(p + 1, '%')) {
+    union logarg *arg = &r->args[r->nargs];
+    enum logarg_type type;
+    const char *s;
+    size_t len;
+
+    if (p[1] == '%') {
+      p++;
+      continue;
+    }
+    p = parse_conversion(p + 1, &type);
+    switch (type) {
+    case LOGARG_NONE:
+      if (!*p)
+	break;
+      continue;
+    case LOGARG_INT:
+      arg->u = va_arg(ap, int);
+      break;
+    case LOGARG_LONG:
+      arg->u = va_arg(ap, long);
+      break;
+    case LOGARG_LLONG:
+      arg->u = va_arg(ap, long long);
+      break;
+    case LOGARG_SIZE:
+      arg->u = va_arg(ap, size_t);
+      break;
+    case LOGARG_INTMAX:
+      arg->u = va_arg(ap, intmax_t);
+      break;
+    case LOGARG_PTRDIFF:
+      arg->u = va_arg(ap, ptrdiff_t);
+      break;
+    case LOGARG_DOUBLE:
+      arg->d = va_arg(ap, double);
+      break;
+    case LOGARG_STRING:
+      s = va_arg(ap, const char *);
+      len = strnlen(s, LOG_STRING_SPACE - 1 - strpos);
+      memcpy(r->strings + strpos, s, len);
+      r->strings[strpos + len] = '\0';
+      arg->p = r->strings + strpos;
+      strpos += len + (strpos + len < LOG_STRING_SPACE - 1);
+      break;
+    case LOGARG_POINTER:
+      arg->p = va_arg(ap, const void *);
+      break;
+    }
+    if (!*p)
+      break;
+    r->nargs++;
+  }
+  va_end(ap);
+
+  atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+
+  // Wake the log thread if it has found the ring empty
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&sleeping, memory_order_relaxed) && atomic_exchange(&sleeping, 0))
+    log_wakeup();
+}
+
+/*
+ * Format and print one record
+ *
+ * Each conversion is printed separately with its own argument. Conversions
+ * beyond the last stored argument are printed as is.
+ */
+static void print_record(FILE *f, const struct logrecord *r)
+{
+  const char *p = r->format;
+  int argno = 0;
+
+  while (*p) {
+    const union logarg *arg = &r->args[argno];
+    const char *end = strchr(p, '%');
+    enum logarg_type type;
+    char spec[32];
+
+    if (!end) {
+      fputs(p, f);
+      return;
+    }
+    fwrite(p, 1, end - p, f);
+    if (end[1] == '%') {
+      fputc('%', f);
+      p = end + 2;
+      continue;
+    }
+    p = parse_conversion(end + 1, &type);
+    if (!*p || type == LOGARG_NONE || argno == r->nargs || p - end + 2 > (ptrdiff_t)sizeof(spec)) {
+      fwrite(end, 1, p - end + (*p != '\0'), f);
+      p += *p != '\0';
+      continue;
+    }
+    p++;
+    memcpy(spec, end, p - end);
+    spec[p - end] = '\0';
+    switch (type) {
+    case LOGARG_NONE:
+      break;
+    case LOGARG_INT:
+      fprintf(f, spec, (int)arg->u);
+      break;
+    case LOGARG_LONG:
+      fprintf(f, spec, (long)arg->u);
+      break;
+    case LOGARG_LLONG:
+      fprintf(f, spec, (long long)arg->u);
+      break;
+    case LOGARG_SIZE:
+      fprintf(f, spec, (size_t)arg->u);
+      break;
+    case LOGARG_INTMAX:
+      fprintf(f, spec, (intmax_t)arg->u);
+      break;
+    case LOGARG_PTRDIFF:
+      fprintf(f, spec, (ptrdiff_t)arg->u);
+      break;
+    case LOGARG_DOUBLE:
+      fprintf(f, spec, arg->d);
+      break;
+    case LOGARG_STRING:
+    case LOGARG_POINTER:
+      fprintf(f, spec, arg->p);
+      break;
+    }
+    argno++;
+  }
+}
+
+/*
+ * Print all complete records in the ring
+ *
+ * Returns the number of records printed.
+ */
+static size_t log_drain(void)
+{
+  size_t count = 0;
+  unsigned long n;
+
+  for (;;) {
+    struct logrecord *r = &ring[tail & (LOG_RECORDS - 1)];
+
+    if (atomic_load_explicit(&r->seq, memory_order_acquire) != tail + 1)
+      break;
+    print_record(stdout, r);
+    atomic_store_explicit(&r->seq, tail + LOG_RECORDS, memory_order_release);
+    tail++;
+    count++;
+  }
+  if ((n = atomic_exchange_explicit(&lost, 0, memory_order_relaxed)))
+    printf("Log ring full, %lu records lost\n", n);
+  return count;
+}
+
+/*
+ * Log thread
+ *
+ * Output is flushed whenever the ring runs empty, and the thread sleeps
+ * until a writer finds it waiting. Only the first record after that costs
+ * the writer a system call, and an idle daemon has no wakeups for logging.
+ */
+static void *log_thread(void *arg)
+{
+  uint64_t count;
+
+  while (!atomic_load(&stopping)) {
+    if (log_drain())
+      continue;
+    fflush(stdout);
+    // Look again after saying we wait, in case a record came before that
+    atomic_store(&sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (log_drain()) {
+      atomic_store(&sleeping, 0);
+      continue;
+    }
+    if (read(wakefd, &count, sizeof(count)) == -1)
+      atomic_store(&sleeping, 0);
+  }
+  return NULL;
+}
+
+/*
+ * Start the log thread
+ *
+ * Remaining records are printed at exit. Print error message and exit on
+ * failure.
+ */
+void log_start(void)
+{
+  size_t i;
+  int err;
+
+  for (i = 0; i < LOG_RECORDS; i++)
+    atomic_init(&ring[i].seq, i);
+  if ((wakefd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    perror("Can't create log thread wakeup");
+    exit(1);
+  }
+  if ((err = pthread_create(&thread, NULL, log_thread, NULL))) {
+    fprintf(stderr, "Can't start log thread: %s\n", strerror(err));
+    exit(1);
+  }
+  running = 1;
+  atexit(log_stop);
+}
+
+/*
+ * Stop the log thread and print what is left in the ring
+ */
+void log_stop(void)
+{
+  if (!running)
+    return;
+  running = 0;
+  atomic_store(&stopping, 1);
+  log_wakeup();
+  pthread_join(thread, NULL);
+  log_drain();
+  fflush(stdout);
+}
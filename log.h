@@ -0,0 +1,41 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+/*
+ * Highest debug level compiled in
+ *
+ * Build with -DLOG_MAX_LEVEL=N to remove debugprintf() calls above level N
+ * altogether.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 12
+#endif
+
+#define LOG_RECORDS 4096         /* Records in the log ring, power of two */
+#define LOG_MAX_ARGS 8           /* Max conversions per record */
+#define LOG_STRING_SPACE 48      /* Bytes for copies of %s arguments */
+
+extern int verbosity;
+
+/* Is output at this level wanted? */
+#define LOG_ENABLED(level) ((level) <= LOG_MAX_LEVEL && (level) <= verbosity)
+
+/*
+ * Queue debug output
+ *
+ * Arguments are stored in a record that is formatted and printed later by
+ * the log thread. Supports the d, i, o, u, x, X, c, e, f, g, a, s and p
+ * conversions without '*' width or precision. Strings are copied, but may
+ * be truncated.
+ */
+#define debugprintf(level, ...) \
+  do { \
+    if (LOG_ENABLED(level)) \
+      log_record(__VA_ARGS__); \
+  } while (0)
+
+void log_record(const char *format, ...);
+void log_start(void);
+void log_stop(void);
+
+#endif
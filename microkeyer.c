@@ -24,12 +24,68 @@
 #include <getopt.h>
 #include <termios.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "microkeyer.h"
+#include "ringbuf.h"
+#include "log.h"
+#include "encoder.h"
+#include "decoder.h"
+#include "capture.h"
+#include "status.h"
+#include "control.h"
+#include "cat.h"
+#include "trace.h"
+#include "keying.h"
+
+#define KEYER_RXBUF_SIZE 4096 /* Must be a power of two */
+#define KEYER_TXBUF_SIZE 4096 /* Must be a power of two */
+#define PTY_RXBUF_SIZE   1024 /* Must be a power of two */
+#define PTY_TXBUF_SIZE   4096 /* Must be a power of two */
+#define LINK_QUEUE_SIZE  4096 /* Decoded bytes per channel on their way to the device thread, must be a power of two */
+#define MAX_EVENTS       16   /* Events handled per epoll_wait() */
+#define CAPTURE_SIZE     16   /* Default capture file size, MB */
+#define THREAD_STACK_SIZE (256*1024) /* Stack of each thread of a device, locked in real-time mode */
+#define COMMAND_CLIENTS  8    /* Command socket clients per device */
+#define STATS_SEND_TIMEOUT 5  /* Seconds to wait for a statistics client to read */
+#define SOCKET_CLIENTS   8    /* Clients per channel socket */
+#define SOCKET_RXBUF_SIZE 256 /* Input from a stream client on its way to the channel, must be a power of two */
+#define MAX_CHANNELS     7    /* Control, radio, FSK, winkey and keyboard channels */
+#define RECONNECT_INTERVAL 100000000ULL /* Between attempts to reopen a lost device, ns */
+#define KEEPALIVE_LIMIT  3    /* Keepalive intervals of silence before the device is lost */
+#define CAT_TTL          100  /* Default time CAT replies are cached, ms */
+#define SHARE_PTYS       8    /* Ptys sharing a radio channel */
+#define MAX_PTYS         (9 + 2 * (SHARE_PTYS - 1)) /* Ptys per device */
+
+#if SHARE_PTYS + SOCKET_CLIENTS > CAT_CLIENTS
+#error "Not enough CAT clients for the ptys and socket clients of a shared radio"
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/*
+ * What to do with decoded data when a pty output queue is full
+ */
+#define OVERFLOW_DROP_NEWEST 0 /* Discard the byte that doesn't fit */
+#define OVERFLOW_DROP_OLDEST 1 /* Discard the oldest byte in the queue */
+#define OVERFLOW_BLOCK       2 /* Stop decoding until the pty is written */
 
 struct ports {
   int keyer;
@@ -42,32 +98,314 @@ struct ports {
   int keyboard;
 };
 
-int verbosity = 0;
-int keyer_model = MODEL_UNSUPPORTED;
+/*
+ * Bounded queue of data waiting to be written to a pty
+ *
+ * Decoded data is passed from the RX thread to the device thread through
+ * link, and queued in buf until the pty takes it. Unallocated (size 0) if
+ * the device doesn't have the channel.
+ */
+struct outqueue {
+  struct ringbuf link;
+  struct ringbuf buf;
+  int policy;            // OVERFLOW_* policy when the queue is full
+  unsigned long dropped; // Bytes dropped because the queue was full
+  struct endpoint *endpoint; // Socket clients that also get the output, NULL if none
+  struct latency *latency; // Byte being followed to the pty, NULL if not tracing
+};
 
-int debugprintf(int level, const char *format, ...)
-{
-  int res = 0;
+/*
+ * Latency of a channel in one direction, when tracing
+ *
+ * To the device, the stages are from the pty to the encoder and from the
+ * encoder to the device. From the device, they are from the device to the
+ * decoder and from the decoder to the pty.
+ */
+struct latency {
+  const char *name;              // Channel
+  struct ringbuf *in;            // Input queue of the channel, to the device
+  struct outqueue *out;          // Output queue of the channel, from the device
+  int channel;                   // DECODE_* of the channel, from the device
+  struct trace_probe probe;
+  struct trace_hist stage[2];
+  struct trace_hist total;
+};
 
-  if (level > verbosity)
-    return 0;
+/*
+ * Data decoded from the device, waiting to be written to ptys
+ */
+struct rxqueues {
+  struct outqueue control;
+  struct outqueue radio1;
+  struct outqueue radio2;
+  struct outqueue winkey;
+  struct outqueue keyboard;
+  unsigned char decoded[DECODE_CHANNELS][KEYER_RXBUF_SIZE / 4]; // Decoder output, RX thread
+};
 
-  va_list args;
-  va_start(args, format);
-  res = vprintf(format, args);
-  va_end(args);
+/*
+ * Per pty counters
+ */
+struct ptystats {
+  unsigned long in;      // Bytes read from the pty
+  unsigned long out;     // Bytes written to the pty
+  unsigned long eagain;  // Writes the pty didn't accept all of
+  unsigned long hangups; // Times the slave side was closed
+  unsigned long reopens; // Times it was reopened after a hangup
+};
 
-  return res;
-}
+/*
+ * A file descriptor registered with epoll
+ */
+struct watch {
+  int fd;
+  const char *name;
+  struct ringbuf *in;    // Where input from the pty is queued, NULL if none
+  struct outqueue *out;  // Output waiting to be written, NULL if none
+  uint32_t events;       // Events currently registered
+  int hangup;            // Slave side closed, wait for it to be reopened
+  unsigned char lineflag; // FLAGS_* bit following the slave's modem lines, 0 if none
+  unsigned char channelcmd; // CONTROL_SET_*_CHANNEL for the slave's settings, 0 if none
+  unsigned char channel[3]; // Divisor and SS byte last sent to the device
+  int channelsent;       // channel is valid
+  int configured;        // A client has set up the channel, set it up again after a reconnect
+  struct ptystats stats;
+};
+
+/*
+ * A radio channel shared by several ptys
+ *
+ * The first pty has the channel's modem lines, serial settings and output
+ * queue. The others only send commands and get replies. The clients of
+ * the channel's socket come after the ptys, one CAT client each.
+ */
+struct catshare {
+  struct cat cat;                    // Framing, routing and cache, no clients if not shared
+  int numptys;                       // Clients that are ptys
+  struct ringbuf in[CAT_CLIENTS];    // Input from each client, not yet framed
+  struct outqueue out[SHARE_PTYS];   // Output for each pty but the first
+  struct watch *watches[CAT_CLIENTS];
+  struct endpoint *endpoint;         // Socket of the channel, NULL if none
+  char names[SHARE_PTYS][16];
+};
+
+/*
+ * A channel offered as a Unix socket
+ *
+ * What clients send goes to the channel as if written to its pty. Each
+ * client's input is queued on its own and moved to the channel one whole
+ * read at a time, so clients never mix with each other or with the pty.
+ * What the device sends on the channel goes to every client, each through
+ * a queue of its own, so a client that doesn't keep up only loses its own
+ * data. On a shared radio channel, each client is a CAT client of its own
+ * instead, and only gets the replies to its own commands and those nobody
+ * asked for. The control channel's socket is SOCK_SEQPACKET, with one
+ * command or reply per message. Its clients' commands go to the control
+ * engine like those of command socket clients, numbered after them, and
+ * each reply goes only to the client that asked.
+ */
+struct endpoint {
+  int fd;                            // Listening socket
+  int type;                          // SOCK_STREAM or SOCK_SEQPACKET
+  const char *name;                  // Channel
+  struct ringbuf *in;                // Channel input queue, NULL if none
+  struct catshare *share;            // Shared radio channel, NULL if not shared
+  struct watch watch;                // Listening socket registration with epoll
+  struct watch clients[SOCKET_CLIENTS]; // fd -1 if unused
+  struct ringbuf clientin[SOCKET_CLIENTS]; // Input from each stream client, unless shared
+  struct outqueue out[SOCKET_CLIENTS]; // Output for each stream client
+  unsigned long accepted;            // Clients that have connected
+  unsigned long dropped;             // Bytes clients didn't keep up with
+};
+
+/*
+ * Replay of a capture in place of the device
+ *
+ * The daemon talks to one end of a socket pair, and the data the device
+ * sent is written to the other end, at the original pace or as fast as
+ * the daemon takes it. What the daemon sends is discarded.
+ */
+struct replay {
+  struct capture cap;
+  int feed;                          // Our end of the socket pair
+  int timer;                         // Wakes us when the next record is due
+  int fast;                          // Don't wait for records to be due
+  const struct capture_record *rec;  // Record being fed, NULL at end
+  const unsigned char *data;
+  size_t done;                       // Bytes of record fed so far
+  uint64_t start;                    // When replay started
+};
+
+/*
+ * Device link counters
+ *
+ * Sequences and frames sent are counted by the scheduler
+ */
+struct linkstats {
+  unsigned long wakeups;  // Returns from epoll_wait() in the device thread
+  unsigned long rxwakeups; // In the RX thread
+  unsigned long txwakeups; // In the TX thread
+  unsigned long rxbytes;  // Bytes read from the device
+  unsigned long rxframes; // Frames decoded
+  unsigned long txbytes;  // Bytes written to the device
+  unsigned long losses;   // Times the device was lost
+  unsigned long reconnects; // Times it was reopened
+  unsigned long restarts; // Times it reported that it had restarted
+};
+
+/*
+ * How late the device thread wakes up for timers
+ */
+struct jitter {
+  unsigned long samples;
+  uint64_t total;         // ns
+  uint64_t max;           // ns
+};
+
+/*
+ * Settings for a device, from the command line
+ */
+struct devconfig {
+  int model;
+  int overflow_policy[5];     // Control, radio1, radio2, winkey, keyboard
+  struct scheduler sched;
+  const char *capture_path;
+  size_t capture_size;        // MB
+  const char *status_path;
+  const char *command_path;
+  int keepalive;              // Interval of presence checks, ms, 0 if none
+  int rtpolicy;               // SCHED_FIFO or SCHED_RR
+  int rtprio;                 // Real-time priority, 0 if not real-time
+  int pinned;                 // Thread is bound to cpus
+  cpu_set_t cpus;
+  int share[2];               // Ptys for radio1 and radio2
+  int cat_protocol[2];        // CAT_* of radio1 and radio2, -1 if not shared
+  int cat_ttl[2];             // How long replies are cached, ms
+  const char *cat_queries[2]; // Queries to cache, NULL for the protocol's defaults
+  const char *socket_dir;     // Where to offer the channels as sockets, NULL if not
+  int trace;                  // Follow bytes through the pipeline
+  int keying_mode[2];         // KEYING_* of radio1 and radio2, -1 if not keyed
+  double keying_speed[2];     // WPM or baud
+  int keying_weight[2];       // CW weighting, percent
+};
+
+/*
+ * A device and its ptys
+ *
+ * Each device is served by three threads of its own, so that a busy or
+ * wedged device never holds up the others, and clients never hold up the
+ * device. The RX thread reads and decodes what comes from the device, the
+ * TX thread encodes and writes what goes to it, and the device thread
+ * serves the ptys and command clients and looks after the connection.
+ * Data is passed between them in ring buffers with one thread adding and
+ * one removing, and they wake each other up through eventfds.
+ *
+ * Only the device thread opens and closes the device. While the device is
+ * lost, its file descriptor points to /dev/null, so the number is never
+ * reused for something else under the other threads. linkgen is bumped
+ * every time the device is lost or reopened, and the RX and TX threads
+ * start over when they see it change.
+ */
+struct device {
+  const char *name;              // Name of microkeyer device, NULL if replaying
+  char label[16];                // Prefix of pty names and counters, "" if only one device
+  struct devconfig config;
+  struct ports ports;            // File descriptors for device and ptys
+  struct termios oldtio;         // Device settings to restore
+  struct ringbuf keyerrx;        // Data read from keyer, not yet decoded, RX thread
+  struct ringbuf keyertx;        // Sequences waiting to be written to keyer, TX thread
+  struct txqueues txq;           // Data read from ptys, not yet encoded
+  struct rxqueues rxq;           // Data decoded from keyer, not yet written
+  struct decoder dec;            // Decoder state for data from keyer, RX thread
+  uint32_t rxflags;              // Flag state word of the decoder, for the device thread
+  struct control control;        // Control commands in flight
+  struct scheduler sched;        // TX thread
+  struct linkstats linkstats;
+  struct capture capture;
+  int capturing;
+  pthread_mutex_t capturelock;   // Capture is written by both the RX and TX threads
+  struct status status;          // Status page for clients
+  int publishing;
+  unsigned long published;       // Traffic counted when counters were last published
+  uint64_t lastrx;               // When data last came from the device
+  uint64_t alive;                // Last sign of life from the device, or when it was opened
+  uint64_t probed;               // When a presence check was last sent
+  uint64_t keepalivedue;         // When to check the device is there, 0 if not checking
+  uint64_t retrydue;             // When to try to reopen the device, 0 if connected
+  int reconfigure;               // Device has lost its settings, send them again
+  unsigned int linkgen;          // Bumped when the device is lost or reopened, odd while open
+  unsigned int failedgen;        // linkgen when the RX or TX thread found the device gone
+  int failure;                   // Why: errno, 0 for end of file, -1 for hangup
+  int rxstalled;                 // RX thread waits for decoded data to be taken
+  int txstalled;                 // Device thread waits for room in the pty input queues
+  unsigned long txqueued;        // tx_queued() when the TX thread was last woken
+  int epfd;                      // For waiting on ptys and clients, device thread
+  int wakefd;                    // Wakes the device thread
+  struct watch wakewatch;
+  int rxepfd;                    // For waiting on the device, RX thread
+  int rxwakefd;                  // Wakes the RX thread
+  struct watch rxwakewatch;
+  struct watch rxkeyerwatch;     // Device registration with the RX thread's epoll
+  int txepfd;                    // For waiting on the device and pacing timer, TX thread
+  int txwakefd;                  // Wakes the TX thread
+  struct watch txwakewatch;
+  struct watch txkeyerwatch;     // Device registration with the TX thread's epoll
+  int pacerfd;                   // Timer for sending bulk data held back
+  uint64_t pacerdue;             // When the pacing timer expires, 0 if disarmed
+  struct watch pacerwatch;       // Pacing timer registration with epoll
+  struct keying keying[2];       // CW or FSK keying of radio 1 and 2, TX thread
+  struct ringbuf keyingin[2];    // Text from the keying ptys, not yet keyed
+  int keyingfd;                  // Timer for the next keying edge, -1 if not keying
+  uint64_t keyingdue;            // When the keying timer expires, 0 if disarmed
+  struct watch keyingwatch;      // Keying timer registration with epoll
+  struct jitter jitter;          // Lateness of pacing timer wakeups
+  struct watch ptywatches[MAX_PTYS]; // Pty registrations with epoll
+  int numptywatches;
+  struct catshare shares[2];     // Radio 1 and 2 shared by several ptys
+  struct replay replay;          // Capture replayed instead of using a device
+  struct watch replaywatch;      // Replay timer registration with epoll
+  struct watch feedwatch;        // Replay feed registration with epoll
+  int commandfd;                 // Listening command socket, -1 if none
+  struct watch commandwatch;     // Command socket registration with epoll
+  struct watch clients[COMMAND_CLIENTS]; // Command socket clients, fd -1 if unused
+  struct endpoint endpoints[MAX_CHANNELS]; // Channels offered as sockets
+  int numendpoints;
+  struct latency txlatency[MAX_CHANNELS]; // Channels traced to the device
+  int numtxlatency;
+  struct latency rxlatency[MAX_CHANNELS]; // Channels traced from the device
+  int numrxlatency;
+  struct trace_reads rxreads;    // When data was read from the device, RX thread
+  pthread_t threads[3];          // Device, RX and TX threads
+};
+
+struct devconfig config = { // For the next device named
+  .model = MODEL_UNSUPPORTED,
+  .overflow_policy = {OVERFLOW_DROP_NEWEST, OVERFLOW_DROP_NEWEST, OVERFLOW_DROP_NEWEST, OVERFLOW_DROP_NEWEST, OVERFLOW_DROP_NEWEST},
+  .sched = {.weight = {5, 5}, .backlog_limit = 40, .starve_limit = 8},
+  .capture_size = CAPTURE_SIZE,
+  .rtpolicy = SCHED_FIFO,
+  .share = {1, 1},
+  .cat_protocol = {-1, -1},
+  .cat_ttl = {CAT_TTL, CAT_TTL},
+  .keying_mode = {-1, -1},
+  .keying_weight = {50, 50}
+};
+struct device *devices = NULL;
+int numdevices = 0;
+const char *stats_path = NULL;
+const char *replay_path = NULL;
+int replay_fast = 0;
+uint64_t start_time;
 
 /*
  * Open a new pseudo TTY, set it to raw mode, grant rights and unlock
  *
  * Print error message and exit on failure
  */
-int newpty()
+int newpty(int packet)
 {
   int fd;
+  int one = 1;
   struct termios tio;
 
   if ((fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) {
@@ -80,11 +418,17 @@ int newpty()
     exit(1);
   }
   cfmakeraw(&tio);
+  if (packet)
+    tio.c_lflag |= EXTPROC; // Report every termios change on the slave
   if (tcsetattr(fd, TCSADRAIN, &tio)) {
     // NOTE: This does NOT guarantee that ALL parameters are set
     perror("Can't set PTY communication parameters");
     exit(1);
   }
+  if (packet && ioctl(fd, TIOCPKT, &one)) {
+    perror("Can't set PTY packet mode");
+    exit(1);
+  }
   if (grantpt(fd)) {
     perror("Can't grant PTY access");
     exit(1);
@@ -98,537 +442,3153 @@ int newpty()
 }
 
 /*
- * Initialize a new sequence of (up to) 5 frames
- *
- * No flags set, no channels valid
+ * Current CLOCK_MONOTONIC time in nanoseconds
  */
-void sequence_init(sequence_t seq)
+uint64_t monotonic_ns()
 {
-  int i;
+  struct timespec ts;
 
-  for (i = 0; i < 20; i++)
-    seq[i] = 0x80;
-  for (i = 4; i < 20; i += 4)
-    seq[i] = 0x40;
-  seq[0] = 0x08; // Valid flags in first frame
-  seq[20] = 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /*
- * Set RTS flags in a sequence
+ * Create an eventfd for waking up a thread
+ *
+ * Print error message and exit on failure
  */
-void sequence_set_rts(sequence_t seq, int radio)
+int wakeup_fd()
 {
-  if (radio == 1)
-    seq[3] |= FLAGS_R1_RTS;
-  else if (radio == 2)
-    seq[3] |= FLAGS_R2_RTS;
-  if (seq[20] < 1)
-    seq[20] = 1;
+  int fd;
+
+  if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    perror("Can't create eventfd");
+    exit(1);
+  }
+  return fd;
 }
 
 /*
- * Set PTT flags in a sequence
+ * Wake up the thread waiting on an eventfd
  */
-void sequence_set_ptt(sequence_t seq, int radio)
+void wakeup(int fd)
 {
-  if (radio == 1)
-    seq[3] |= FLAGS_R1_PTT;
-  else if (radio == 2)
-    seq[3] |= FLAGS_R2_PTT;
-  if (seq[20] < 1)
-    seq[20] = 1;
+  uint64_t one = 1;
+
+  if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    perror("Can't wake up thread");
 }
 
 /*
- * Set FSK EXT flags in a sequence
+ * Reset an eventfd after waking up
  */
-void sequence_set_fsk_ext(sequence_t seq, int radio)
+void wakeup_clear(int fd)
 {
-  if (radio == 1)
-    seq[3] |= FLAGS_R1_FSK_EXT;
-  else if (radio == 2)
-    seq[3] |= FLAGS_R2_FSK_EXT;
-  if (seq[20] < 1)
-    seq[20] = 1;
+  uint64_t count;
+
+  if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    perror("Error reading eventfd");
 }
 
 /*
- * Set CW flags in a sequence
+ * Tell the device thread that the device has failed
+ *
+ * Only the first failure seen on a connection counts. err is an errno
+ * value, 0 for end of file or -1 for hangup.
  */
-void sequence_set_cw(sequence_t seq, int radio)
+void link_failed(struct device *d, unsigned int gen, int err)
 {
-  if (radio == 1)
-    seq[3] |= FLAGS_R1_CW;
-  else if (radio == 2)
-    seq[3] |= FLAGS_R2_CW;
-  if (seq[20] < 1)
-    seq[20] = 1;
+  __atomic_store_n(&d->failure, err, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->failedgen, gen, __ATOMIC_RELEASE);
+  wakeup(d->wakefd);
 }
 
 /*
- * Set radio channel byte in a given frame (0-4)
+ * Why the device failed, as told by link_failed()
  */
-void sequence_set_radio(sequence_t seq, int radio, int frame, unsigned char data)
+const char *failure_reason(int err)
 {
-  seq[radio + 4*frame] = 0x80 | data;
-  if (radio == 1)
-    seq[4*frame] |= ((data & 0x080) ? SYNCHRO_MSB_R1 : 0x00) | SYNCHRO_VALID_R1;
-  else if (radio == 2)
-    seq[4*frame] |= ((data & 0x080) ? SYNCHRO_MSB_R2 : 0x00) | SYNCHRO_VALID_R2;
-  if (seq[20] < frame + 1)
-    seq[20] = frame + 1;
+  if (err > 0)
+    return strerror(err);
+  return err ? "Hung up" : "End of file";
 }
 
 /*
- * Set control channel byte
+ * Record len bytes of a ring buffer, starting at free running position pos
  */
-void sequence_set_control(sequence_t seq, unsigned char data, int valid)
+void capture_ring(struct device *d, int direction, const struct ringbuf *rb, size_t pos, size_t len)
 {
-  seq[7] = 0x80 | data;
-  seq[4] |= ((data & 0x080) ? SYNCHRO_MSB_SHARED : 0x00);
-  if (valid) // First and last byte in a command are marked as invalid
-    seq[4] |= SYNCHRO_VALID_SHARED;
-  if (seq[20] < 2)
-    seq[20] = 2;
+  struct iovec iov[2];
+
+  pthread_mutex_lock(&d->capturelock);
+  capture_write(&d->capture, direction, iov, ringbuf_iov(rb, pos, len, iov), monotonic_ns());
+  pthread_mutex_unlock(&d->capturelock);
 }
 
 /*
- * Set Winkey channel byte
+ * Follow bytes from the ptys through the encoder to the device
+ *
+ * Called by the TX thread after encoding and after writing to the device.
+ * If the device is lost, sequences that weren't written are dropped, and
+ * so are the bytes followed in them.
  */
-void sequence_set_winkey(sequence_t seq, unsigned char data)
+void trace_tx(struct device *d, int lost)
 {
-  seq[11] = 0x80 | data;
-  seq[8] |= ((data & 0x080) ? SYNCHRO_MSB_SHARED : 0x00) | SYNCHRO_VALID_SHARED;
-  if (seq[20] < 3)
-    seq[20] = 3;
+  struct latency *l;
+  uint64_t now = monotonic_ns();
+  int state;
+  int i;
+
+  for (i = 0; i < d->numtxlatency; i++) {
+    l = &d->txlatency[i];
+    state = __atomic_load_n(&l->probe.state, __ATOMIC_ACQUIRE);
+    if (state == TRACE_WAITING && trace_passed(l->in->tail, l->probe.pos)) {
+      l->probe.pos = d->keyertx.head - 1;
+      l->probe.mid = now;
+      __atomic_store_n(&l->probe.state, TRACE_PASSED, __ATOMIC_RELAXED);
+    }
+    else if (state == TRACE_PASSED && lost)
+      __atomic_store_n(&l->probe.state, TRACE_IDLE, __ATOMIC_RELEASE);
+    else if (state == TRACE_PASSED && trace_passed(d->keyertx.tail, l->probe.pos)) {
+      trace_add(&l->stage[0], l->probe.mid - l->probe.start);
+      trace_add(&l->stage[1], now - l->probe.mid);
+      trace_add(&l->total, now - l->probe.start);
+      __atomic_store_n(&l->probe.state, TRACE_IDLE, __ATOMIC_RELEASE);
+    }
+  }
 }
 
 /*
- * Set FSK channel byte for given radio
+ * Write queued sequences to the device
+ *
+ * Everything is written with one system call. Whatever the device doesn't
+ * accept stays in the queue until it is writable again. Returns -1, with
+ * errno set, if writing failed for any other reason.
  */
-void sequence_set_fsk(sequence_t seq, int radio, unsigned char data)
+int flush_sequences(struct device *d)
 {
-  seq[11 + radio*4] = 0x80 | data;
-  seq[8 + radio*4] |= ((data & 0x080) ? SYNCHRO_MSB_SHARED : 0x00) | SYNCHRO_VALID_SHARED;
-  if (seq[20] < 3 + radio)
-    seq[20] = 3 + radio;
+  struct ringbuf *out = &d->keyertx;
+  uint64_t now;
+  ssize_t res;
+
+  if (!ringbuf_used(out))
+    return 0;
+  res = ringbuf_write_fd(out, d->ports.keyer);
+  if (res == -1 && errno != EAGAIN && errno != EINTR)
+    return -1;
+  debugprintf(7, "Sent %zi bytes, %zu bytes left.\n", res, ringbuf_used(out));
+
+  // Keep track of when the link will be done sending what was written
+  if (res > 0) {
+    d->linkstats.txbytes += res;
+    if (d->capturing)
+      capture_ring(d, CAPTURE_TX, out, out->tail - res, res);
+    now = monotonic_ns();
+    if (d->sched.link_idle < now)
+      d->sched.link_idle = now;
+    d->sched.link_idle += (uint64_t)res * 1000000000ULL / KEYER_BYTES_PER_SEC;
+    if (d->numtxlatency)
+      trace_tx(d, 0);
+  }
+  return 0;
 }
 
 /*
- * How many frames in the sequence are used?
+ * Number of bytes sent to the device that it hasn't received yet
+ *
+ * Not all drivers count what is buffered in the USB serial converter, so
+ * the driver's count is compared to how much the link can't have sent yet
+ * at link rate, and the larger is used.
  */
-int frames_in_sequence(sequence_t seq)
+size_t device_backlog(int fd, struct scheduler *sched)
 {
-  return seq[20];
+  int outq = 0;
+  uint64_t now = monotonic_ns();
+  size_t inflight = 0;
+
+  if (ioctl(fd, TIOCOUTQ, &outq) == -1)
+    outq = 0;
+  if (sched->link_idle > now)
+    inflight = (sched->link_idle - now) * KEYER_BYTES_PER_SEC / 1000000000ULL;
+
+  return inflight > outq ? inflight : outq;
 }
 
 /*
- * Send a sequence
+ * Wake up when the device backlog has drained by the given number of bytes
  *
- * Only the minimum number of frames necessary from a sequence are actually sent
+ * A zero byte count disarms the timer
  */
-void send_sequence(int fd, sequence_t seq)
+void pace(struct device *d, size_t bytes)
 {
-  int numframes = frames_in_sequence(seq);
-
-  debugprintf(5, "Sending %i frames:\n%02x %02x %02x %02x\n%02x %02x %02x %02x\n%02x %02x %02x %02x \n%02x %02x %02x %02x \n%02x %02x %02x %02x\n", numframes, seq[0], seq[1], seq[2], seq[3], seq[4], seq[5], seq[6], seq[7], seq[8], seq[9], seq[10], seq[11], seq[12], seq[13], seq[14], seq[15], seq[16], seq[17], seq[18], seq[19]);
+  struct itimerspec its;
+  long long ns = (long long)bytes * 1000000000LL / KEYER_BYTES_PER_SEC;
 
-  // TODO: Better error handling
-  if (write(fd, seq, numframes*4) != numframes*4) {
-    perror("Error sending sequence to device");
+  memset(&its, 0, sizeof(its));
+  d->pacerdue = 0;
+  if (bytes) {
+    its.it_value.tv_sec = ns / 1000000000LL;
+    its.it_value.tv_nsec = ns % 1000000000LL;
+    d->pacerdue = monotonic_ns() + ns;
   }
-  else
-    debugprintf(7, "Send successful.\n");
+  if (timerfd_settime(d->pacerfd, 0, &its, NULL))
+    perror("Can't set pacing timer");
 }
 
 /*
- * Decode a 4 octet frame
- *
- * Keeps a static sequence position
+ * Record how late a timer wakeup was
  */
-void decode_frame(frame_t frame, struct ports *ports)
+void jitter_add(struct jitter *j, uint64_t due, uint64_t now)
 {
-  static int sequencepos = 0;
-  int radio_index;
+  uint64_t late = now > due ? now - due : 0;
 
-  // Synchronize on SYNCHRO_SEQUENCE
-  if (!(frame[0] & 0xC0))
-    sequencepos = 0;
+  j->samples++;
+  j->total += late;
+  if (late > j->max)
+    j->max = late;
+}
 
-  // Decode R1 data channel
-  if (frame[0] & SYNCHRO_VALID_R1) {
-    if (!(frame[0] & SYNCHRO_MSB_R1))
-      frame[1] &= 0x7F;
-    debugprintf(3, "R1: %02x ('%c')\n", frame[1], frame[1]);
-    if (ports->radio1 >= 0 && write(ports->radio1, &frame[1], 1) != 1)
-      perror("Error writing to radio1");
-  }
+/*
+ * Key the radios that are keyed from their keying ptys
+ *
+ * Text queued since the last call is turned into elements, the edges that
+ * are due go out in the next sequence, and the keying timer is armed for
+ * the next edge. Returns the number of bytes taken from the keying ptys'
+ * queues.
+ */
+size_t run_keying(struct device *d)
+{
+  static const unsigned char keyflags[2][2] = {{FLAGS_R1_CW, FLAGS_R2_CW}, {FLAGS_R1_FSK_EXT, FLAGS_R2_FSK_EXT}};
+  struct itimerspec its;
+  struct keying *k;
+  unsigned char flags = 0;
+  uint64_t now = monotonic_ns();
+  uint64_t due = 0;
+  size_t taken = 0;
+  int i;
 
-  // Decode R2 data channel
-  if (frame[0] & SYNCHRO_VALID_R2) {
-    if (!(frame[0] & SYNCHRO_MSB_R2))
-      frame[2] &= 0x7F;
-    debugprintf(3, "R2: %02x ('%c')\n", frame[2], frame[2]);
-    if (ports->radio2 >= 0 && write(ports->radio2, &frame[2], 1) != 1)
-      perror("Error writing to radio2");
+  for (i = 0; i < 2; i++) {
+    k = &d->keying[i];
+    if (d->config.keying_mode[i] < 0)
+      continue;
+    taken += keying_feed(k, &d->keyingin[i]);
+    if (keying_run(k, now))
+      flags |= keyflags[k->mode][i];
+    if (k->due && (!due || k->due < due))
+      due = k->due;
   }
+  set_keyflags(&d->txq, flags);
 
-  // Decode shared channel
-  if (frame[0] & SYNCHRO_VALID_SHARED || sequencepos == 1) {
-    if (!(frame[0] & SYNCHRO_MSB_SHARED))
-      frame[3] &= 0x7F;
-    switch (sequencepos) {
-    case 0: // FLAGS
-      radio_index = (frame[3] & FLAGS_IS_R2) ? 1 : 0;
-      if (frame[3] & FLAGS_CTS) {
-	debugprintf(4, "R%i flags: CTS\n", radio_index+1);
-	// TODO: Set radio no. radio_index CTS = (frame[3] & FLAGS_CTS)
-      }
-      if (frame[3] & FLAGS_SQUELCH) {
-	debugprintf(4, "R%i flags: SQUELCH\n", radio_index+1);
-	// TODO: Set radio no. radio_index squelch = (frame[3] & FLAGS_SQUELCH)
-      }
-      if (frame[3] & FLAGS_FSK_BUSY) {
-	debugprintf(4, "R%i flags: FSK BUSY\n", radio_index+1);
-	// TODO: Set radio no. radio_index fsk_busy = (frame[3] & FLAGS_FSK_BUSY)
-      }
-      if (frame[3] & FLAGS_ANY_PTT_ON) {
-	debugprintf(4, "R%i flags: ANY PTT ON\n", radio_index+1);
-	// TODO: Set radio no. radio_index any_ptt_on = (frame[3] & FLAGS_ANY_PTT_ON)
-      }
-      if (frame[3] & FLAGS_FOOTSWITCH) {
-	debugprintf(4, "R%i flags: FOOTSWITCH\n", radio_index+1);
-	// TODO: Set radio no. radio_index footswitch = (frame[3] & FLAGS_FOOTSWITCH)
-      }
-      break;
-    case 1: // CONTROL
-      if (frame[3]) { // Ignore NOPs from device
-	debugprintf(3, "CONTROL: %02x ('%c')\n", frame[3], frame[3]);
-	if (ports->control >= 0 && write(ports->control, &frame[3], 1) != 1)
-	  perror("Error writing to control");
-      }
-      break;
-    case 2: // WINKEY
-      debugprintf(3, "WINKEY: %02x ('%c')\n", frame[3], frame[3]);
-      if (ports->winkey >= 0 && write(ports->winkey, &frame[3], 1) != 1)
-	perror("Error writing to winkey");
-      break;
-    case 3: // KEYBOARD
-      debugprintf(3, "KEYBOARD: %02x ('%c')\n", frame[3], frame[3]);
-      if (ports->keyboard >= 0 && write(ports->keyboard, &frame[3], 1) != 1)
-	perror("Error writing to keyboard");
-      break;
-    default: // Should not happen. Each input sequence consists of max 4 frames.
-      debugprintf(2, "Received frame %i in sequence of 4. Offending frame: 0x%02x 0x%02x 0x%02x 0x%02x\n", sequencepos, frame[0], frame[1], frame[2], frame[3]);
-      break;
-    }
+  // The timer is absolute, so time spent getting here isn't added
+  if (due != d->keyingdue) {
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+    d->keyingdue = due;
+    if (timerfd_settime(d->keyingfd, TFD_TIMER_ABSTIME, &its, NULL))
+      perror("Can't set keying timer");
   }
+  return taken;
+}
 
-  sequencepos++;
+/*
+ * Initialize an output queue
+ */
+void outqueue_init(struct outqueue *q, size_t size, int policy)
+{
+  ringbuf_init(&q->link, LINK_QUEUE_SIZE);
+  ringbuf_init(&q->buf, size);
+  q->policy = policy;
+  q->dropped = 0;
+  q->endpoint = NULL;
+  q->latency = NULL;
 }
 
-void show_version()
+void outqueue_free(struct outqueue *q)
 {
-  printf("microkeyer 0.1\n");
-  exit(0);
+  ringbuf_free(&q->link);
+  ringbuf_free(&q->buf);
 }
 
-void show_help()
+/*
+ * Give output for a channel to one of its socket clients
+ *
+ * On a SOCK_SEQPACKET socket, each call is one message. What the client
+ * has no room for is dropped.
+ */
+void endpoint_queue(struct endpoint *ep, int client, const unsigned char *data, size_t len)
 {
-  printf("Usage: microkeyer [OPTIONS] -m MODEL DEVICE\n");
-  printf("\n Help and debug:\n");
-  printf("  -m, --model=MODEL       Set keyer model (MK, MK2, MK2R, MK2R+, CK, DK, DK2, U2R, SM)\n");
-  printf("  -h, --help              Display this help text\n");
-  printf("  -v, --verbose           Show debug output (repeat for more verbosity)\n");
-  printf("  -V, --version           Show version information\n");
-  printf("\n");
-  exit(0);
+  struct watch *w = &ep->clients[client];
+  size_t queued;
+
+  if (w->fd < 0)
+    return;
+  if (ep->type == SOCK_SEQPACKET)
+    queued = send(w->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 ? 0 : len;
+  else
+    queued = ringbuf_put(&ep->out[client].buf, data, len);
+  if (queued < len) {
+    debugprintf(2, "Client of %s socket doesn't keep up, dropping %zu bytes\n", ep->name, len - queued);
+    ep->dropped += len - queued;
+    ep->out[client].dropped += len - queued;
+  }
+  if (ep->type == SOCK_SEQPACKET)
+    w->stats.out += queued;
 }
 
 /*
- * Parse command line arguments
+ * Give output for a channel to all of its socket clients
  */
-char *parseargs(int argc, char *argv[])
+void endpoint_output(struct endpoint *ep, const unsigned char *data, size_t len)
 {
-  static struct option long_options[] = {
-    {"help", no_argument, NULL, 'h'},
-    {"model", required_argument, NULL, 'm'},
-    {"verbose", no_argument, NULL, 'v'},
-    {"version", no_argument, NULL, 'V'}
-  };
-  int c;
-  int option_index;
-  char *devicename = NULL;
+  int i;
 
-  while ((c = getopt_long(argc, argv, "-hm:vV", long_options, &option_index)) != -1) {
-    switch (c) {
-    case 1:
-      if (!devicename)
-        devicename = optarg;
-      else
-        show_help();
-      break;
-    case 'm':
-      if (!strcasecmp(optarg, "MK"))
-	keyer_model = MODEL_MK;
-      else if (!strcasecmp(optarg, "DK"))
-	keyer_model = MODEL_DK;
-      else if (!strcasecmp(optarg, "CK"))
-	keyer_model = MODEL_CK;
-      else if (!strcasecmp(optarg, "MK2R"))
-	keyer_model = MODEL_MK2R;
-      else if (!strcasecmp(optarg, "MK2R+"))
-	keyer_model = MODEL_MK2RPLUS;
-      else if (!strcasecmp(optarg, "MK2"))
-	keyer_model = MODEL_MK2;
-      else if (!strcasecmp(optarg, "DK2"))
-	keyer_model = MODEL_DK2;
-      else if (!strcasecmp(optarg, "U2R"))
-	keyer_model = MODEL_U2R;
-      else if (!strcasecmp(optarg, "SM"))
-	keyer_model = MODEL_SM;
-      // TODO: Add MODEL_SMD
-      break;
-    case 'v':
-      verbosity++;
-      break;
-    case 'V':
-      show_version();
-      break;
-    case 'h':
-    case '?':
-    default:
-      show_help();
-      break;
+  for (i = 0; i < SOCKET_CLIENTS; i++)
+    endpoint_queue(ep, i, data, len);
+}
+
+/*
+ * Queue decoded bytes for output to a pty
+ *
+ * If they don't all fit, either the new or the oldest bytes are dropped,
+ * depending on policy. With OVERFLOW_BLOCK, take_output() makes sure there
+ * is always room.
+ */
+void queue_output(struct outqueue *q, const unsigned char *data, size_t len, const char *name)
+{
+  size_t excess;
+  size_t i;
+
+  if (!q->buf.size || !len) // Channel not present on this model
+    return;
+  if (q->endpoint)
+    endpoint_output(q->endpoint, data, len);
+  if (LOG_ENABLED(3)) {
+    debugprintf(3, "%s:", name);
+    for (i = 0; i < len; i++)
+      debugprintf(3, " %02x", data[i]);
+    debugprintf(3, "\n");
+  }
+  if (len > ringbuf_space(&q->buf)) {
+    excess = len - ringbuf_space(&q->buf);
+    q->dropped += excess;
+    debugprintf(2, "Output buffer for %s full, dropping %zu bytes\n", name, excess);
+    if (q->policy == OVERFLOW_DROP_OLDEST) {
+      if (len > q->buf.size) {
+	data += len - q->buf.size;
+	len = q->buf.size;
+      }
+      ringbuf_skip(&q->buf, len - ringbuf_space(&q->buf));
     }
   }
+  ringbuf_put(&q->buf, data, len); // Drops the newest bytes if still full
+}
 
-  return devicename;
+/*
+ * How many more bytes can be queued without dropping any?
+ *
+ * Only limited for queues with OVERFLOW_BLOCK policy
+ */
+size_t outqueue_room(const struct outqueue *q)
+{
+  if (q->policy != OVERFLOW_BLOCK || !q->buf.size)
+    return (size_t)-1;
+  return ringbuf_space(&q->buf);
 }
 
-int main(int argc, char *argv[])
+/*
+ * How many more bytes can the RX thread pass on?
+ *
+ * The RX thread holds back frames until the device thread has taken what
+ * was passed on before, so overflow policies are applied in one place.
+ */
+size_t link_room(const struct outqueue *q)
 {
-  char *devicename = NULL;       // Name of microkeyer device
-  struct ports ports = {-1, -1, -1, -1, -1, -1, -1, -1}; // File descriptors for device and ptys
-  struct termios oldtio, newtio; // For keyer
-  fd_set allfds;                 // All available file descriptors
+  if (!q->buf.size)
+    return (size_t)-1;
+  return ringbuf_space(&q->link);
+}
 
-  // Parse command line arguments
-  devicename = parseargs(argc, argv);
-  if (!devicename || !strlen(devicename) || keyer_model == MODEL_UNSUPPORTED)
-    show_help();
-  debugprintf(1, "Using microkeyer device %s.\n", devicename);
+/*
+ * Pass decoded bytes on to the device thread, for output to a pty
+ *
+ * decode_frames() makes sure there is always room.
+ */
+void pass_output(struct outqueue *q, const unsigned char *data, size_t len)
+{
+  if (!q->buf.size || !len) // Channel not present on this model
+    return;
+  ringbuf_put(&q->link, data, len);
+}
 
-  // Connect to device
-  if ((ports.keyer = open(devicename, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) {
-    perror("Can't open microkeyer device");
-    exit(1);
-  }
+/*
+ * Queue the bytes the RX thread has passed on for output to a pty
+ *
+ * If fit is set, only as much is taken as there is room for. Otherwise,
+ * the overflow policy decides, and with OVERFLOW_BLOCK, the RX thread
+ * holds back the rest. Returns the number of bytes taken.
+ */
+size_t take_output(struct outqueue *q, const char *name, int fit)
+{
+  struct latency *l = q->latency;
+  unsigned char *ptr;
+  size_t len, taken = 0;
 
-  if (tcgetattr(ports.keyer, &oldtio)) {
-    perror("Can't get device communication parameters");
-    exit(1);
+  if (!q->buf.size)
+    return 0;
+  while ((len = MIN(ringbuf_contig(&q->link, &ptr), fit ? ringbuf_space(&q->buf) : outqueue_room(q)))) {
+    queue_output(q, ptr, len, name);
+    ringbuf_skip(&q->link, len);
+    taken += len;
   }
-  newtio = oldtio;
-  cfmakeraw(&newtio);
-  cfsetispeed(&newtio, B230400);
-  cfsetospeed(&newtio, B230400);
-  if (tcsetattr(ports.keyer, TCSADRAIN, &newtio)) {
-    // NOTE: This does NOT guarantee that ALL parameters are set
-    perror("Can't set device communication parameters");
-    exit(1);
+  // A byte followed from the device now waits to be written to the pty
+  if (l && __atomic_load_n(&l->probe.state, __ATOMIC_ACQUIRE) == TRACE_WAITING && trace_passed(q->link.tail, l->probe.pos)) {
+    l->probe.pos = q->buf.head - 1;
+    __atomic_store_n(&l->probe.state, TRACE_PASSED, __ATOMIC_RELAXED);
   }
-  FD_ZERO(&allfds);
-  FD_SET(ports.keyer, &allfds);
+  return taken;
+}
 
-  // TODO: Check device type automatically with GET VERSION command and set keyer_model
+/*
+ * Queue a CAT reply for the ptys and socket clients it is for
+ */
+void deliver_cat(struct catshare *s, const struct cat_reply *r)
+{
+  int i;
 
-  // TODO: Add option to create symlinks and/or print pty slaves
+  for (i = 0; i < s->cat.numclients; i++)
+    if (r->to & (1U << i)) {
+      if (i < s->numptys)
+	queue_output(s->watches[i]->out, r->data, r->len, s->watches[i]->name);
+      else
+	endpoint_queue(s->endpoint, i - s->numptys, r->data, r->len);
+    }
+}
 
-  // Open ptys
-  ports.control = newpty();
-  printf("Control: %s\n", (char *)ptsname(ports.control));
-  FD_SET(ports.control, &allfds);
+/*
+ * How many more bytes can be taken from the radio for a shared channel?
+ *
+ * A reply may go to all ptys, so the fullest queue decides. If fit is
+ * set, that is how much fits, otherwise it is only limited for queues with
+ * OVERFLOW_BLOCK policy. Socket clients that don't keep up lose data, as
+ * on other channels, so they don't count.
+ */
+size_t share_room(struct catshare *s, int fit)
+{
+  size_t room = (size_t)-1;
+  int i;
 
-  if (keyer_model != MODEL_U2R) {
-    ports.radio1 = newpty();
-    printf("Radio 1: %s\n", (char *)ptsname(ports.radio1));
-    FD_SET(ports.radio1, &allfds);
-  }
+  for (i = 0; i < s->numptys; i++)
+    room = MIN(room, fit ? ringbuf_space(&s->watches[i]->out->buf) : outqueue_room(s->watches[i]->out));
+  return room;
+}
 
-  if (keyer_model == MODEL_MK2R || keyer_model == MODEL_MK2RPLUS || keyer_model == MODEL_MK2 || keyer_model == MODEL_SM) {
-    // MK2 and SM has AUX, not RADIO2, but it is only the name of the port that changes
-    ports.radio2 = newpty();
-    printf("Radio 2: %s\n", (char *)ptsname(ports.radio2));
-    FD_SET(ports.radio2, &allfds);
-  }
+/*
+ * Route what the RX thread has passed on from a shared radio channel to
+ * the ptys that asked for it
+ *
+ * Returns the number of bytes taken.
+ */
+size_t take_cat(struct catshare *s, struct outqueue *q, int fit)
+{
+  struct cat_reply r;
+  const unsigned char *data;
+  unsigned char *ptr;
+  size_t len, left, taken = 0;
+  uint64_t now = monotonic_ns();
 
-  if (keyer_model != MODEL_CK && keyer_model != MODEL_SM) {
-    ports.fsk1 = newpty();
-    printf("FSK 1: %s\n", (char *)ptsname(ports.fsk1));
-    FD_SET(ports.fsk1, &allfds);
+  while ((len = MIN(ringbuf_contig(&q->link, &ptr), share_room(s, fit)))) {
+    data = ptr;
+    left = len;
+    while (cat_receive(&s->cat, &data, &left, now, &r))
+      deliver_cat(s, &r);
+    ringbuf_skip(&q->link, len);
+    taken += len;
   }
+  return taken;
+}
+
+/*
+ * Print flags from the device that have changed
+ */
+void print_flags(uint32_t oldflags, uint32_t flags)
+{
+  int radio;
+  unsigned char old, new;
 
-  if (keyer_model == MODEL_MK2R || keyer_model == MODEL_MK2RPLUS || keyer_model == MODEL_U2R) {
-    ports.fsk2 = newpty();
-    printf("FSK 2: %s\n", (char *)ptsname(ports.fsk1));
-    FD_SET(ports.fsk2, &allfds);
+  for (radio = 1; radio <= 2; radio++) {
+    old = radio == 1 ? DECODER_FLAGS_R1(oldflags) : DECODER_FLAGS_R2(oldflags);
+    new = radio == 1 ? DECODER_FLAGS_R1(flags) : DECODER_FLAGS_R2(flags);
+    if (old == new)
+      continue;
+    debugprintf(4, "R%i flags:%s%s%s%s%s\n", radio,
+		(new & FLAGS_CTS) ? " CTS" : "",
+		(new & FLAGS_SQUELCH) ? " SQUELCH" : "",
+		(new & FLAGS_FSK_BUSY) ? " FSK BUSY" : "",
+		(new & FLAGS_ANY_PTT_ON) ? " ANY PTT ON" : "",
+		(new & FLAGS_FOOTSWITCH) ? " FOOTSWITCH" : "");
   }
+}
+
+/*
+ * Count how long a byte followed from the device took, if it has been
+ * written to the pty
+ *
+ * The RX thread may pick a new one as soon as it sees the probe idle.
+ */
+void trace_written(struct latency *l, size_t tail)
+{
+  struct trace_probe *p = &l->probe;
+  uint64_t now;
 
-  if (keyer_model != MODEL_DK && keyer_model != MODEL_SM) {
-    ports.winkey = newpty();
-    printf("Winkey: %s\n", (char *)ptsname(ports.winkey));
-    FD_SET(ports.winkey, &allfds);
+  if (__atomic_load_n(&p->state, __ATOMIC_RELAXED) != TRACE_PASSED || !trace_passed(tail, p->pos))
+    return;
+  now = monotonic_ns();
+  trace_add(&l->stage[0], p->mid - p->start);
+  trace_add(&l->stage[1], now - p->mid);
+  trace_add(&l->total, now - p->start);
+  __atomic_store_n(&p->state, TRACE_IDLE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write as much as possible of what is queued for a pty
+ *
+ * Everything is written with a single system call. Whatever the pty doesn't
+ * accept stays queued until it is writable.
+ */
+void write_pty(struct watch *w)
+{
+  ssize_t res;
+
+  if (!ringbuf_used(&w->out->buf))
+    return;
+  res = ringbuf_write_fd(&w->out->buf, w->fd);
+  debugprintf(6, "Output to %s: %zi bytes, %zu bytes left\n", w->name, res, ringbuf_used(&w->out->buf));
+  if (res > 0) {
+    w->stats.out += res;
+    if (w->out->latency)
+      trace_written(w->out->latency, w->out->buf.tail);
+  }
+  if (ringbuf_used(&w->out->buf) && (res >= 0 || errno == EAGAIN))
+    w->stats.eagain++;
+  if (res == -1 && errno != EAGAIN && errno != EINTR) {
+    fprintf(stderr, "Error writing to %s: %s\n", w->name, strerror(errno));
+    w->out->dropped += ringbuf_used(&w->out->buf);
+    ringbuf_clear(&w->out->buf);
   }
+}
+
+/*
+ * Write what is queued for the clients of the channel sockets
+ */
+void write_endpoints(struct device *d)
+{
+  struct endpoint *ep;
+  int i, j;
 
-  if (keyer_model != MODEL_SM) {
-    ports.keyboard = newpty();
-    printf("Keyboard: %s\n", (char *)ptsname(ports.keyboard));
-    FD_SET(ports.keyboard, &allfds);
+  for (i = 0; i < d->numendpoints; i++) {
+    ep = &d->endpoints[i];
+    for (j = 0; j < SOCKET_CLIENTS; j++)
+      if (ep->clients[j].fd >= 0 && ep->clients[j].out)
+	write_pty(&ep->clients[j]);
   }
+}
 
-  // Mux and demux until exit
-  int framepos = 0; // Current position in input frame from device
-  unsigned char controlendbyte = 0x00; // Byte that will finish the current control command
-  fd_set eoffds; // File descriptors that are not waited for by select
-  FD_ZERO(&eoffds);
-  while (1) { // TODO: Fix loop condition
-    fd_set fds; // File descriptors that are waited for by select
-    struct timeval tv;
-    int numready = -1; // Number of ready ports
-    frame_t frame; // Current frame read from device
-    sequence_t sequence; // Next sequence to output to device
-    unsigned char data; // Data read from pty
-
-    // Set up fds to all except those that return EOF or other error
-    fds = allfds;
-    if (FD_ISSET(ports.keyer, &eoffds))
-      FD_CLR(ports.keyer, &fds);
-    if (FD_ISSET(ports.control, &eoffds))
-      FD_CLR(ports.control, &fds);
-    if (FD_ISSET(ports.radio1, &eoffds))
-      FD_CLR(ports.radio1, &fds);
-    if (FD_ISSET(ports.radio2, &eoffds))
-      FD_CLR(ports.radio2, &fds);
-    if (FD_ISSET(ports.fsk1, &eoffds))
-      FD_CLR(ports.fsk1, &fds);
-    if (FD_ISSET(ports.fsk2, &eoffds))
-      FD_CLR(ports.fsk2, &fds);
-    if (FD_ISSET(ports.winkey, &eoffds))
-      FD_CLR(ports.winkey, &fds);
-    if (FD_ISSET(ports.keyboard, &eoffds))
-      FD_CLR(ports.keyboard, &fds);
-
-    // Wait for input from device or ptys
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000; // If we wait too long, reopened PTYs are not read
-    while (numready < 0) {
-      numready = select(20, &fds, NULL, NULL, &tv); // NOTE: 20 is more than enough
-      if (numready == -1 && errno != EINTR) {
-	perror("Error selecting input");
-	exit(1);
+/*
+ * Answer a command from a command socket client
+ *
+ * The reply is one message: status, command byte and the reply from the
+ * device, if any. If the client doesn't keep up, the reply is lost.
+ */
+void send_reply(struct watch *w, int status, unsigned char cmd, const unsigned char *data, size_t len)
+{
+  unsigned char hdr[2] = {status, cmd};
+  struct iovec iov[2];
+  struct msghdr msg;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = len ? 2 : 1;
+  if (sendmsg(w->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+    debugprintf(2, "Reply to %s lost: %s\n", w->name, strerror(errno));
+}
+
+/*
+ * Hand a finished command, or a message nobody asked for, to whoever it
+ * is for
+ *
+ * If the device doesn't take channel settings from the daemon, they are
+ * sent again on the next change. If it says it has restarted, it has lost
+ * them, and they are sent again at once.
+ */
+void deliver_reply(struct device *d, const struct control_reply *r)
+{
+  int i;
+
+  if (r->to == COMMAND_FROM_PTY && r->cmd == CONTROL_JUST_RESTARTED && r->status == REPLY_OK) {
+    debugprintf(1, "Device restarted.\n");
+    d->linkstats.restarts++;
+    d->reconfigure = 1;
+  }
+  if (r->to == COMMAND_FROM_PTY)
+    queue_output(&d->rxq.control, r->data, r->len, "control");
+  else if (r->to >= COMMAND_CLIENTS) {
+    struct watch *w = &d->endpoints[0].clients[r->to - COMMAND_CLIENTS];
+    // The control socket gets what the control pty would
+    if (r->len && w->fd >= 0 && send(w->fd, r->data, r->len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+      debugprintf(2, "Reply to control socket client lost: %s\n", strerror(errno));
+  }
+  else if (r->to >= 0 && d->clients[r->to].fd >= 0)
+    send_reply(&d->clients[r->to], r->status, r->cmd, r->data, r->len);
+  else if (r->to == COMMAND_FROM_DAEMON && r->status != REPLY_OK) {
+    if (r->status == REPLY_UNSUPPORTED)
+      fprintf(stderr, "Device doesn't support control command %02x\n", r->cmd);
+    for (i = 0; i < d->numptywatches; i++)
+      if (d->ptywatches[i].channelcmd == r->cmd)
+	d->ptywatches[i].channelsent = 0;
+  }
+}
+
+/*
+ * Match control channel data from the device to the commands in flight
+ */
+void receive_control(struct device *d, const unsigned char *data, size_t len)
+{
+  struct control_reply r;
+
+  while (control_receive(&d->control, &data, &len, &r))
+    deliver_reply(d, &r);
+}
+
+/*
+ * Start following a byte from the device on each channel that got output
+ * and isn't following one already
+ *
+ * pos is the last byte decoded. The byte is the last one passed on for the
+ * channel, and is taken to have come with the read that brought pos.
+ */
+void trace_decoded(struct device *d, const struct decoded *out, size_t pos)
+{
+  struct latency *l;
+  uint64_t now = 0;
+  uint64_t read = 0;
+  int i;
+
+  for (i = 0; i < d->numrxlatency; i++) {
+    l = &d->rxlatency[i];
+    if (!out->len[l->channel] || __atomic_load_n(&l->probe.state, __ATOMIC_ACQUIRE) != TRACE_IDLE)
+      continue;
+    if (!now) {
+      now = monotonic_ns();
+      if (!(read = trace_read_time(&d->rxreads, pos)))
+	return;
+    }
+    l->probe.pos = l->out->link.head - 1;
+    l->probe.start = read;
+    l->probe.mid = now;
+    __atomic_store_n(&l->probe.state, TRACE_WAITING, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Decode all complete frames in the buffer and pass the output on to the
+ * device thread
+ *
+ * Bytes that aren't part of a well framed frame are skipped. Stops early if
+ * the link to the device thread doesn't have room for the output. The
+ * remaining frames are decoded when the device thread has taken what was
+ * passed on before. Returns the number of frames decoded.
+ */
+size_t decode_frames(struct device *d)
+{
+  struct ringbuf *rb = &d->keyerrx;
+  struct rxqueues *q = &d->rxq;
+  struct decoder *dec = &d->dec;
+  struct decoded out;
+  struct iovec iov[2];
+  unsigned char *ptr;
+  frame_t frame;
+  size_t nframes = ringbuf_used(rb) / sizeof(frame_t);
+  size_t room, count, contig, len;
+  uint32_t oldflags = dec->flags;
+  int c;
+
+  // Each frame adds at most one byte to each channel
+  room = link_room(&q->control);
+  room = MIN(room, link_room(&q->radio1));
+  room = MIN(room, link_room(&q->radio2));
+  room = MIN(room, link_room(&q->winkey));
+  room = MIN(room, link_room(&q->keyboard));
+  if (room < nframes) {
+    debugprintf(7, "Output blocked, %zu bytes left undecoded.\n", ringbuf_used(rb) - room * sizeof(frame_t));
+    nframes = room;
+  }
+
+  for (c = 0; c < DECODE_CHANNELS; c++) {
+    out.data[c] = q->decoded[c];
+    out.len[c] = 0;
+  }
+  for (count = 0; count < nframes; count += contig) {
+    if ((len = ringbuf_contig(rb, &ptr)) < sizeof(frame_t)) { // Frame wraps around the end of the buffer
+      ringbuf_iov(rb, rb->tail, sizeof(frame_t), iov);
+      memcpy(frame, iov[0].iov_base, iov[0].iov_len);
+      memcpy(frame + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+      ptr = frame;
+      len = sizeof(frame_t);
+    }
+    contig = MIN(len / sizeof(frame_t), nframes - count);
+    if (!(contig = decoder_check(ptr, contig))) {
+      // Framing lost, skip to where the next frame may start
+      ringbuf_skip(rb, decoder_resync(dec, ptr, len));
+      nframes = MIN(room, count + ringbuf_used(rb) / sizeof(frame_t));
+      continue;
+    }
+    decoder_run(dec, ptr, contig, &out);
+    ringbuf_skip(rb, contig * sizeof(frame_t));
+  }
+  if (!count)
+    return 0;
+  debugprintf(4, "Decoded %zu frames.\n", count);
+
+  pass_output(&q->control, out.data[DECODE_CONTROL], out.len[DECODE_CONTROL]);
+  pass_output(&q->radio1, out.data[DECODE_R1], out.len[DECODE_R1]);
+  pass_output(&q->radio2, out.data[DECODE_R2], out.len[DECODE_R2]);
+  pass_output(&q->winkey, out.data[DECODE_WINKEY], out.len[DECODE_WINKEY]);
+  pass_output(&q->keyboard, out.data[DECODE_KEYBOARD], out.len[DECODE_KEYBOARD]);
+  if (d->numrxlatency)
+    trace_decoded(d, &out, rb->tail - 1);
+  if (dec->flags != oldflags) {
+    __atomic_store_n(&d->rxflags, dec->flags, __ATOMIC_RELAXED);
+    print_flags(oldflags, dec->flags);
+  }
+  for (c = 0; c < DECODE_CHANNELS && !out.len[c]; c++)
+    ;
+  if (c < DECODE_CHANNELS || dec->flags != oldflags)
+    wakeup(d->wakefd);
+
+  return count;
+}
+
+/*
+ * Decode what has been read from the device
+ *
+ * If frames are held back, the device thread is asked to wake us up when
+ * it has made room for them.
+ */
+void rx_decode(struct device *d)
+{
+  d->linkstats.rxframes += decode_frames(d);
+  if (ringbuf_used(&d->keyerrx) < sizeof(frame_t))
+    return;
+  // It may have made room before it saw that we are waiting
+  __atomic_store_n(&d->rxstalled, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  d->linkstats.rxframes += decode_frames(d);
+}
+
+/*
+ * Take control channel data from the RX thread and match it to the
+ * commands in flight
+ *
+ * Takes no more than fit_output() would for the control pty. Returns the
+ * number of bytes taken.
+ */
+size_t take_control(struct device *d, int fit)
+{
+  struct outqueue *q = &d->rxq.control;
+  unsigned char *ptr;
+  size_t len, taken = 0;
+
+  while ((len = MIN(ringbuf_contig(&q->link, &ptr), fit ? ringbuf_space(&q->buf) : outqueue_room(q)))) {
+    receive_control(d, ptr, len);
+    ringbuf_skip(&q->link, len);
+    taken += len;
+  }
+  return taken;
+}
+
+/*
+ * Queue what the RX thread has decoded, and write it to the ptys
+ *
+ * Output is written as it is queued, so that overflow policies only apply
+ * to what the ptys really don't take. Control channel data goes through
+ * the command engine, which queues what is for the control pty. If the RX
+ * thread is holding back frames, it is woken up to decode them.
+ */
+void take_decoded(struct device *d)
+{
+  struct rxqueues *q = &d->rxq;
+  size_t taken;
+  int fit = 1;
+  int i;
+
+  do {
+    taken = take_control(d, fit);
+    if (d->shares[0].cat.numclients)
+      taken += take_cat(&d->shares[0], &q->radio1, fit);
+    else
+      taken += take_output(&q->radio1, "radio1", fit);
+    if (d->shares[1].cat.numclients)
+      taken += take_cat(&d->shares[1], &q->radio2, fit);
+    else
+      taken += take_output(&q->radio2, "radio2", fit);
+    taken += take_output(&q->winkey, "winkey", fit);
+    taken += take_output(&q->keyboard, "keyboard", fit);
+    for (i = 0; i < d->numptywatches; i++)
+      if (d->ptywatches[i].out)
+	write_pty(&d->ptywatches[i]);
+    write_endpoints(d);
+    if (!taken)
+      fit = !fit;
+  } while (taken || !fit);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&d->rxstalled, __ATOMIC_RELAXED) && __atomic_exchange_n(&d->rxstalled, 0, __ATOMIC_SEQ_CST))
+    wakeup(d->rxwakefd);
+}
+
+/*
+ * Close a device that has gone away and start trying to reopen it
+ *
+ * The ptys stay open. Commands in flight are given up on, cached CAT
+ * replies are forgotten, and the TX thread discards sequences encoded for
+ * the lost connection, since the device may have got only part of one.
+ * Data from the ptys stays queued and is sent when the device is back.
+ */
+void device_lost(struct device *d, const char *why)
+{
+  struct control_reply reply;
+  int null;
+
+  fprintf(stderr, "Lost connection to microkeyer device %s: %s\n", d->name, why);
+  d->linkstats.losses++;
+  if ((null = open("/dev/null", O_RDWR | O_CLOEXEC)) == -1 || dup3(null, d->ports.keyer, O_CLOEXEC) == -1) {
+    perror("Can't close microkeyer device");
+    exit(1);
+  }
+  close(null);
+  __atomic_store_n(&d->linkgen, d->linkgen + 1, __ATOMIC_RELEASE);
+  wakeup(d->rxwakefd);
+  wakeup(d->txwakefd);
+  d->retrydue = monotonic_ns() + RECONNECT_INTERVAL;
+  while (control_expire(&d->control, UINT64_MAX, &reply))
+    deliver_reply(d, &reply);
+  cat_flush(&d->shares[0].cat);
+  cat_flush(&d->shares[1].cat);
+}
+
+/*
+ * Read everything available from the device and decode all complete frames
+ *
+ * An incomplete frame at the end of the input is left in the buffer until
+ * the rest of it arrives, so the decoder's sequence position is never
+ * advanced by a partial frame. The decoded data is passed on after each
+ * batch of frames. Returns -1 if the device has failed, 0 otherwise.
+ */
+int receive_frames(struct device *d, unsigned int gen)
+{
+  struct ringbuf *rb = &d->keyerrx;
+  size_t space;
+  ssize_t res;
+  uint64_t now;
+
+  do {
+    if (!(space = ringbuf_space(rb)))
+      break; // Output is blocked
+    res = ringbuf_read_fd(rb, d->ports.keyer);
+    if (res == 0 || (res == -1 && errno != EAGAIN && errno != EINTR)) {
+      link_failed(d, gen, res ? errno : 0);
+      return -1;
+    }
+    if (res > 0) {
+      now = monotonic_ns();
+      if (d->numrxlatency)
+	trace_read(&d->rxreads, rb->head, now);
+      d->linkstats.rxbytes += res;
+      __atomic_store_n(&d->lastrx, now, __ATOMIC_RELAXED);
+      __atomic_store_n(&d->alive, now, __ATOMIC_RELAXED);
+      if (d->capturing)
+	capture_ring(d, CAPTURE_RX, rb, rb->head - res, res);
+    }
+    debugprintf(6, "Read %zi bytes from device, %zu bytes buffered.\n", res, ringbuf_used(rb));
+    rx_decode(d);
+  } while (res > 0 && (size_t)res == space); // Buffer was filled, there may be more
+  return 0;
+}
+
+/*
+ * Register a file descriptor with epoll
+ *
+ * Print error message and exit on failure
+ */
+void watch_add(int epfd, struct watch *w, int fd, const char *name, struct ringbuf *in, struct outqueue *out)
+{
+  struct epoll_event ev;
+
+  w->fd = fd;
+  w->name = name;
+  w->in = in;
+  w->out = out;
+  w->events = in ? EPOLLIN : 0;
+  w->hangup = 0;
+  w->lineflag = 0;
+  w->channelcmd = 0;
+  w->channelsent = 0;
+  w->configured = 0;
+  memset(&w->stats, 0, sizeof(w->stats));
+  ev.events = w->events;
+  ev.data.ptr = w;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("Can't add file descriptor to epoll");
+    exit(1);
+  }
+}
+
+/*
+ * Change the events a file descriptor is waited for
+ *
+ * Print error message and exit on failure
+ */
+void watch_set(int epfd, struct watch *w, uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (w->events == events)
+    return;
+  w->events = events;
+  ev.events = events;
+  ev.data.ptr = w;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, w->fd, &ev)) {
+    perror("Can't modify epoll events");
+    exit(1);
+  }
+}
+
+/*
+ * Register the device with the epoll instance of the RX or TX thread, or
+ * change the events it is waited for
+ *
+ * The device thread may replace the descriptor at any time, which removes
+ * it from epoll, so failing isn't fatal. The thread sees a new linkgen
+ * right after. Returns -1 on failure.
+ */
+int watch_device(int epfd, struct watch *w, int op, int fd, uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (op == EPOLL_CTL_MOD && w->events == events)
+    return 0;
+  w->fd = fd;
+  w->name = "device";
+  w->events = events;
+  ev.events = events;
+  ev.data.ptr = w;
+  if (epoll_ctl(epfd, op, fd, &ev)) {
+    debugprintf(7, "Can't wait for device: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Wait for input on a pty if there is room for it in its queue, and for the
+ * pty to become writable if there is output waiting for it
+ *
+ * A pty master keeps reporting EPOLLHUP for as long as the slave is closed,
+ * so a pty that has hung up, or whose queue is full, is switched to edge
+ * triggered mode. The hangup is then reported only once, and the next input
+ * after the slave is reopened wakes us up again.
+ */
+void watch_rearm(int epfd, struct watch *w)
+{
+  uint32_t events = 0;
+
+  if (w->in && ringbuf_space(w->in))
+    events |= EPOLLIN;
+  if (w->out && ringbuf_used(&w->out->buf))
+    events |= EPOLLOUT;
+  if (w->hangup || !(events & EPOLLIN))
+    events |= EPOLLET;
+  watch_set(epfd, w, events);
+}
+
+/*
+ * Raise or drop the modem lines of a pty slave
+ *
+ * The change goes out to the device in the next sequence.
+ */
+void set_lines(struct device *d, struct watch *w, int up)
+{
+  unsigned char flags = d->txq.flags & ~w->lineflag;
+
+  if (up != !!(w->lineflag & FLAGS_ACTIVE_LOW))
+    flags |= w->lineflag;
+  if (flags != d->txq.flags)
+    debugprintf(4, "%s lines %s.\n", w->name, up ? "up" : "down");
+  set_flags(&d->txq, flags);
+}
+
+/*
+ * Baud rate of a termios speed, in hundredths, 0 if unknown
+ *
+ * Termios has no 45.45 baud, so on FSK channels B50 is taken to mean the
+ * usual RTTY speed.
+ */
+long termios_baud(speed_t speed, int fsk)
+{
+  static const struct {
+    speed_t speed;
+    long baud;
+  } bauds[] = {
+    {B50, 50}, {B75, 75}, {B110, 110}, {B134, 134}, {B150, 150},
+    {B200, 200}, {B300, 300}, {B600, 600}, {B1200, 1200}, {B1800, 1800},
+    {B2400, 2400}, {B4800, 4800}, {B9600, 9600}, {B19200, 19200},
+    {B38400, 38400}, {B57600, 57600}, {B115200, 115200}, {B230400, 230400}
+  };
+  int i;
+
+  if (fsk && speed == B50)
+    return 4545;
+  for (i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++)
+    if (bauds[i].speed == speed)
+      return bauds[i].baud * 100;
+  return 0;
+}
+
+/*
+ * Send the serial settings of a pty slave to its channel on the device
+ *
+ * Many clients set up the port every time they open it, so the settings
+ * are only sent if they differ from what was last sent and taken by the
+ * device. Even parity can't be seen through a pty.
+ */
+void configure_channel(struct device *d, struct watch *w, const struct termios *tio)
+{
+  int fsk = w->channelcmd == CONTROL_SET_R1_FSK_CHANNEL || w->channelcmd == CONTROL_SET_R2_FSK_CHANNEL;
+  long baud = termios_baud(cfgetospeed(tio), fsk);
+  long divisor;
+  unsigned char cmd[5];
+  unsigned char ss;
+
+  if (!baud || (divisor = ((fsk ? CHANNEL_FSK_CLOCK : CHANNEL_RADIO_CLOCK) * 100LL + baud / 2) / baud) < 1 || divisor > 0xFFFF) {
+    debugprintf(1, "Speed of %s not supported by the device.\n", w->name);
+    return;
+  }
+
+  // Ptys force 8 data bits and clear PARENB, so data bits are given by the
+  // channel, and of the parity settings only PARODD and CMSPAR get through
+  ss = fsk ? CHANNEL_DATA_5BIT : CHANNEL_DATA_8BIT;
+  if (tio->c_cflag & CMSPAR)
+    ss |= CHANNEL_PARITY_MARKSPACE | ((tio->c_cflag & PARODD) ? CHANNEL_PARITY_MARK : CHANNEL_PARITY_SPACE);
+  else if (tio->c_cflag & PARODD)
+    ss |= CHANNEL_PARITY_ODD;
+  if (tio->c_cflag & CSTOPB) // Like a UART, 2 stop bits with 5 data bits is 1.5
+    ss |= fsk ? CHANNEL_STOP_15BIT : CHANNEL_STOP_2BIT;
+  if (tio->c_cflag & CRTSCTS)
+    ss |= CHANNEL_RTSCTS;
+
+  cmd[0] = w->channelcmd;
+  cmd[1] = divisor & 0xFF;
+  cmd[2] = divisor >> 8;
+  cmd[3] = ss;
+  cmd[4] = w->channelcmd | CONTROL_END_COMMAND;
+  if (w->channelsent && !memcmp(w->channel, cmd + 1, 3))
+    return;
+  if (control_send(&d->control, &d->txq, cmd, sizeof(cmd), COMMAND_FROM_DAEMON, monotonic_ns())) {
+    fprintf(stderr, "Control command queue full, settings of %s not sent\n", w->name);
+    return;
+  }
+  debugprintf(2, "%s: %li.%02li baud, divisor %li, SS %02x\n", w->name, baud / 100, baud % 100, divisor, ss);
+  memcpy(w->channel, cmd + 1, 3);
+  w->channelsent = 1;
+  w->configured = 1;
+}
+
+/*
+ * Pick up a termios change on a pty slave
+ *
+ * Ptys have no modem lines, so the output speed stands in for them: like
+ * on a serial port, B0 drops them and any other speed raises them. A client
+ * that sets up termios from scratch clears EXTPROC, so it is put back to
+ * keep hearing about changes.
+ */
+void termios_changed(struct device *d, struct watch *w)
+{
+  struct termios tio;
+
+  if (tcgetattr(w->fd, &tio)) {
+    fprintf(stderr, "Can't get settings of %s: %s\n", w->name, strerror(errno));
+    return;
+  }
+  if (!(tio.c_lflag & EXTPROC)) {
+    tio.c_lflag |= EXTPROC;
+    if (tcsetattr(w->fd, TCSANOW, &tio))
+      fprintf(stderr, "Can't set EXTPROC on %s: %s\n", w->name, strerror(errno));
+  }
+  set_lines(d, w, cfgetospeed(&tio) != B0);
+  if (w->channelcmd && cfgetospeed(&tio) != B0)
+    configure_channel(d, w, &tio);
+}
+
+/*
+ * Send the flags, and the channel settings clients have made, to a device
+ * that has lost them
+ */
+void reconfigure(struct device *d)
+{
+  struct termios tio;
+  int i;
+
+  debugprintf(2, "Setting up device again.\n");
+  d->reconfigure = 0;
+  resend_flags(&d->txq);
+  for (i = 0; i < d->numptywatches; i++) {
+    struct watch *w = &d->ptywatches[i];
+
+    if (!w->configured || tcgetattr(w->fd, &tio) || cfgetospeed(&tio) == B0)
+      continue;
+    w->channelsent = 0;
+    configure_channel(d, w, &tio);
+  }
+}
+
+/*
+ * Start following a byte just read into a channel's input queue, unless
+ * one is being followed on the channel already
+ */
+void trace_input(struct device *d, struct ringbuf *in)
+{
+  struct latency *l;
+  int i;
+
+  for (i = 0; i < d->numtxlatency; i++) {
+    l = &d->txlatency[i];
+    if (l->in != in || __atomic_load_n(&l->probe.state, __ATOMIC_ACQUIRE) != TRACE_IDLE)
+      continue;
+    l->probe.pos = in->head - 1;
+    l->probe.start = monotonic_ns();
+    __atomic_store_n(&l->probe.state, TRACE_WAITING, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Read all available input from a pty into its queue
+ *
+ * Ptys with modem lines are in packet mode, where termios changes on the
+ * slave are reported before the data that follows them.
+ */
+void read_pty(struct device *d, struct watch *w)
+{
+  unsigned char pkt;
+  ssize_t res;
+
+  if (!w->in || !ringbuf_space(w->in))
+    return;
+  if (w->lineflag) {
+    while ((res = ringbuf_read_pkt(w->in, w->fd, &pkt)) > 0 && pkt != TIOCPKT_DATA)
+      if (pkt & TIOCPKT_IOCTL)
+	termios_changed(d, w);
+    if (res > 0 && !--res)
+      return;
+  }
+  else
+    res = ringbuf_read_fd(w->in, w->fd);
+  if (res > 0) {
+    debugprintf(6, "Input from %s: %zi bytes\n", w->name, res);
+    w->stats.in += res;
+    if (d->numtxlatency)
+      trace_input(d, w->in);
+    if (w->hangup) {
+      debugprintf(7, "%s reopened.\n", w->name);
+      w->stats.reopens++;
+    }
+    w->hangup = 0;
+  }
+  else if (res == 0 || (errno != EAGAIN && errno != EINTR)) {
+    if (!w->hangup) {
+      debugprintf(7, "EOF or error from %s. Waiting for it to be reopened.\n", w->name);
+      w->stats.hangups++;
+      if (w->lineflag)
+	set_lines(d, w, 0);
+    }
+    w->hangup = 1;
+  }
+}
+
+/*
+ * Print a latency histogram as the number of samples, median, 99th
+ * percentile and maximum
+ */
+void print_hist(FILE *f, struct device *d, const char *name, const char *stage, const struct trace_hist *h)
+{
+  const char *l = d->label;
+  const char *dot = *d->label ? "." : "";
+
+  fprintf(f, "%s%s%s.latency.%s.samples %lu\n", l, dot, name, stage, h->samples);
+  fprintf(f, "%s%s%s.latency.%s.p50_us %.1f\n", l, dot, name, stage, trace_percentile(h, 0.5) / 1e3);
+  fprintf(f, "%s%s%s.latency.%s.p99_us %.1f\n", l, dot, name, stage, trace_percentile(h, 0.99) / 1e3);
+  fprintf(f, "%s%s%s.latency.%s.max_us %.1f\n", l, dot, name, stage, h->max / 1e3);
+}
+
+/*
+ * Print counters, one "name value" pair per line
+ *
+ * Utilisation is the share of the link's capacity used since start. With
+ * more than one device, names are prefixed by the device label. Counters
+ * are read while the device threads are running, so they may lag slightly.
+ */
+void print_stats(FILE *f, struct device *d)
+{
+  double uptime = (monotonic_ns() - start_time) / 1e9;
+  double capacity = uptime * KEYER_BYTES_PER_SEC;
+  const char *l = d->label;
+  const char *dot = *d->label ? "." : "";
+  int i;
+
+  fprintf(f, "%s%suptime %.3f\n", l, dot, uptime);
+  fprintf(f, "%s%swakeups %lu\n", l, dot, d->linkstats.wakeups);
+  fprintf(f, "%s%swakeups.rx %lu\n", l, dot, d->linkstats.rxwakeups);
+  fprintf(f, "%s%swakeups.tx %lu\n", l, dot, d->linkstats.txwakeups);
+  fprintf(f, "%s%swakeups.timed %lu\n", l, dot, d->jitter.samples);
+  fprintf(f, "%s%swakeups.late.mean_us %.1f\n", l, dot, d->jitter.samples ? d->jitter.total / 1e3 / d->jitter.samples : 0);
+  fprintf(f, "%s%swakeups.late.max_us %.1f\n", l, dot, d->jitter.max / 1e3);
+  fprintf(f, "%s%sdevice.losses %lu\n", l, dot, d->linkstats.losses);
+  fprintf(f, "%s%sdevice.reconnects %lu\n", l, dot, d->linkstats.reconnects);
+  fprintf(f, "%s%sdevice.restarts %lu\n", l, dot, d->linkstats.restarts);
+  fprintf(f, "%s%sdevice.rx.bytes %lu\n", l, dot, d->linkstats.rxbytes);
+  fprintf(f, "%s%sdevice.rx.frames %lu\n", l, dot, d->linkstats.rxframes);
+  fprintf(f, "%s%sdevice.rx.overlong %lu\n", l, dot, d->dec.overlong);
+  fprintf(f, "%s%sdevice.rx.resyncs %lu\n", l, dot, d->dec.resyncs);
+  fprintf(f, "%s%sdevice.rx.skipped %lu\n", l, dot, d->dec.skipped);
+  fprintf(f, "%s%sdevice.rx.utilisation %.4f\n", l, dot, capacity > 0 ? d->linkstats.rxbytes / capacity : 0);
+  fprintf(f, "%s%sdevice.tx.bytes %lu\n", l, dot, d->linkstats.txbytes);
+  fprintf(f, "%s%sdevice.tx.frames %lu\n", l, dot, d->sched.frames);
+  fprintf(f, "%s%sdevice.tx.sequences %lu\n", l, dot, d->sched.sequences);
+  fprintf(f, "%s%sdevice.tx.frames_per_sequence %.2f\n", l, dot, d->sched.sequences ? (double)d->sched.frames / d->sched.sequences : 0);
+  fprintf(f, "%s%sdevice.tx.utilisation %.4f\n", l, dot, capacity > 0 ? d->linkstats.txbytes / capacity : 0);
+  fprintf(f, "%s%scontrol.commands %lu\n", l, dot, d->control.commands);
+  fprintf(f, "%s%scontrol.replies %lu\n", l, dot, d->control.replies);
+  fprintf(f, "%s%scontrol.unsupported %lu\n", l, dot, d->control.unsupported);
+  fprintf(f, "%s%scontrol.timeouts %lu\n", l, dot, d->control.timeouts);
+  fprintf(f, "%s%scontrol.unsolicited %lu\n", l, dot, d->control.unsolicited);
+  fprintf(f, "%s%scontrol.discarded %lu\n", l, dot, d->control.discarded);
+  for (i = 0; i < d->numptywatches; i++) {
+    struct watch *w = &d->ptywatches[i];
+
+    if (w->in)
+      fprintf(f, "%s%s%s.in.bytes %lu\n", l, dot, w->name, w->stats.in);
+    if (w->out) {
+      fprintf(f, "%s%s%s.out.bytes %lu\n", l, dot, w->name, w->stats.out);
+      fprintf(f, "%s%s%s.out.eagain %lu\n", l, dot, w->name, w->stats.eagain);
+      fprintf(f, "%s%s%s.out.dropped %lu\n", l, dot, w->name, w->out->dropped);
+    }
+    fprintf(f, "%s%s%s.hangups %lu\n", l, dot, w->name, w->stats.hangups);
+    fprintf(f, "%s%s%s.reopens %lu\n", l, dot, w->name, w->stats.reopens);
+  }
+  for (i = 0; i < 2; i++) {
+    struct cat *c = &d->shares[i].cat;
+    const char *name = i ? "radio2" : "radio1";
+
+    if (!c->numclients)
+      continue;
+    fprintf(f, "%s%s%s.cat.commands %lu\n", l, dot, name, c->commands);
+    fprintf(f, "%s%s%s.cat.hits %lu\n", l, dot, name, c->hits);
+    fprintf(f, "%s%s%s.cat.joined %lu\n", l, dot, name, c->joined);
+    fprintf(f, "%s%s%s.cat.replies %lu\n", l, dot, name, c->replies);
+    fprintf(f, "%s%s%s.cat.unsolicited %lu\n", l, dot, name, c->unsolicited);
+    fprintf(f, "%s%s%s.cat.timeouts %lu\n", l, dot, name, c->timeouts);
+    fprintf(f, "%s%s%s.cat.discarded %lu\n", l, dot, name, c->discarded);
+  }
+  for (i = 0; i < 2; i++) {
+    struct keying *k = &d->keying[i];
+    const char *name = i ? "radio2" : "radio1";
+
+    if (d->config.keying_mode[i] < 0)
+      continue;
+    fprintf(f, "%s%s%s.keying.chars %lu\n", l, dot, name, k->chars);
+    fprintf(f, "%s%s%s.keying.unknown %lu\n", l, dot, name, k->unknown);
+    fprintf(f, "%s%s%s.keying.edges %lu\n", l, dot, name, k->edges);
+    fprintf(f, "%s%s%s.keying.late.mean_us %.1f\n", l, dot, name, k->edges ? k->late / 1e3 / k->edges : 0);
+    fprintf(f, "%s%s%s.keying.late.max_us %.1f\n", l, dot, name, k->latemax / 1e3);
+  }
+  for (i = 0; i < d->numendpoints; i++) {
+    struct endpoint *ep = &d->endpoints[i];
+
+    fprintf(f, "%s%s%s.socket.accepted %lu\n", l, dot, ep->name, ep->accepted);
+    fprintf(f, "%s%s%s.socket.dropped %lu\n", l, dot, ep->name, ep->dropped);
+  }
+  for (i = 0; i < d->numtxlatency; i++) {
+    print_hist(f, d, d->txlatency[i].name, "tx.encode", &d->txlatency[i].stage[0]);
+    print_hist(f, d, d->txlatency[i].name, "tx.write", &d->txlatency[i].stage[1]);
+    print_hist(f, d, d->txlatency[i].name, "tx.total", &d->txlatency[i].total);
+  }
+  for (i = 0; i < d->numrxlatency; i++) {
+    print_hist(f, d, d->rxlatency[i].name, "rx.decode", &d->rxlatency[i].stage[0]);
+    print_hist(f, d, d->rxlatency[i].name, "rx.write", &d->rxlatency[i].stage[1]);
+    print_hist(f, d, d->rxlatency[i].name, "rx.total", &d->rxlatency[i].total);
+  }
+}
+
+/*
+ * Print counters for all devices, ending with a blank line
+ */
+void print_all_stats(FILE *f)
+{
+  int i;
+
+  for (i = 0; i < numdevices; i++)
+    print_stats(f, &devices[i]);
+  fprintf(f, "\n");
+  fflush(f);
+}
+
+/*
+ * Update the status page
+ *
+ * Flags are written when they change, counters when there has been
+ * traffic since they were last written.
+ */
+void publish_status(struct device *d)
+{
+  struct status_counters *c;
+  unsigned long traffic = d->linkstats.rxbytes + d->linkstats.txbytes;
+  uint64_t now = monotonic_ns();
+  int i;
+
+  status_flags(&d->status, __atomic_load_n(&d->rxflags, __ATOMIC_RELAXED), d->txq.flags, now);
+  for (i = 0; i < d->numptywatches; i++) {
+    struct watch *w = &d->ptywatches[i];
+
+    traffic += w->stats.in + w->stats.out + (w->out ? w->out->dropped : 0);
+  }
+  if (traffic == d->published)
+    return;
+  d->published = traffic;
+
+  c = status_counters_begin(&d->status);
+  c->updated = now;
+  c->lastrx = __atomic_load_n(&d->lastrx, __ATOMIC_RELAXED);
+  c->rxbytes = d->linkstats.rxbytes;
+  c->rxframes = d->linkstats.rxframes;
+  c->rxoverlong = d->dec.overlong;
+  c->rxresyncs = d->dec.resyncs;
+  c->txbytes = d->linkstats.txbytes;
+  c->txframes = d->sched.frames;
+  for (i = 0; i < d->numptywatches && i < STATUS_CHANNELS; i++) {
+    struct watch *w = &d->ptywatches[i];
+
+    c->channel[i].in = w->stats.in;
+    c->channel[i].out = w->stats.out;
+    c->channel[i].dropped = w->out ? w->out->dropped : 0;
+  }
+  status_counters_end(&d->status);
+}
+
+/*
+ * Listen on a Unix socket of the given type
+ *
+ * Print error message and exit on failure
+ */
+int unix_listen(const char *path, int type, const char *what)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Path of %s socket too long\n", what);
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if ((fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+    fprintf(stderr, "Can't create %s socket: %s\n", what, strerror(errno));
+    exit(1);
+  }
+
+  return fd;
+}
+
+/*
+ * Send statistics to everyone who has connected to the socket
+ *
+ * Clients are written to with blocking writes, so a slow reader gets the
+ * whole report, but one that stops reading is given up on after
+ * STATS_SEND_TIMEOUT seconds. Only the main thread waits meanwhile.
+ */
+void serve_stats(int listenfd)
+{
+  struct timeval timeout = {STATS_SEND_TIMEOUT, 0};
+  FILE *f;
+  int fd;
+
+  while ((fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (!(f = fdopen(fd, "w"))) {
+      close(fd);
+      continue;
+    }
+    print_all_stats(f);
+    if (fclose(f))
+      fprintf(stderr, "Can't send counters: %s\n", strerror(errno));
+  }
+}
+
+/*
+ * Take new command socket clients, as many as there is room for
+ */
+void accept_clients(struct device *d)
+{
+  int fd;
+  int i;
+
+  while ((fd = accept4(d->commandfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    for (i = 0; i < COMMAND_CLIENTS && d->clients[i].fd >= 0; i++)
+      ;
+    if (i == COMMAND_CLIENTS) {
+      debugprintf(1, "Too many command socket clients.\n");
+      close(fd);
+      continue;
+    }
+    watch_add(d->epfd, &d->clients[i], fd, "command", NULL, NULL);
+    watch_set(d->epfd, &d->clients[i], EPOLLIN);
+  }
+}
+
+/*
+ * Queue the commands a command socket client has sent, one per message
+ *
+ * Commands that are malformed or don't fit are rejected at once. When the
+ * client goes away, replies still to come are dropped.
+ */
+void serve_client(struct device *d, struct watch *w)
+{
+  unsigned char cmd[CONTROL_MAX_COMMAND];
+  int client = w - d->clients;
+  ssize_t res;
+
+  while ((res = recv(w->fd, cmd, sizeof(cmd), MSG_TRUNC)) > 0) {
+    debugprintf(6, "Command from client %i: %zi bytes\n", client, res);
+    if ((size_t)res > sizeof(cmd) || control_send(&d->control, &d->txq, cmd, res, client, monotonic_ns()))
+      send_reply(w, REPLY_REJECTED, cmd[0], NULL, 0);
+  }
+  if (res == 0 || (errno != EAGAIN && errno != EINTR)) {
+    debugprintf(7, "Command client %i gone.\n", client);
+    epoll_ctl(d->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    w->fd = -1;
+    control_forget(&d->control, client);
+  }
+}
+
+/*
+ * Offer the channel of a pty as a Unix socket in the socket directory
+ *
+ * The socket is named after the channel, and clients share the pty's
+ * queues, or become CAT clients of a shared radio channel. The queues of
+ * stream clients are allocated here, once for all the clients that may
+ * connect. Print error message and exit on failure.
+ */
+void endpoint_open(struct device *d, struct watch *pty)
+{
+  struct endpoint *ep = &d->endpoints[d->numendpoints++];
+  char path[sizeof(((struct sockaddr_un *)NULL)->sun_path) + 1];
+  struct catshare *s = NULL;
+  int i;
+
+  if (snprintf(path, sizeof(path), "%s/%s", d->config.socket_dir, pty->name) >= sizeof(path)) {
+    fprintf(stderr, "Path of %s socket too long\n", pty->name);
+    exit(1);
+  }
+  ep->type = pty == &d->ptywatches[0] ? SOCK_SEQPACKET : SOCK_STREAM;
+  ep->fd = unix_listen(path, ep->type, pty->name);
+  ep->name = pty->name;
+  ep->in = pty->in;
+  for (i = 0; i < 2; i++)
+    if (d->shares[i].cat.numclients && d->shares[i].watches[0] == pty)
+      s = &d->shares[i];
+  ep->share = s;
+  memset(ep->clientin, 0, sizeof(ep->clientin));
+  memset(ep->out, 0, sizeof(ep->out));
+  for (i = 0; i < SOCKET_CLIENTS; i++) {
+    ep->clients[i].fd = -1;
+    if (ep->type == SOCK_STREAM)
+      ringbuf_init(&ep->out[i].buf, PTY_TXBUF_SIZE);
+    if (ep->type == SOCK_STREAM && ep->in && !s)
+      ringbuf_init(&ep->clientin[i], SOCKET_RXBUF_SIZE);
+    if (s)
+      s->watches[s->numptys + i] = &ep->clients[i];
+  }
+  watch_add(d->epfd, &ep->watch, ep->fd, pty->name, NULL, NULL);
+  watch_set(d->epfd, &ep->watch, EPOLLIN);
+  if (s)
+    s->endpoint = ep; // Replies are routed to the clients that asked
+  else if (pty->out)
+    pty->out->endpoint = ep;
+}
+
+/*
+ * Input queue of a channel socket client, NULL if it takes none
+ */
+struct ringbuf *endpoint_in(struct endpoint *ep, int client)
+{
+  if (ep->type != SOCK_STREAM || !ep->in)
+    return NULL;
+  return ep->share ? &ep->share->in[ep->share->numptys + client] : &ep->clientin[client];
+}
+
+/*
+ * Move what a stream client has sent to the channel, if all of it fits
+ *
+ * The client's queue holds at most one read, so reads from different
+ * clients and the pty are never mixed. It is moved even after the client
+ * has gone. Shared radio channels frame the input of each client on their
+ * own instead.
+ */
+void endpoint_input(struct device *d, struct endpoint *ep, struct ringbuf *in)
+{
+  unsigned char *ptr;
+  size_t len;
+
+  if (!ringbuf_used(in) || ringbuf_used(in) > ringbuf_space(ep->in))
+    return;
+  while ((len = ringbuf_contig(in, &ptr))) {
+    ringbuf_put(ep->in, ptr, len);
+    ringbuf_skip(in, len);
+  }
+  if (d->numtxlatency)
+    trace_input(d, ep->in);
+}
+
+/*
+ * Take new clients of a channel socket, as many as there is room for
+ */
+void endpoint_accept(struct device *d, struct endpoint *ep)
+{
+  int fd;
+  int i;
+
+  while ((fd = accept4(ep->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    for (i = 0; i < SOCKET_CLIENTS && ep->clients[i].fd >= 0; i++)
+      ;
+    if (i == SOCKET_CLIENTS) {
+      debugprintf(1, "Too many clients of %s socket.\n", ep->name);
+      close(fd);
+      continue;
+    }
+    debugprintf(7, "Client %i of %s socket connected.\n", i, ep->name);
+    ep->accepted++;
+    ep->out[i].dropped = 0;
+    ringbuf_clear(&ep->out[i].buf);
+    watch_add(d->epfd, &ep->clients[i], fd, ep->name, endpoint_in(ep, i), ep->type == SOCK_STREAM ? &ep->out[i] : NULL);
+    // What the last CAT client in this place left unsent is dropped, so
+    // that its replies don't come here
+    if (ep->share) {
+      ringbuf_clear(ep->clients[i].in);
+      cat_forget(&ep->share->cat, ep->share->numptys + i);
+    }
+    watch_set(d->epfd, &ep->clients[i], EPOLLIN);
+  }
+}
+
+/*
+ * Take what a channel socket client has sent, and let it go when it goes
+ * away
+ *
+ * Commands on the control socket are one per message, and go to the
+ * control engine whole, so they never mix with what is written to the
+ * control pty. A message is only taken when a command of any length fits
+ * in the queue. Commands that are malformed, too long, or would have too
+ * many in flight are discarded. Stream clients of channels that aren't
+ * shared are read one read at a time, and the read is moved to the channel
+ * whole. Clients of channels that take no input are only watched for going
+ * away.
+ */
+void endpoint_serve(struct device *d, struct endpoint *ep, struct watch *w, uint32_t events)
+{
+  unsigned char cmd[CONTROL_MAX_COMMAND];
+  int client = w - ep->clients;
+  ssize_t res = -1;
+
+  errno = EAGAIN;
+  if (ep->type == SOCK_SEQPACKET) {
+    while (command_room(&d->txq, sizeof(cmd)) && (res = recv(w->fd, cmd, sizeof(cmd), MSG_TRUNC)) > 0) {
+      debugprintf(6, "Command from %s socket: %zi bytes\n", ep->name, res);
+      w->stats.in += res;
+      if ((size_t)res > sizeof(cmd) || control_send(&d->control, &d->txq, cmd, res, COMMAND_CLIENTS + client, monotonic_ns())) {
+	debugprintf(2, "Command from %s socket rejected, discarded\n", ep->name);
+	d->control.discarded++;
+      }
+    }
+  }
+  else if (w->in) {
+    while ((ep->share ? ringbuf_space(w->in) : !ringbuf_used(w->in)) && (res = ringbuf_read_fd(w->in, w->fd)) > 0) {
+      debugprintf(6, "Input from %s socket: %zi bytes\n", ep->name, res);
+      w->stats.in += res;
+      if (!ep->share)
+	endpoint_input(d, ep, w->in);
+    }
+  }
+  else if (events & (EPOLLHUP | EPOLLERR))
+    res = 0;
+  if (res == 0 || (res == -1 && errno != EAGAIN && errno != EINTR)) {
+    debugprintf(7, "Client %i of %s socket gone.\n", client, ep->name);
+    epoll_ctl(d->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    w->fd = -1;
+    ringbuf_clear(&ep->out[client].buf);
+    if (ep->type == SOCK_SEQPACKET)
+      control_forget(&d->control, COMMAND_CLIENTS + client);
+  }
+  else if (events & EPOLLOUT)
+    write_pty(w);
+}
+
+/*
+ * Find the channel socket a listening socket or client belongs to, NULL if
+ * none
+ */
+struct endpoint *find_endpoint(struct device *d, struct watch *w)
+{
+  struct endpoint *ep;
+  int i;
+
+  for (i = 0; i < d->numendpoints; i++) {
+    ep = &d->endpoints[i];
+    if (w == &ep->watch || (w >= ep->clients && w < ep->clients + SOCKET_CLIENTS))
+      return ep;
+  }
+  return NULL;
+}
+
+/*
+ * Move what channel socket clients have sent to the channels, where there
+ * is room for it now
+ */
+void endpoints_input(struct device *d)
+{
+  struct endpoint *ep;
+  int i, j;
+
+  for (i = 0; i < d->numendpoints; i++) {
+    ep = &d->endpoints[i];
+    for (j = 0; j < SOCKET_CLIENTS; j++)
+      endpoint_input(d, ep, &ep->clientin[j]);
+  }
+}
+
+/*
+ * Wait for input from channel socket clients while there is room for it,
+ * and for them to take output while there is some
+ *
+ * A client of a channel that isn't shared isn't read again until its last
+ * read has been moved to the channel.
+ */
+void rearm_endpoints(struct device *d)
+{
+  struct endpoint *ep;
+  struct watch *w;
+  int i, j;
+
+  for (i = 0; i < d->numendpoints; i++) {
+    ep = &d->endpoints[i];
+    for (j = 0; j < SOCKET_CLIENTS; j++) {
+      w = &ep->clients[j];
+      if (w->fd < 0)
+	continue;
+      if (ep->type == SOCK_SEQPACKET)
+	watch_set(d->epfd, w, command_room(&d->txq, CONTROL_MAX_COMMAND) ? EPOLLIN : EPOLLET);
+      else if (w->in && !ep->share)
+	watch_set(d->epfd, w, (ringbuf_used(w->in) ? EPOLLET : EPOLLIN) | (ringbuf_used(&w->out->buf) ? EPOLLOUT : 0));
+      else if (w->in)
+	watch_rearm(d->epfd, w);
+      else
+	watch_set(d->epfd, w, ringbuf_used(&w->out->buf) ? EPOLLOUT : 0);
+    }
+  }
+}
+
+/*
+ * Close the channel sockets and let their clients go
+ */
+void close_endpoints(struct device *d)
+{
+  struct endpoint *ep;
+  int i, j;
+
+  for (i = 0; i < d->numendpoints; i++) {
+    ep = &d->endpoints[i];
+    for (j = 0; j < SOCKET_CLIENTS; j++) {
+      if (ep->clients[j].fd >= 0)
+	close(ep->clients[j].fd);
+      ringbuf_free(&ep->clientin[j]);
+      ringbuf_free(&ep->out[j].buf);
+    }
+    close(ep->fd);
+  }
+}
+
+/*
+ * Move on to the next record of data from the device
+ */
+void replay_advance(struct replay *r)
+{
+  while ((r->rec = replay_next(&r->cap, &r->data)) && r->rec->direction != CAPTURE_RX)
+    ;
+  r->done = 0;
+}
+
+/*
+ * Start replaying a capture file
+ *
+ * Returns the file descriptor to use as the device. Print error message
+ * and exit on failure.
+ */
+int replay_start(struct replay *r, const char *filename, int fast)
+{
+  int sv[2];
+
+  replay_open(&r->cap, filename);
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv)) {
+    perror("Can't create socket pair for replay");
+    exit(1);
+  }
+  if ((r->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+    perror("Can't create replay timer");
+    exit(1);
+  }
+  r->feed = sv[1];
+  r->fast = fast;
+  r->start = monotonic_ns();
+  replay_advance(r);
+
+  return sv[0];
+}
+
+/*
+ * Feed the daemon the device data that is due
+ *
+ * If a record isn't due yet, the timer is set to wake us up when it is.
+ * At the end of the capture, the feed is closed, so the daemon sees the
+ * device disappear. Returns 1 if the feed is full and we must wait for it
+ * to become writable.
+ */
+int replay_feed(struct replay *r)
+{
+  unsigned char discard[4096];
+  struct itimerspec its;
+  uint64_t now = monotonic_ns();
+  ssize_t res;
+
+  // Throw away what the daemon sent to the device
+  while (read(r->feed, discard, sizeof(discard)) > 0)
+    ;
+
+  while (r->rec) {
+    if (!r->fast && r->start + r->rec->time > now) {
+      uint64_t ns = r->start + r->rec->time - now;
+
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = ns / 1000000000ULL;
+      its.it_value.tv_nsec = ns % 1000000000ULL;
+      if (timerfd_settime(r->timer, 0, &its, NULL))
+	perror("Can't set replay timer");
+      return 0;
+    }
+    if ((res = write(r->feed, r->data + r->done, r->rec->len - r->done)) == -1) {
+      if (errno == EAGAIN)
+	return 1;
+      perror("Error replaying capture");
+      exit(1);
+    }
+    r->done += res;
+    if (r->done == r->rec->len)
+      replay_advance(r);
+  }
+
+  if (r->feed >= 0) {
+    debugprintf(1, "End of capture.\n");
+    close(r->feed);
+    r->feed = -1;
+  }
+  return 0;
+}
+
+void show_version()
+{
+  printf("microkeyer 0.1\n");
+  exit(0);
+}
+
+void show_help()
+{
+  printf("Usage: microkeyer [OPTIONS] -m MODEL DEVICE [[OPTIONS] DEVICE...]\n");
+  printf("\n Help and debug:\n");
+  printf("  -m, --model=MODEL       Set keyer model (MK, MK2, MK2R, MK2R+, CK, DK, DK2, U2R, SM)\n");
+  printf("  -h, --help              Display this help text\n");
+  printf("  -v, --verbose           Show debug output (repeat for more verbosity)\n");
+  printf("  -V, --version           Show version information\n");
+  printf("\n Devices:\n");
+  printf("  Each DEVICE gets its own ptys and threads. Model, buffering, scheduling,\n");
+  printf("  status page, sockets, CAT sharing, keying, tracing, capture, keepalive,\n");
+  printf("  affinity and real-time options apply to the DEVICE after them and to all\n");
+  printf("  later ones.\n");
+  printf("  Options after the last DEVICE also apply to it.\n");
+  printf("  -a, --affinity=CPUS     Run the threads of the device on CPUS, a list like\n");
+  printf("                          0,2-3. Default any CPU.\n");
+  printf("  -k, --keepalive=MS      Check that the device is there after MS ms without\n");
+  printf("                          data from it, and reopen it after three times\n");
+  printf("                          that. A device that hangs up is always reopened.\n");
+  printf("  -R, --realtime=PRIO     Run the threads of the device with SCHED_FIFO priority\n");
+  printf("                          PRIO (1-99), or SCHED_RR if given as rr:PRIO, and\n");
+  printf("                          lock memory. Use with -a for the most precise timing.\n");
+  printf("\n Buffering:\n");
+  printf("  -o, --overflow=POLICY   What to do when a pty doesn't keep up with output from\n");
+  printf("                          the device (drop-newest, drop-oldest, block). Prefix\n");
+  printf("                          with CHANNEL: to set it for control, radio1, radio2,\n");
+  printf("                          winkey or keyboard only. Default drop-newest.\n");
+  printf("\n Scheduling:\n");
+  printf("  -b, --backlog=BYTES     Hold back radio and FSK data while more than BYTES\n");
+  printf("                          are waiting to be sent to the device. Default 40.\n");
+  printf("  -w, --weight=CHANNEL:N  Max bytes per sequence from radio1 or radio2 when\n");
+  printf("                          sending held back data (1-5). Default 5.\n");
+  printf("  -s, --starvation=N      Send held back data after N sequences of latency\n");
+  printf("                          critical data. Default 8.\n");
+  printf("\n CAT sharing:\n");
+  printf("  -x, --share=CHANNEL:N   Share radio1 or radio2 between N ptys (2-%i) that\n", SHARE_PTYS);
+  printf("                          take turns sending whole commands. Needs -y.\n");
+  printf("  -y, --cat=CHANNEL:PROTOCOL[:MS]\n");
+  printf("                          CAT protocol of the radio on radio1 or radio2\n");
+  printf("                          (kenwood, yaesu, icom). Replies to frequency and\n");
+  printf("                          mode reads are reused for MS ms. Default %i.\n", CAT_TTL);
+  printf("  -q, --cat-queries=CHANNEL:LIST\n");
+  printf("                          Cache replies to the reads in LIST instead, e.g.\n");
+  printf("                          FA,IF for Kenwood or 03,1A05 (hex) for Icom.\n");
+  printf("\n Keying:\n");
+  printf("  -E, --keying=CHANNEL:cw:WPM[:WEIGHT]\n");
+  printf("                          Key CW on radio1 or radio2 from text written to\n");
+  printf("                          the CW pty, at WPM (5-99) with WEIGHT percent\n");
+  printf("                          (25-75) key down. Default weight 50. Elements can\n");
+  printf("                          be given between [ and ], e.g. [...-.-].\n");
+  printf("  -E, --keying=CHANNEL:fsk:BAUD\n");
+  printf("                          Key FSK on radio1 or radio2 from text written to\n");
+  printf("                          the Ext FSK pty, at BAUD (e.g. 45.45, 50 or 75).\n");
+  printf("\n Sockets:\n");
+  printf("  -u, --sockets=DIR       Also offer each channel as a Unix socket in DIR,\n");
+  printf("                          named like the channel's counters, e.g. radio1.\n");
+  printf("                          Up to %i clients may write to it, and each gets\n", SOCKET_CLIENTS);
+  printf("                          all output. control is SOCK_SEQPACKET, with\n");
+  printf("                          one command or reply per message, and replies\n");
+  printf("                          only go to the client that asked.\n");
+  printf("\n Statistics:\n");
+  printf("  -S, --stats=PATH        Send counters to clients connecting to Unix socket\n");
+  printf("                          PATH. They are also printed on SIGUSR1. With more\n");
+  printf("                          than one device, names are prefixed by keyerN.\n");
+  printf("  -T, --trace             Follow bytes on each channel from pty to device and\n");
+  printf("                          back, and count the latency of each stage in\n");
+  printf("                          histograms, shown with the other counters.\n");
+  printf("  -P, --status=FILE       Publish flags and counters of the device in a page\n");
+  printf("                          clients can map from FILE, e.g. in /dev/shm.\n");
+  printf("\n Control commands:\n");
+  printf("  -K, --commands=PATH     Take whole control commands from clients of Unix\n");
+  printf("                          SOCK_SEQPACKET socket PATH, one per message. Each\n");
+  printf("                          is answered by a message with the status (0 ok,\n");
+  printf("                          1 not supported, 2 no reply, 3 rejected), the\n");
+  printf("                          command byte and the reply from the device.\n");
+  printf("\n Capture and replay:\n");
+  printf("  -c, --capture=FILE      Record the raw device stream in both directions to\n");
+  printf("                          FILE. When full, the oldest data is overwritten.\n");
+  printf("  -C, --capture-size=MB   Size of capture file. Default %i.\n", CAPTURE_SIZE);
+  printf("  -r, --replay=FILE       Replay data from the device in a capture instead of\n");
+  printf("                          using a device, at the original pace. No DEVICE is\n");
+  printf("                          given, and MODEL defaults to the captured model.\n");
+  printf("  -M, --max-speed         Replay as fast as possible\n");
+  printf("\n");
+  exit(0);
+}
+
+/*
+ * Parse [CHANNEL:]POLICY argument of --overflow
+ *
+ * Returns 0 on success, -1 on invalid argument
+ */
+int parse_overflow(const char *arg)
+{
+  static const char *channels[] = {"control", "radio1", "radio2", "winkey", "keyboard"};
+  const char *colon = strchr(arg, ':');
+  int policy;
+  int i;
+
+  if (!strcasecmp(colon ? colon + 1 : arg, "drop-newest"))
+    policy = OVERFLOW_DROP_NEWEST;
+  else if (!strcasecmp(colon ? colon + 1 : arg, "drop-oldest"))
+    policy = OVERFLOW_DROP_OLDEST;
+  else if (!strcasecmp(colon ? colon + 1 : arg, "block"))
+    policy = OVERFLOW_BLOCK;
+  else
+    return -1;
+
+  for (i = 0; i < 5; i++) {
+    if (!colon)
+      config.overflow_policy[i] = policy;
+    else if (strlen(channels[i]) == colon - arg && !strncasecmp(arg, channels[i], colon - arg)) {
+      config.overflow_policy[i] = policy;
+      return 0;
+    }
+  }
+
+  return colon ? -1 : 0;
+}
+
+/*
+ * Parse CHANNEL: prefix of radio channel options
+ *
+ * Returns 0 for radio1, 1 for radio2, -1 on invalid argument
+ */
+int parse_radio(const char *arg)
+{
+  if (!strncasecmp(arg, "radio1:", 7))
+    return 0;
+  if (!strncasecmp(arg, "radio2:", 7))
+    return 1;
+  return -1;
+}
+
+/*
+ * Parse CHANNEL:PROTOCOL[:MS] argument of --cat
+ *
+ * Returns 0 on success, -1 on invalid argument
+ */
+int parse_cat(const char *arg)
+{
+  int radio = parse_radio(arg);
+  const char *colon;
+  char name[16];
+
+  if (radio < 0)
+    return -1;
+  arg += 7;
+  if ((colon = strchr(arg, ':'))) {
+    if (colon - arg >= sizeof(name) || (config.cat_ttl[radio] = atoi(colon + 1)) < 0)
+      return -1;
+    memcpy(name, arg, colon - arg);
+    name[colon - arg] = '\0';
+    arg = name;
+  }
+  return (config.cat_protocol[radio] = cat_protocol(arg)) < 0 ? -1 : 0;
+}
+
+/*
+ * Parse CHANNEL:MODE:SPEED[:WEIGHT] argument of --keying
+ *
+ * Returns 0 on success, -1 on invalid argument
+ */
+int parse_keying(const char *arg)
+{
+  int radio = parse_radio(arg);
+  const char *colon;
+  char name[16];
+  char *end;
+
+  if (radio < 0)
+    return -1;
+  arg += 7;
+  if (!(colon = strchr(arg, ':')) || colon - arg >= sizeof(name))
+    return -1;
+  memcpy(name, arg, colon - arg);
+  name[colon - arg] = '\0';
+  if ((config.keying_mode[radio] = keying_mode(name)) < 0)
+    return -1;
+  arg = colon + 1;
+  config.keying_speed[radio] = strtod(arg, &end);
+  if (end == arg)
+    return -1;
+  if (*end == ':' && config.keying_mode[radio] == KEYING_CW) {
+    arg = end + 1;
+    config.keying_weight[radio] = strtol(arg, &end, 10);
+    if (end == arg)
+      return -1;
+  }
+  return *end ? -1 : 0;
+}
+
+/*
+ * Parse CPU list argument of --affinity
+ *
+ * Returns 0 on success, -1 on invalid argument
+ */
+int parse_cpus(const char *arg, cpu_set_t *cpus)
+{
+  char *end;
+  long first, last;
+
+  CPU_ZERO(cpus);
+  do {
+    first = strtol(arg, &end, 10);
+    last = first;
+    if (end == arg)
+      return -1;
+    if (*end == '-') {
+      arg = end + 1;
+      last = strtol(arg, &end, 10);
+      if (end == arg)
+	return -1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return -1;
+    for (; first <= last; first++)
+      CPU_SET(first, cpus);
+    arg = end + 1;
+  } while (*end == ',');
+
+  return *end ? -1 : 0;
+}
+
+/*
+ * Parse [fifo:|rr:]PRIO argument of --realtime
+ *
+ * Returns 0 on success, -1 on invalid argument
+ */
+int parse_realtime(const char *arg)
+{
+  config.rtpolicy = SCHED_FIFO;
+  if (!strncasecmp(arg, "fifo:", 5))
+    arg += 5;
+  else if (!strncasecmp(arg, "rr:", 3)) {
+    config.rtpolicy = SCHED_RR;
+    arg += 3;
+  }
+  config.rtprio = atoi(arg);
+
+  return config.rtprio < sched_get_priority_min(config.rtpolicy) || config.rtprio > sched_get_priority_max(config.rtpolicy) ? -1 : 0;
+}
+
+/*
+ * Add a device with the settings given so far
+ */
+void add_device(const char *name)
+{
+  if (!(devices = realloc(devices, (numdevices + 1) * sizeof(struct device)))) {
+    perror("Can't allocate device");
+    exit(1);
+  }
+  memset(&devices[numdevices], 0, sizeof(struct device));
+  devices[numdevices].name = name;
+  devices[numdevices].config = config;
+  numdevices++;
+}
+
+/*
+ * Parse command line arguments
+ *
+ * Each device gets the settings in effect where it is named. Settings
+ * changed after the last device are applied to it too, so options may
+ * follow the device when there is only one.
+ */
+void parseargs(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"model", required_argument, NULL, 'm'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"version", no_argument, NULL, 'V'},
+    {"affinity", required_argument, NULL, 'a'},
+    {"keepalive", required_argument, NULL, 'k'},
+    {"realtime", required_argument, NULL, 'R'},
+    {"overflow", required_argument, NULL, 'o'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"weight", required_argument, NULL, 'w'},
+    {"starvation", required_argument, NULL, 's'},
+    {"stats", required_argument, NULL, 'S'},
+    {"status", required_argument, NULL, 'P'},
+    {"commands", required_argument, NULL, 'K'},
+    {"capture", required_argument, NULL, 'c'},
+    {"capture-size", required_argument, NULL, 'C'},
+    {"replay", required_argument, NULL, 'r'},
+    {"max-speed", no_argument, NULL, 'M'},
+    {"share", required_argument, NULL, 'x'},
+    {"cat", required_argument, NULL, 'y'},
+    {"cat-queries", required_argument, NULL, 'q'},
+    {"sockets", required_argument, NULL, 'u'},
+    {"trace", no_argument, NULL, 'T'},
+    {"keying", required_argument, NULL, 'E'},
+    {NULL, 0, NULL, 0}
+  };
+  int c;
+  int option_index;
+  int radio;
+
+  while ((c = getopt_long(argc, argv, "-hm:vVa:k:R:o:b:w:s:S:P:K:c:C:r:Mx:y:q:u:TE:", long_options, &option_index)) != -1) {
+    switch (c) {
+    case 1:
+      if (!strlen(optarg))
+	show_help();
+      add_device(optarg);
+      break;
+    case 'm':
+      if (!strcasecmp(optarg, "MK"))
+	config.model = MODEL_MK;
+      else if (!strcasecmp(optarg, "DK"))
+	config.model = MODEL_DK;
+      else if (!strcasecmp(optarg, "CK"))
+	config.model = MODEL_CK;
+      else if (!strcasecmp(optarg, "MK2R"))
+	config.model = MODEL_MK2R;
+      else if (!strcasecmp(optarg, "MK2R+"))
+	config.model = MODEL_MK2RPLUS;
+      else if (!strcasecmp(optarg, "MK2"))
+	config.model = MODEL_MK2;
+      else if (!strcasecmp(optarg, "DK2"))
+	config.model = MODEL_DK2;
+      else if (!strcasecmp(optarg, "U2R"))
+	config.model = MODEL_U2R;
+      else if (!strcasecmp(optarg, "SM"))
+	config.model = MODEL_SM;
+      // TODO: Add MODEL_SMD
+      break;
+    case 'v':
+      verbosity++;
+      break;
+    case 'V':
+      show_version();
+      break;
+    case 'a':
+      if (parse_cpus(optarg, &config.cpus))
+	show_help();
+      config.pinned = 1;
+      break;
+    case 'k':
+      if ((config.keepalive = atoi(optarg)) < 1)
+	show_help();
+      break;
+    case 'R':
+      if (parse_realtime(optarg))
+	show_help();
+      break;
+    case 'o':
+      if (parse_overflow(optarg))
+	show_help();
+      break;
+    case 'b':
+      config.sched.backlog_limit = atoi(optarg);
+      break;
+    case 'w':
+      if (!strncasecmp(optarg, "radio1:", 7))
+	config.sched.weight[0] = atoi(optarg + 7);
+      else if (!strncasecmp(optarg, "radio2:", 7))
+	config.sched.weight[1] = atoi(optarg + 7);
+      else
+	show_help();
+      if (config.sched.weight[0] < 1 || config.sched.weight[0] > 5 || config.sched.weight[1] < 1 || config.sched.weight[1] > 5)
+	show_help();
+      break;
+    case 's':
+      if ((config.sched.starve_limit = atoi(optarg)) < 1)
+	show_help();
+      break;
+    case 'S':
+      stats_path = optarg;
+      break;
+    case 'P':
+      config.status_path = optarg;
+      break;
+    case 'K':
+      config.command_path = optarg;
+      break;
+    case 'c':
+      config.capture_path = optarg;
+      break;
+    case 'C':
+      if ((config.capture_size = atoi(optarg)) < 1)
+	show_help();
+      break;
+    case 'r':
+      replay_path = optarg;
+      break;
+    case 'M':
+      replay_fast = 1;
+      break;
+    case 'x':
+      if ((radio = parse_radio(optarg)) < 0)
+	show_help();
+      if ((config.share[radio] = atoi(optarg + 7)) < 1 || config.share[radio] > SHARE_PTYS)
+	show_help();
+      break;
+    case 'y':
+      if (parse_cat(optarg))
+	show_help();
+      break;
+    case 'q':
+      if ((radio = parse_radio(optarg)) < 0)
+	show_help();
+      config.cat_queries[radio] = optarg + 7;
+      break;
+    case 'u':
+      config.socket_dir = optarg;
+      break;
+    case 'T':
+      config.trace = 1;
+      break;
+    case 'E':
+      if (parse_keying(optarg))
+	show_help();
+      break;
+    case 'h':
+    case '?':
+    default:
+      show_help();
+      break;
+    }
+  }
+
+  if (replay_path) {
+    if (numdevices)
+      show_help();
+    add_device(NULL);
+  }
+  if (!numdevices)
+    show_help();
+  devices[numdevices - 1].config = config;
+}
+
+/*
+ * Are both files given and the same?
+ */
+int same_file(const char *a, const char *b)
+{
+  return a && b && !strcmp(a, b);
+}
+
+/*
+ * Open a pty for a channel and print its name
+ *
+ * Packet mode is for ptys whose modem lines are followed.
+ */
+int device_pty(struct device *d, const char *name, int packet)
+{
+  int fd = newpty(packet);
+
+  printf("%s%s%s: %s\n", d->label, *d->label ? " " : "", name, (char *)ptsname(fd));
+  return fd;
+}
+
+/*
+ * Set up sharing of a radio channel and open the extra ptys
+ *
+ * w is the channel's own pty, which becomes the first client. With a
+ * socket directory, the channel's socket clients come after the ptys, and
+ * their input queues are allocated here. Print error message and exit on
+ * failure.
+ */
+void share_setup(struct device *d, int radio, struct watch *w)
+{
+  struct catshare *s = &d->shares[radio];
+  int n = d->config.share[radio];
+  int clients = n + (d->config.socket_dir ? SOCKET_CLIENTS : 0);
+  char name[16];
+  int fd;
+  int i;
+
+  if (cat_init(&s->cat, d->config.cat_protocol[radio], d->config.cat_ttl[radio] * 1000000ULL, clients, d->config.cat_queries[radio])) {
+    fprintf(stderr, "Invalid CAT queries for %s\n", w->name);
+    exit(1);
+  }
+  s->numptys = n;
+  s->endpoint = NULL;
+  for (i = 0; i < clients; i++)
+    ringbuf_init(&s->in[i], PTY_RXBUF_SIZE);
+  w->in = &s->in[0];
+  s->watches[0] = w;
+  for (i = 1; i < n; i++) {
+    snprintf(name, sizeof(name), "Radio %c #%i", '1' + radio, i + 1);
+    fd = device_pty(d, name, 0);
+    snprintf(s->names[i], sizeof(s->names[i]), "radio%c-%i", '1' + radio, i + 1);
+    outqueue_init(&s->out[i], PTY_TXBUF_SIZE, d->config.overflow_policy[radio + 1]);
+    s->watches[i] = &d->ptywatches[d->numptywatches++];
+    watch_add(d->epfd, s->watches[i], fd, s->names[i], &s->in[i], &s->out[i]);
+  }
+}
+
+/*
+ * Free the buffers of a shared radio channel
+ *
+ * The first pty uses the channel's own output queue.
+ */
+void share_free(struct catshare *s)
+{
+  int i;
+
+  for (i = 0; i < s->cat.numclients; i++) {
+    ringbuf_free(&s->in[i]);
+    if (i && i < s->numptys)
+      outqueue_free(&s->out[i]);
+  }
+}
+
+/*
+ * Set up keying of a radio and open its keying pty
+ *
+ * The keying timer is created with the first one. Print error message and
+ * exit on failure.
+ */
+void keying_setup(struct device *d, int radio)
+{
+  static const char *labels[2][2] = {{"CW 1", "CW 2"}, {"Ext FSK 1", "Ext FSK 2"}};
+  static const char *names[2][2] = {{"cw1", "cw2"}, {"extfsk1", "extfsk2"}};
+  int mode = d->config.keying_mode[radio];
+  int fd;
+
+  if (keying_init(&d->keying[radio], mode, d->config.keying_speed[radio], d->config.keying_weight[radio])) {
+    fprintf(stderr, "Invalid keying speed or weight for radio%i\n", radio + 1);
+    exit(1);
+  }
+  if (d->keyingfd < 0) {
+    if ((d->keyingfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+      perror("Can't create keying timer");
+      exit(1);
+    }
+    watch_add(d->txepfd, &d->keyingwatch, d->keyingfd, "keying", NULL, NULL);
+    watch_set(d->txepfd, &d->keyingwatch, EPOLLIN);
+  }
+  ringbuf_init(&d->keyingin[radio], PTY_RXBUF_SIZE);
+  fd = device_pty(d, labels[mode][radio], 0);
+  watch_add(d->epfd, &d->ptywatches[d->numptywatches++], fd, names[mode][radio], &d->keyingin[radio], NULL);
+}
+
+/*
+ * Open the device and set it up for the link
+ *
+ * The settings it had are stored in oldtio if not NULL. Returns the file
+ * descriptor, or -1 with errno set on failure.
+ */
+int device_open(struct device *d, struct termios *oldtio)
+{
+  struct termios tio;
+  int fd;
+  int err;
+
+  if ((fd = open(d->name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) == -1)
+    return -1;
+  if (!tcgetattr(fd, &tio)) {
+    if (oldtio)
+      *oldtio = tio;
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B230400);
+    cfsetospeed(&tio, B230400);
+    // NOTE: This does NOT guarantee that ALL parameters are set
+    if (!tcsetattr(fd, TCSADRAIN, &tio))
+      return fd;
+  }
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+/*
+ * Get ready to follow bytes on the channels of the first ptys
+ *
+ * Control commands and shared radio channels go through engines that
+ * reframe them, so they aren't followed.
+ */
+void trace_setup(struct device *d, int channels)
+{
+  static const int decode[] = {DECODE_R1, DECODE_R2, DECODE_WINKEY, DECODE_KEYBOARD};
+  struct outqueue *outs[] = {&d->rxq.radio1, &d->rxq.radio2, &d->rxq.winkey, &d->rxq.keyboard};
+  struct latency *l;
+  struct watch *w;
+  int i, j;
+
+  memset(d->txlatency, 0, sizeof(d->txlatency));
+  memset(d->rxlatency, 0, sizeof(d->rxlatency));
+  memset(&d->rxreads, 0, sizeof(d->rxreads));
+  d->numtxlatency = 0;
+  d->numrxlatency = 0;
+  for (i = 1; i < channels; i++) {
+    w = &d->ptywatches[i];
+    if (w == d->shares[0].watches[0] || w == d->shares[1].watches[0])
+      continue;
+    if (w->in) {
+      l = &d->txlatency[d->numtxlatency++];
+      l->name = w->name;
+      l->in = w->in;
+    }
+    for (j = 0; j < 4; j++)
+      if (w->out == outs[j]) {
+	l = &d->rxlatency[d->numrxlatency++];
+	l->name = w->name;
+	l->out = w->out;
+	l->channel = decode[j];
+	w->out->latency = l;
       }
+  }
+}
+
+/*
+ * Open the device and its ptys and get ready to mux and demux
+ *
+ * Print error message and exit on failure
+ */
+void device_setup(struct device *d)
+{
+  struct ports *ports = &d->ports;
+  struct watch *radiowatch[2] = {NULL, NULL};
+  int model;
+  int blocked;
+  int channels;
+  int i;
+
+  memset(ports, -1, sizeof(*ports));
+  if (!d->name) {
+    ports->keyer = replay_start(&d->replay, replay_path, replay_fast);
+    if (d->config.model == MODEL_UNSUPPORTED)
+      d->config.model = d->replay.cap.hdr->model;
+    debugprintf(1, "Replaying %s.\n", replay_path);
+  }
+  if (d->config.model == MODEL_UNSUPPORTED)
+    show_help();
+  model = d->config.model;
+
+  if (d->name) {
+    debugprintf(1, "Using microkeyer device %s.\n", d->name);
+    if ((ports->keyer = device_open(d, &d->oldtio)) == -1) {
+      fprintf(stderr, "Can't open microkeyer device %s: %s\n", d->name, strerror(errno));
+      exit(1);
+    }
+    d->alive = monotonic_ns();
+    d->keepalivedue = d->config.keepalive ? d->alive : 0;
+  }
+
+  if (d->config.capture_path) {
+    capture_open(&d->capture, d->config.capture_path, d->config.capture_size << 20, model, monotonic_ns());
+    pthread_mutex_init(&d->capturelock, NULL);
+    d->capturing = 1;
+  }
+
+  // TODO: Check device type automatically with GET VERSION command and set model
+
+  // TODO: Add option to create symlinks to the pty slaves at stable paths,
+  // for programs that can only open a tty. Their names are printed, and -u
+  // offers every channel at a stable path, but only as a socket.
+
+  // Open ptys
+  ports->control = device_pty(d, "Control", 0);
+
+  if (MODEL_HAS_RADIO1(model))
+    ports->radio1 = device_pty(d, "Radio 1", 1);
+
+  // MK2 and SM has AUX, not RADIO2, but it is only the name of the port that changes
+  if (MODEL_HAS_RADIO2(model))
+    ports->radio2 = device_pty(d, "Radio 2", 1);
+
+  if (MODEL_HAS_FSK1(model))
+    ports->fsk1 = device_pty(d, "FSK 1", 1);
+
+  if (MODEL_HAS_FSK2(model))
+    ports->fsk2 = device_pty(d, "FSK 2", 1);
+
+  if (MODEL_HAS_WINKEY(model))
+    ports->winkey = device_pty(d, "Winkey", 0);
+
+  if (MODEL_HAS_KEYBOARD(model))
+    ports->keyboard = device_pty(d, "Keyboard", 0);
+  fflush(stdout);
+
+  ringbuf_init(&d->keyerrx, KEYER_RXBUF_SIZE);
+  ringbuf_init(&d->keyertx, KEYER_TXBUF_SIZE);
+  txqueues_init(&d->txq, PTY_RXBUF_SIZE); // Lines are down until a client sets up the pty
+  d->sched = d->config.sched;
+  decoder_init(&d->dec);
+  control_init(&d->control);
+  memset(&d->rxq, 0, sizeof(d->rxq)); // Queues are only allocated for existing ptys
+  outqueue_init(&d->rxq.control, PTY_TXBUF_SIZE, d->config.overflow_policy[0]);
+  if (ports->radio1 >= 0)
+    outqueue_init(&d->rxq.radio1, PTY_TXBUF_SIZE, d->config.overflow_policy[1]);
+  if (ports->radio2 >= 0)
+    outqueue_init(&d->rxq.radio2, PTY_TXBUF_SIZE, d->config.overflow_policy[2]);
+  if (ports->winkey >= 0)
+    outqueue_init(&d->rxq.winkey, PTY_TXBUF_SIZE, d->config.overflow_policy[3]);
+  if (ports->keyboard >= 0)
+    outqueue_init(&d->rxq.keyboard, PTY_TXBUF_SIZE, d->config.overflow_policy[4]);
+
+  // The RX and TX threads register the device themselves, once they run
+  if ((d->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || (d->rxepfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || (d->txepfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("Can't create epoll instance");
+    exit(1);
+  }
+  d->linkgen = 1;
+  d->wakefd = wakeup_fd();
+  watch_add(d->epfd, &d->wakewatch, d->wakefd, "wakeup", NULL, NULL);
+  watch_set(d->epfd, &d->wakewatch, EPOLLIN);
+  d->rxwakefd = wakeup_fd();
+  watch_add(d->rxepfd, &d->rxwakewatch, d->rxwakefd, "wakeup", NULL, NULL);
+  watch_set(d->rxepfd, &d->rxwakewatch, EPOLLIN);
+  d->txwakefd = wakeup_fd();
+  watch_add(d->txepfd, &d->txwakewatch, d->txwakefd, "wakeup", NULL, NULL);
+  watch_set(d->txepfd, &d->txwakewatch, EPOLLIN);
+  if ((d->pacerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+    perror("Can't create pacing timer");
+    exit(1);
+  }
+  watch_add(d->txepfd, &d->pacerwatch, d->pacerfd, "pacer", NULL, NULL);
+  watch_set(d->txepfd, &d->pacerwatch, EPOLLIN);
+  d->numptywatches = 0;
+  watch_add(d->epfd, &d->ptywatches[d->numptywatches++], ports->control, "control", &d->txq.control, &d->rxq.control);
+  // The radio ptys' lines are RTS to the radio, the FSK ptys' are PTT. The
+  // serial settings of both are sent to their channels on the device.
+  if (ports->radio1 >= 0) {
+    radiowatch[0] = &d->ptywatches[d->numptywatches];
+    watch_add(d->epfd, &d->ptywatches[d->numptywatches], ports->radio1, "radio1", &d->txq.radio1, &d->rxq.radio1);
+    d->ptywatches[d->numptywatches].channelcmd = CONTROL_SET_R1_RADIO_CHANNEL;
+    d->ptywatches[d->numptywatches++].lineflag = FLAGS_R1_RTS;
+  }
+  if (ports->radio2 >= 0) {
+    radiowatch[1] = &d->ptywatches[d->numptywatches];
+    watch_add(d->epfd, &d->ptywatches[d->numptywatches], ports->radio2, "radio2", &d->txq.radio2, &d->rxq.radio2);
+    d->ptywatches[d->numptywatches].channelcmd = CONTROL_SET_R2_RADIO_CHANNEL;
+    d->ptywatches[d->numptywatches++].lineflag = FLAGS_R2_RTS;
+  }
+  if (ports->fsk1 >= 0) {
+    watch_add(d->epfd, &d->ptywatches[d->numptywatches], ports->fsk1, "fsk1", &d->txq.fsk1, NULL);
+    d->ptywatches[d->numptywatches].channelcmd = CONTROL_SET_R1_FSK_CHANNEL;
+    d->ptywatches[d->numptywatches++].lineflag = FLAGS_R1_PTT;
+  }
+  if (ports->fsk2 >= 0) {
+    watch_add(d->epfd, &d->ptywatches[d->numptywatches], ports->fsk2, "fsk2", &d->txq.fsk2, NULL);
+    d->ptywatches[d->numptywatches].channelcmd = CONTROL_SET_R2_FSK_CHANNEL;
+    d->ptywatches[d->numptywatches++].lineflag = FLAGS_R2_PTT;
+  }
+  if (ports->winkey >= 0)
+    watch_add(d->epfd, &d->ptywatches[d->numptywatches++], ports->winkey, "winkey", &d->txq.winkey, &d->rxq.winkey);
+  if (ports->keyboard >= 0)
+    watch_add(d->epfd, &d->ptywatches[d->numptywatches++], ports->keyboard, "keyboard", NULL, &d->rxq.keyboard);
+  channels = d->numptywatches;
+  // Shared radio channels take commands from their own ptys and more
+  for (i = 0; i < 2; i++) {
+    if (d->config.share[i] > 1 && d->config.cat_protocol[i] < 0) {
+      fprintf(stderr, "Sharing radio%i needs a CAT protocol\n", i + 1);
+      exit(1);
+    }
+    if (radiowatch[i] && d->config.cat_protocol[i] >= 0)
+      share_setup(d, i, radiowatch[i]);
+  }
+  // Keying ptys feed the TX thread directly, so they aren't channels
+  d->keyingfd = -1;
+  for (i = 0; i < 2; i++) {
+    if (d->config.keying_mode[i] >= 0 && !radiowatch[i]) {
+      fprintf(stderr, "No radio%i to key\n", i + 1);
+      exit(1);
+    }
+    if (d->config.keying_mode[i] >= 0)
+      keying_setup(d, i);
+  }
+  fflush(stdout);
+  // The channels' sockets share the queues of their ptys, so they must be
+  // set up after sharing has taken over a radio pty's input
+  d->numendpoints = 0;
+  if (d->config.socket_dir)
+    for (i = 0; i < channels; i++)
+      endpoint_open(d, &d->ptywatches[i]);
+  if (d->config.trace)
+    trace_setup(d, channels);
+
+  d->commandfd = -1;
+  for (i = 0; i < COMMAND_CLIENTS; i++)
+    d->clients[i].fd = -1;
+  if (d->config.command_path) {
+    d->commandfd = unix_listen(d->config.command_path, SOCK_SEQPACKET, "command");
+    watch_add(d->epfd, &d->commandwatch, d->commandfd, "command socket", NULL, NULL);
+    watch_set(d->epfd, &d->commandwatch, EPOLLIN);
+  }
+
+  if (d->config.status_path) {
+    status_open(&d->status, d->config.status_path, model);
+    for (i = 0; i < d->numptywatches; i++)
+      status_add_channel(&d->status, d->ptywatches[i].name);
+    d->publishing = 1;
+    publish_status(d);
+  }
+
+  if (!d->name) {
+    watch_add(d->epfd, &d->replaywatch, d->replay.timer, "replay", NULL, NULL);
+    watch_set(d->epfd, &d->replaywatch, EPOLLIN);
+    watch_add(d->epfd, &d->feedwatch, d->replay.feed, "feed", NULL, NULL);
+    blocked = replay_feed(&d->replay);
+    if (d->replay.feed >= 0)
+      watch_set(d->epfd, &d->feedwatch, EPOLLIN | (blocked ? EPOLLOUT : 0));
+  }
+}
+
+/*
+ * Try to reopen a lost device
+ *
+ * Once it is back, it is set up again as it was before it was lost.
+ */
+void device_reconnect(struct device *d, uint64_t now)
+{
+  int fd;
+
+  if ((fd = device_open(d, NULL)) == -1) {
+    debugprintf(7, "Can't reopen %s: %s\n", d->name, strerror(errno));
+    d->retrydue = now + RECONNECT_INTERVAL;
+    return;
+  }
+  if (dup3(fd, d->ports.keyer, O_CLOEXEC) == -1) {
+    perror("Can't reopen microkeyer device");
+    exit(1);
+  }
+  close(fd);
+  fprintf(stderr, "Reconnected to microkeyer device %s\n", d->name);
+  d->linkstats.reconnects++;
+  d->retrydue = 0;
+  __atomic_store_n(&d->alive, now, __ATOMIC_RELAXED);
+  d->probed = 0;
+  __atomic_store_n(&d->linkgen, d->linkgen + 1, __ATOMIC_RELEASE);
+  wakeup(d->rxwakefd);
+  wakeup(d->txwakefd);
+  d->reconfigure = 1;
+}
+
+/*
+ * Check that the device is still there
+ *
+ * After a keepalive interval without data from the device, it is asked
+ * whether it is there, once per interval. If it hasn't sent anything for
+ * KEEPALIVE_LIMIT intervals, it is taken as lost. Returns when to check
+ * again, 0 if it was lost.
+ */
+uint64_t keepalive(struct device *d, uint64_t now)
+{
+  static const unsigned char probe[] = {CONTROL_ARE_YOU_THERE, CONTROL_ARE_YOU_THERE | CONTROL_END_COMMAND};
+  uint64_t interval = d->config.keepalive * 1000000ULL;
+  uint64_t alive = __atomic_load_n(&d->alive, __ATOMIC_RELAXED);
+
+  if (now < alive) // Data came in after now was taken
+    return alive + interval;
+  if (now - alive >= KEEPALIVE_LIMIT * interval) {
+    device_lost(d, "Not responding");
+    return 0;
+  }
+  if (now - alive >= interval && now - d->probed >= interval) {
+    debugprintf(7, "Checking that %s is there.\n", d->name);
+    control_send(&d->control, &d->txq, probe, sizeof(probe), COMMAND_FROM_DAEMON, now);
+    d->probed = now;
+  }
+  return MIN(alive + KEEPALIVE_LIMIT * interval, MAX(alive, d->probed) + interval);
+}
+
+/*
+ * Earlier of two times, 0 meaning never
+ */
+uint64_t earliest(uint64_t a, uint64_t b)
+{
+  return !a || (b && b < a) ? b : a;
+}
+
+/*
+ * Frame the commands written to the control pty and the shared radio ptys
+ * and sockets, and queue them for the device, along with what socket
+ * clients of other channels have sent
+ *
+ * CAT queries answered from the cache are written to the clients at once.
+ */
+void frame_commands(struct device *d, uint64_t now)
+{
+  struct ringbuf *radio[2] = {&d->txq.radio1, &d->txq.radio2};
+  struct catshare *s;
+  struct cat_reply r;
+  int i, j;
+
+  control_frame_pty(&d->control, &d->txq, now);
+  endpoints_input(d);
+  for (i = 0; i < 2; i++) {
+    s = &d->shares[i];
+    if (!s->cat.numclients)
+      continue;
+    while (cat_frame(&s->cat, s->in, radio[i], now, &r)) {
+      deliver_cat(s, &r);
+      for (j = 0; j < s->cat.numclients; j++)
+	if ((r.to & (1U << j)) && s->watches[j]->fd >= 0)
+	  write_pty(s->watches[j]);
+    }
+  }
+}
+
+/*
+ * Running count of everything queued for the TX thread
+ *
+ * Only for the device thread, like txqueues_queued().
+ */
+unsigned long tx_queued(struct device *d)
+{
+  return txqueues_queued(&d->txq) + d->keyingin[0].head + d->keyingin[1].head;
+}
+
+/*
+ * Is pty input held up until the TX thread has sent some of what is queued?
+ */
+int tx_blocked(struct device *d)
+{
+  int i, j;
+
+  if (d->control.ptydone || cat_pending(&d->shares[0].cat) || cat_pending(&d->shares[1].cat))
+    return 1;
+  // Control socket clients wait for room for a command of any length
+  if (d->numendpoints && d->endpoints[0].type == SOCK_SEQPACKET && !command_room(&d->txq, CONTROL_MAX_COMMAND))
+    return 1;
+  for (i = 0; i < d->numptywatches; i++)
+    if (d->ptywatches[i].in && !ringbuf_space(d->ptywatches[i].in))
+      return 1;
+  // Socket clients wait for room for all they have read
+  for (i = 0; i < d->numendpoints; i++)
+    for (j = 0; j < SOCKET_CLIENTS; j++)
+      if (ringbuf_used(&d->endpoints[i].clientin[j]))
+	return 1;
+  return 0;
+}
+
+/*
+ * Serve the ptys and command clients of one device until exit
+ *
+ * If the device is lost, the ptys stay open while it is reopened.
+ */
+void *device_thread(void *arg)
+{
+  struct device *d = arg;
+  int blocked;                   // Replay feed is full
+  int replayed = 0;              // Whole capture has been decoded
+
+  while (1) { // TODO: Fix loop condition
+    struct epoll_event events[MAX_EVENTS];
+    int numready; // Number of ready fds
+    struct control_reply reply;
+    struct endpoint *ep;
+    uint64_t deadline;
+    uint64_t now;
+    int timeout = -1;
+    int i;
+
+    // Wait for input from ptys and clients, for ptys to accept output, or
+    // to be woken up by the RX or TX thread, and no longer than until a
+    // control command is overdue or the device is to be checked or reopened
+    deadline = earliest(control_deadline(&d->control), earliest(d->retrydue, d->keepalivedue));
+    if (deadline) {
+      now = monotonic_ns();
+      timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+    }
+    if ((numready = epoll_wait(d->epfd, events, MAX_EVENTS, timeout)) == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("Error waiting for input");
+      exit(1);
     }
+    d->linkstats.wakeups++;
     debugprintf(12, "Number of ready fds: %i.\n", numready);
 
-    // Check if there is new input from keyer
-    if (FD_ISSET(ports.keyer, &fds)) {
-      if (read(ports.keyer, &frame[framepos], 1) == 1)
-	framepos++;
-      debugprintf(6, "Read 1 byte from device: %02x, new framepos=%i.\n", frame[framepos - 1], framepos);
-      if (framepos >= 4) {
-	framepos = 0;
-	debugprintf(4, "Decoding frame.\n");
-	decode_frame(frame, &ports);
+    for (i = 0; i < numready; i++) {
+      struct watch *w = events[i].data.ptr;
+
+      if (w == &d->wakewatch)
+	wakeup_clear(d->wakefd);
+      else if (!d->name && (w == &d->replaywatch || w == &d->feedwatch)) {
+	uint64_t expirations;
+	if (w == &d->replaywatch && read(d->replay.timer, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+	  perror("Error reading replay timer");
+	if (d->replay.feed >= 0) {
+	  blocked = replay_feed(&d->replay);
+	  if (d->replay.feed >= 0)
+	    watch_set(d->epfd, &d->feedwatch, EPOLLIN | (blocked ? EPOLLOUT : 0));
+	}
+      }
+      else if (w == &d->commandwatch)
+	accept_clients(d);
+      else if (w >= d->clients && w < d->clients + COMMAND_CLIENTS)
+	serve_client(d, w);
+      else if ((ep = find_endpoint(d, w))) {
+	if (w == &ep->watch)
+	  endpoint_accept(d, ep);
+	else
+	  endpoint_serve(d, ep, w, events[i].events);
+      }
+      else {
+	if (events[i].events & EPOLLOUT)
+	  write_pty(w);
+	if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	  read_pty(d, w);
+      }
+    }
+
+    take_decoded(d);
+
+    // Close the device if the RX or TX thread has found it gone. A replay
+    // ends there, but the ptys are kept open, so that clients can read what
+    // is left.
+    if ((d->linkgen & 1) && __atomic_load_n(&d->failedgen, __ATOMIC_ACQUIRE) == d->linkgen && !replayed) {
+      if (d->name)
+	device_lost(d, failure_reason(__atomic_load_n(&d->failure, __ATOMIC_RELAXED)));
+      else {
+	printf("Replay finished\n");
+	print_all_stats(stdout);
+	replayed = 1;
+      }
+    }
+
+    // Reopen a lost device, check that it is still there, and set it up
+    // again if it has lost its settings
+    now = monotonic_ns();
+    if (d->retrydue && now >= d->retrydue)
+      device_reconnect(d, now);
+    d->keepalivedue = 0;
+    if (d->name && (d->linkgen & 1) && d->config.keepalive)
+      d->keepalivedue = keepalive(d, now);
+    if (d->reconfigure && (d->linkgen & 1))
+      reconfigure(d);
+
+    // Give up on overdue control commands, and frame the ones written to
+    // the control and shared radio ptys. If pty input has to wait for room
+    // in the queues, have the TX thread wake us up when it has made some,
+    // and try again in case it did before it saw that we wait.
+    while (control_expire(&d->control, now, &reply))
+      deliver_reply(d, &reply);
+    frame_commands(d, now);
+    if (tx_blocked(d)) {
+      __atomic_store_n(&d->txstalled, 1, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      frame_commands(d, now);
+    }
+
+    // Have the TX thread send what has been queued. While the device is
+    // lost, it stays queued.
+    if (tx_queued(d) != d->txqueued) {
+      d->txqueued = tx_queued(d);
+      wakeup(d->txwakefd);
+    }
+
+    for (i = 0; i < d->numptywatches; i++)
+      watch_rearm(d->epfd, &d->ptywatches[i]);
+    rearm_endpoints(d);
+    if (d->publishing)
+      publish_status(d);
+  }
+
+  close(d->wakefd);
+  if (d->commandfd >= 0)
+    close(d->commandfd);
+  close(d->epfd);
+  txqueues_free(&d->txq);
+  outqueue_free(&d->rxq.control);
+  outqueue_free(&d->rxq.radio1);
+  outqueue_free(&d->rxq.radio2);
+  outqueue_free(&d->rxq.winkey);
+  outqueue_free(&d->rxq.keyboard);
+  share_free(&d->shares[0]);
+  share_free(&d->shares[1]);
+  ringbuf_free(&d->keyingin[0]);
+  ringbuf_free(&d->keyingin[1]);
+  close_endpoints(d);
+  if (d->name)
+    tcsetattr(d->ports.keyer, TCSADRAIN, &d->oldtio);
+  return NULL;
+}
+
+/*
+ * Read and decode what comes from one device until exit
+ *
+ * The device is only waited for while it is open, hasn't failed, and there
+ * is room for what it sends, since a failed device keeps reporting that it
+ * has hung up.
+ */
+void *rx_thread(void *arg)
+{
+  struct device *d = arg;
+  unsigned int gen = 0;          // Connection the thread is set up for
+  int registered = 0;            // Device is registered with epoll
+  int failed = 0;                // Connection has failed
+
+  while (1) {
+    struct epoll_event events[2];
+    unsigned int linkgen = __atomic_load_n(&d->linkgen, __ATOMIC_ACQUIRE);
+    int wanted;                  // Device should be waited for
+    int numready;
+    int i;
+
+    // Start over when the device has been lost or reopened. The descriptor
+    // may have been replaced, which removes it from epoll.
+    if (linkgen != gen) {
+      if (registered)
+	epoll_ctl(d->rxepfd, EPOLL_CTL_DEL, d->ports.keyer, NULL);
+      registered = 0;
+      failed = 0;
+      gen = linkgen;
+      ringbuf_clear(&d->keyerrx);
+      d->dec.sequencepos = 0;
+    }
+
+    // Decode what was held back while the device thread was behind, and
+    // read what has come in
+    if (gen & 1) {
+      rx_decode(d);
+      if (!failed && receive_frames(d, gen))
+	failed = 1;
+    }
+    wanted = (gen & 1) && !failed && ringbuf_space(&d->keyerrx);
+    if (registered && !wanted) {
+      epoll_ctl(d->rxepfd, EPOLL_CTL_DEL, d->ports.keyer, NULL);
+      registered = 0;
+    }
+    else if (!registered && wanted)
+      registered = !watch_device(d->rxepfd, &d->rxkeyerwatch, EPOLL_CTL_ADD, d->ports.keyer, EPOLLIN);
+
+    if ((numready = epoll_wait(d->rxepfd, events, 2, -1)) == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("Error waiting for device");
+      exit(1);
+    }
+    d->linkstats.rxwakeups++;
+    for (i = 0; i < numready; i++)
+      if (events[i].data.ptr == &d->rxwakewatch)
+	wakeup_clear(d->rxwakefd);
+  }
+  return NULL;
+}
+
+/*
+ * Encode and send what is queued for one device until exit
+ */
+void *tx_thread(void *arg)
+{
+  struct device *d = arg;
+  unsigned int gen = 0;          // Connection the thread is set up for
+  int registered = 0;            // Device is registered with epoll
+  size_t heldback;               // Bytes to wait before sending held back bulk data
+  size_t taken;                  // Bytes taken from the keying ptys' queues
+  unsigned long sequences;
+
+  // Keying edges are timed to the microsecond, so don't let the kernel
+  // gather the timer with others
+  if (d->keyingfd >= 0)
+    prctl(PR_SET_TIMERSLACK, 1);
+
+  while (1) {
+    struct epoll_event events[4];
+    unsigned int linkgen = __atomic_load_n(&d->linkgen, __ATOMIC_ACQUIRE);
+    int numready;
+    int i;
+
+    // Start over when the device has been lost or reopened. Sequences
+    // encoded for the old connection are dropped, since the device may
+    // have got only part of one.
+    if (linkgen != gen) {
+      if (registered)
+	epoll_ctl(d->txepfd, EPOLL_CTL_DEL, d->ports.keyer, NULL);
+      gen = linkgen;
+      ringbuf_clear(&d->keyertx);
+      if (d->numtxlatency)
+	trace_tx(d, 1);
+      d->sched.link_idle = 0;
+      d->sched.starved = 0;
+      pace(d, 0);
+      registered = (gen & 1) && !watch_device(d->txepfd, &d->txkeyerwatch, EPOLL_CTL_ADD, d->ports.keyer, 0);
+    }
+
+    // Pack the queued data into sequences and send them in one go. If bulk
+    // data is held back, wake up when the device has caught up. Keying
+    // edges that are due go out in the first sequence.
+    if (registered) {
+      sequences = d->sched.sequences;
+      taken = d->keyingfd >= 0 ? run_keying(d) : 0;
+      heldback = encode_sequences(&d->txq, &d->keyertx, &d->sched, device_backlog(d->ports.keyer, &d->sched));
+      pace(d, heldback);
+      if (d->numtxlatency)
+	trace_tx(d, 0);
+      if (flush_sequences(d)) {
+	if (d->name)
+	  link_failed(d, gen, errno);
+	else
+	  perror("Error sending sequence to device");
+	epoll_ctl(d->txepfd, EPOLL_CTL_DEL, d->ports.keyer, NULL);
+	registered = 0;
+      }
+      // Only wait for the device to become writable if it has fallen
+      // behind or there is more to encode than fit in the buffer
+      else if (watch_device(d->txepfd, &d->txkeyerwatch, EPOLL_CTL_MOD, d->ports.keyer, ringbuf_used(&d->keyertx) || urgent_pending(&d->txq) || (!heldback && bulk_pending(&d->txq)) ? EPOLLOUT : 0))
+	registered = 0;
+
+      // Wake up the device thread if it waits for room in the queues
+      if (d->sched.sequences != sequences || taken) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&d->txstalled, __ATOMIC_RELAXED) && __atomic_exchange_n(&d->txstalled, 0, __ATOMIC_SEQ_CST))
+	  wakeup(d->wakefd);
+      }
+    }
+
+    if ((numready = epoll_wait(d->txepfd, events, 4, -1)) == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("Error waiting for device");
+      exit(1);
+    }
+    d->linkstats.txwakeups++;
+    for (i = 0; i < numready; i++) {
+      struct watch *w = events[i].data.ptr;
+
+      if (w == &d->pacerwatch) {
+	uint64_t expirations;
+	if (read(d->pacerfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+	  perror("Error reading pacing timer");
+	else if (d->pacerdue) {
+	  jitter_add(&d->jitter, d->pacerdue, monotonic_ns());
+	  d->pacerdue = 0;
+	}
+      }
+      else if (w == &d->keyingwatch) {
+	uint64_t expirations;
+	if (read(d->keyingfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+	  perror("Error reading keying timer");
+	d->keyingdue = 0;
+      }
+      else if (w == &d->txwakewatch)
+	wakeup_clear(d->txwakefd);
+      else if (registered && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+	// Reported even when not asked for, so stop waiting for the device
+	if (d->name)
+	  link_failed(d, gen, -1);
+	epoll_ctl(d->txepfd, EPOLL_CTL_DEL, d->ports.keyer, NULL);
+	registered = 0;
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int epfd;                      // For waiting on signals and statistics requests
+  int sigfd;                     // SIGUSR1 delivery
+  struct watch sigwatch;         // Signal registration with epoll
+  int statsfd = -1;              // Listening statistics socket
+  struct watch statswatch;       // Statistics socket registration with epoll
+  sigset_t sigs;
+  pthread_attr_t attr;
+  int realtime = 0;              // Memory is locked
+  int i, j;
+  int err;
+
+  // Parse command line arguments
+  parseargs(argc, argv);
+  if (verbosity)
+    log_start();
+  for (i = 0; i < numdevices; i++) {
+    if (numdevices > 1)
+      snprintf(devices[i].label, sizeof(devices[i].label), "keyer%i", i);
+    for (j = 0; j < i; j++) {
+      if (same_file(devices[i].config.capture_path, devices[j].config.capture_path)) {
+	fprintf(stderr, "Capture file %s given for more than one device\n", devices[i].config.capture_path);
+	exit(1);
+      }
+      if (same_file(devices[i].config.status_path, devices[j].config.status_path)) {
+	fprintf(stderr, "Status page %s given for more than one device\n", devices[i].config.status_path);
+	exit(1);
+      }
+      if (same_file(devices[i].config.command_path, devices[j].config.command_path)) {
+	fprintf(stderr, "Command socket %s given for more than one device\n", devices[i].config.command_path);
+	exit(1);
       }
-      numready--;
-    }
-
-    // Construct and populate sequence
-    sequence_init(sequence);
-    if (read(ports.control, &data, 1) == 1) {
-      // NOTE: This does NOT implement the protocol correctly. This implementation
-      //       doesn't allow the end byte to occur within the command string. This
-      //       should be possible, as such bytes are legal and may occur.
-      // TODO: Add some out-of-band signalling to indicate start and end of a command
-      debugprintf(6, "Input from control: %02x ('%c')\n", data, data);
-      if (!controlendbyte) { // If 0x00, this is the start of a new command
-	debugprintf(7, "Start of new command\n");
-	sequence_set_control(sequence, data, 0);
-	if (data) // 0x00 NOP is a single byte command
-	  controlendbyte = data | 0x80;
+    }
+  }
+  // Sending to the device after the end of a replayed capture, or to a
+  // socket client that has gone away, is an error, not a reason to die
+  signal(SIGPIPE, SIG_IGN);
+
+  // SIGUSR1 is only taken by the main thread, through a signalfd. The
+  // device threads inherit the blocked mask.
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) || (sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+    perror("Can't set up signal handling");
+    exit(1);
+  }
+
+  for (i = 0; i < numdevices; i++)
+    device_setup(&devices[i]);
+
+  // Everything the device threads use is allocated by now. In real-time
+  // mode, lock it into memory, along with the thread stacks to come.
+  for (i = 0; i < numdevices; i++)
+    if (devices[i].config.rtprio && !realtime) {
+      if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+	perror("Can't lock memory");
+	exit(1);
       }
-      else if (controlendbyte == data) { // End of a command
-	debugprintf(7, "End of command\n");
-	sequence_set_control(sequence, data, 0);
-	controlendbyte = 0x00;
+      realtime = 1;
+    }
+
+  // Mux and demux until exit
+  start_time = monotonic_ns();
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+  for (i = 0; i < numdevices * 3; i++) {
+    static void *(*const threadfuncs[3])(void *) = {device_thread, rx_thread, tx_thread};
+    struct device *d = &devices[i / 3];
+    pthread_t *thread = &d->threads[i % 3];
+    struct sched_param param;
+
+    if ((err = pthread_create(thread, &attr, threadfuncs[i % 3], d))) {
+      fprintf(stderr, "Can't start device thread: %s\n", strerror(err));
+      exit(1);
+    }
+    if (d->config.pinned && (err = pthread_setaffinity_np(*thread, sizeof(cpu_set_t), &d->config.cpus))) {
+      fprintf(stderr, "Can't set CPU affinity of %s: %s\n", d->name ? d->name : replay_path, strerror(err));
+      exit(1);
+    }
+    param.sched_priority = d->config.rtprio;
+    if (d->config.rtprio && (err = pthread_setschedparam(*thread, d->config.rtpolicy, &param))) {
+      fprintf(stderr, "Can't set real-time priority of %s: %s\n", d->name ? d->name : replay_path, strerror(err));
+      exit(1);
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  // Dump statistics on SIGUSR1 or request on the statistics socket
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("Can't create epoll instance");
+    exit(1);
+  }
+  watch_add(epfd, &sigwatch, sigfd, "signal", NULL, NULL);
+  watch_set(epfd, &sigwatch, EPOLLIN);
+  if (stats_path) {
+    statsfd = unix_listen(stats_path, SOCK_STREAM, "statistics");
+    watch_add(epfd, &statswatch, statsfd, "stats", NULL, NULL);
+    watch_set(epfd, &statswatch, EPOLLIN);
+  }
+
+  while (1) {
+    struct epoll_event events[2];
+    int numready;
+
+    if ((numready = epoll_wait(epfd, events, 2, -1)) == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("Error waiting for signals");
+      exit(1);
+    }
+    for (i = 0; i < numready; i++) {
+      if (events[i].data.ptr == &sigwatch) {
+	struct signalfd_siginfo si;
+
+	while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+	  print_all_stats(stdout);
       }
       else
-	sequence_set_control(sequence, data, 1);
-      FD_CLR(ports.control, &eoffds);
-    }
-    else if (FD_ISSET(ports.control, &fds)) {
-      debugprintf(7, "EOF or error from control. Removing from select fds.\n");
-      FD_SET(ports.control, &eoffds);
-    }
-    // TODO: Read up to 5 bytes from radio1 and radio2 in order to fill up sequence
-    if (read(ports.radio1, &data, 1) == 1) {
-      debugprintf(6, "Input from radio1: %02x ('%c')\n", data, data);
-      sequence_set_radio(sequence, 1, 0, data);
-      FD_CLR(ports.radio1, &eoffds);
-    }
-    else if (FD_ISSET(ports.radio1, &fds)) {
-      debugprintf(7, "EOF or error from radio1. Removing from select fds.\n");
-      FD_SET(ports.radio1, &eoffds);
-    }
-    if (read(ports.radio2, &data, 1) == 1) {
-      debugprintf(6, "Input from radio2: %02x ('%c')\n", data, data);
-      sequence_set_radio(sequence, 2, 0, data);
-      FD_CLR(ports.radio2, &eoffds);
-    }
-    else if (FD_ISSET(ports.radio2, &fds)) {
-      debugprintf(7, "EOF or error from radio2. Removing from select fds.\n");
-      FD_SET(ports.radio2, &eoffds);
-    }
-    if (read(ports.fsk1, &data, 1) == 1) {
-      debugprintf(6, "Input from fsk1: %02x ('%c')\n", data, data);
-      sequence_set_fsk(sequence, 1, data);
-      FD_CLR(ports.fsk1, &eoffds);
-    }
-    else if (FD_ISSET(ports.fsk1, &fds)) {
-      debugprintf(7, "EOF or error from fsk1. Removing from select fds.\n");
-      FD_SET(ports.fsk1, &eoffds);
-    }
-    if (read(ports.fsk2, &data, 1) == 1) {
-      debugprintf(6, "Input from fsk2: %02x ('%c')\n", data, data);
-      sequence_set_fsk(sequence, 2, data);
-      FD_CLR(ports.fsk2, &eoffds);
-    }
-    else if (FD_ISSET(ports.fsk2, &fds)) {
-      debugprintf(7, "EOF or error from fsk2. Removing from select fds.\n");
-      FD_SET(ports.fsk2, &eoffds);
-    }
-    if (read(ports.winkey, &data, 1) == 1) {
-      debugprintf(6, "Input from winkey: %02x ('%c')\n", data, data);
-      sequence_set_winkey(sequence, data);
-      FD_CLR(ports.winkey, &eoffds);
-    }
-    else if (FD_ISSET(ports.winkey, &fds)) {
-      debugprintf(7, "EOF or error from winkey. Removing from select fds.\n");
-      FD_SET(ports.winkey, &eoffds);
-    }
-    
-    if (frames_in_sequence(sequence)) {
-      // Set flags whenever sending a sequence
-      sequence_set_rts(sequence, 1); // TODO: Actually check RTS value on radio1
-      sequence_set_rts(sequence, 2); // TODO: Actually check RTS value on radio2
-      // TODO: Set ptt1 and ptt2 flags
-      // TODO: Set cw1 and cw2 flags
-      send_sequence(ports.keyer, sequence);
-    }
-  }
-  
-  tcsetattr(ports.keyer,TCSADRAIN,&oldtio);
+	serve_stats(statsfd);
+    }
+  }
+
   return 0;
 }
@@ -4,6 +4,7 @@
 #define FTDI_VID            0x0403 /* FTDI USB vendor ID */
 #define MHAM_MICROKEYER_PID 0xEEEF /* microHAM micro KEYER family product ID */
                                    /* Also used by incompatible products :-( */
+#define KEYER_BYTES_PER_SEC 23040  /* Link rate, 230400 baud 8N1 */
 
 /*
  * Device models supported by the driver
@@ -20,6 +21,16 @@
 #define MODEL_SM       0x09          /* microHAM Station Master */
 #define MODEL_SMD      0x0A          /* microHAM Station Master Deluxe */
 
+/*
+ * Channels available on each model
+ */
+#define MODEL_HAS_RADIO1(m)   ((m) != MODEL_U2R)
+#define MODEL_HAS_RADIO2(m)   ((m) == MODEL_MK2R || (m) == MODEL_MK2RPLUS || (m) == MODEL_MK2 || (m) == MODEL_SM) /* AUX on MK2 and SM */
+#define MODEL_HAS_FSK1(m)     ((m) != MODEL_CK && (m) != MODEL_SM)
+#define MODEL_HAS_FSK2(m)     ((m) == MODEL_MK2R || (m) == MODEL_MK2RPLUS || (m) == MODEL_U2R)
+#define MODEL_HAS_WINKEY(m)   ((m) != MODEL_DK && (m) != MODEL_SM)
+#define MODEL_HAS_KEYBOARD(m) ((m) != MODEL_SM)
+
 /*
  * Bit fields in synchro byte (byte 0) of frame
  */
@@ -43,6 +54,7 @@
 #define FLAGS_R2_FSK_EXT 0x20
 #define FLAGS_R1_CW      0x40
 #define FLAGS_R2_CW      0x80
+#define FLAGS_ACTIVE_LOW (FLAGS_R1_RTS | FLAGS_R2_RTS)
 
 /*
  * Flags sent from device to computer, FLAGS_IS_R2 used to select R1 or R2
@@ -126,6 +138,12 @@
 #define CHANNEL_PARITY_SPACE     0x00
 #define CHANNEL_PARITY_MARK      0x80
 
+/*
+ * Baud rate divisor of SET_*_CHANNEL control commands is CLOCK / baud rate
+ */
+#define CHANNEL_RADIO_CLOCK      11059200
+#define CHANNEL_FSK_CLOCK        2700
+
 typedef unsigned char frame_t[4];     /* A 4 byte frame */
 typedef unsigned char sequence_t[21]; /* Sequence of up to 5 frames + number of frames to send */
 
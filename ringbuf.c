@@ -0,0 +1,249 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "ringbuf.h"
+
+/*
+ * Only the thread adding to a buffer moves head and only the thread
+ * removing from it moves tail. Each publishes its move with release
+ * ordering after touching the data, and reads the other's with acquire
+ * ordering before touching it.
+ */
+#define LOAD(pos)       __atomic_load_n(&(pos), __ATOMIC_ACQUIRE)
+#define STORE(pos, val) __atomic_store_n(&(pos), (val), __ATOMIC_RELEASE)
+
+/*
+ * Allocate buffer space
+ *
+ * Print error message and exit on failure
+ */
+void ringbuf_init(struct ringbuf *rb, size_t size)
+{
+  if (!size || (size & (size - 1))) {
+    fprintf(stderr, "Ring buffer size %zu is not a power of two\n", size);
+    exit(1);
+  }
+  if (!(rb->data = malloc(size))) {
+    perror("Can't allocate ring buffer");
+    exit(1);
+  }
+  rb->size = size;
+  rb->head = 0;
+  rb->tail = 0;
+}
+
+void ringbuf_free(struct ringbuf *rb)
+{
+  free(rb->data);
+  rb->data = NULL;
+  rb->size = 0;
+}
+
+/*
+ * Discard everything in the buffer
+ *
+ * Only for the thread removing from the buffer
+ */
+void ringbuf_clear(struct ringbuf *rb)
+{
+  STORE(rb->tail, LOAD(rb->head));
+}
+
+/*
+ * Number of bytes in the buffer
+ */
+size_t ringbuf_used(const struct ringbuf *rb)
+{
+  return LOAD(rb->head) - LOAD(rb->tail);
+}
+
+/*
+ * Number of bytes that can be added before the buffer is full
+ */
+size_t ringbuf_space(const struct ringbuf *rb)
+{
+  return rb->size - (LOAD(rb->head) - LOAD(rb->tail));
+}
+
+/*
+ * Add up to len bytes to the buffer
+ *
+ * Returns number of bytes actually added
+ */
+size_t ringbuf_put(struct ringbuf *rb, const unsigned char *data, size_t len)
+{
+  size_t pos = rb->head & (rb->size - 1);
+  size_t first;
+
+  if (len > ringbuf_space(rb))
+    len = ringbuf_space(rb);
+  first = rb->size - pos;
+  if (first > len)
+    first = len;
+  memcpy(rb->data + pos, data, first);
+  memcpy(rb->data, data + first, len - first);
+  STORE(rb->head, rb->head + len);
+
+  return len;
+}
+
+/*
+ * Remove up to len bytes from the buffer
+ *
+ * Returns number of bytes actually removed
+ */
+size_t ringbuf_get(struct ringbuf *rb, unsigned char *data, size_t len)
+{
+  size_t pos = rb->tail & (rb->size - 1);
+  size_t first;
+
+  if (len > ringbuf_used(rb))
+    len = ringbuf_used(rb);
+  first = rb->size - pos;
+  if (first > len)
+    first = len;
+  memcpy(data, rb->data + pos, first);
+  memcpy(data + first, rb->data, len - first);
+  STORE(rb->tail, rb->tail + len);
+
+  return len;
+}
+
+/*
+ * Find the data that can be read without wrapping around
+ *
+ * Returns the number of contiguous bytes starting at *ptr
+ */
+size_t ringbuf_contig(const struct ringbuf *rb, unsigned char **ptr)
+{
+  size_t pos = rb->tail & (rb->size - 1);
+  size_t len = rb->size - pos;
+
+  *ptr = rb->data + pos;
+  return len < ringbuf_used(rb) ? len : ringbuf_used(rb);
+}
+
+/*
+ * Remove len bytes from the buffer without copying them
+ */
+void ringbuf_skip(struct ringbuf *rb, size_t len)
+{
+  if (len > ringbuf_used(rb))
+    len = ringbuf_used(rb);
+  STORE(rb->tail, rb->tail + len);
+}
+
+/*
+ * Describe len bytes starting at free running position pos
+ *
+ * The bytes may have been read already, e.g., pos = tail - n for the n
+ * bytes just written to a file descriptor, as long as they haven't been
+ * overwritten. Returns the number of iovecs used (1 or 2).
+ */
+int ringbuf_iov(const struct ringbuf *rb, size_t pos, size_t len, struct iovec iov[2])
+{
+  pos &= rb->size - 1;
+  iov[0].iov_base = rb->data + pos;
+  iov[0].iov_len = rb->size - pos;
+  if (iov[0].iov_len > len)
+    iov[0].iov_len = len;
+  iov[1].iov_base = rb->data;
+  iov[1].iov_len = len - iov[0].iov_len;
+
+  return iov[1].iov_len ? 2 : 1;
+}
+
+/*
+ * Fill the free space of the buffer from a file descriptor
+ *
+ * Uses a single readv() even if the free space wraps around the end of the
+ * buffer. Returns the result of readv(), i.e., 0 on EOF and -1 on error.
+ */
+ssize_t ringbuf_read_fd(struct ringbuf *rb, int fd)
+{
+  struct iovec iov[2];
+  size_t pos = rb->head & (rb->size - 1);
+  size_t space = ringbuf_space(rb);
+  ssize_t res;
+
+  iov[0].iov_base = rb->data + pos;
+  iov[0].iov_len = rb->size - pos;
+  if (iov[0].iov_len > space)
+    iov[0].iov_len = space;
+  iov[1].iov_base = rb->data;
+  iov[1].iov_len = space - iov[0].iov_len;
+
+  res = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+  if (res > 0)
+    STORE(rb->head, rb->head + res);
+
+  return res;
+}
+
+/*
+ * Read from a pty master in packet mode
+ *
+ * The packet's status byte is stored in *pkt and only data is stored in
+ * the buffer. Returns the number of bytes read, including the status byte.
+ */
+ssize_t ringbuf_read_pkt(struct ringbuf *rb, int fd, unsigned char *pkt)
+{
+  struct iovec iov[3];
+  ssize_t res;
+
+  iov[0].iov_base = pkt;
+  iov[0].iov_len = 1;
+  res = readv(fd, iov, 1 + ringbuf_iov(rb, rb->head, ringbuf_space(rb), iov + 1));
+  if (res > 1)
+    STORE(rb->head, rb->head + res - 1);
+
+  return res;
+}
+
+/*
+ * Write the contents of the buffer to a file descriptor
+ *
+ * Uses a single writev() even if the data wraps around the end of the
+ * buffer. Whatever is not accepted stays in the buffer. Returns the result
+ * of writev().
+ */
+ssize_t ringbuf_write_fd(struct ringbuf *rb, int fd)
+{
+  struct iovec iov[2];
+  size_t pos = rb->tail & (rb->size - 1);
+  size_t used = ringbuf_used(rb);
+  ssize_t res;
+
+  iov[0].iov_base = rb->data + pos;
+  iov[0].iov_len = rb->size - pos;
+  if (iov[0].iov_len > used)
+    iov[0].iov_len = used;
+  iov[1].iov_base = rb->data;
+  iov[1].iov_len = used - iov[0].iov_len;
+
+  res = writev(fd, iov, iov[1].iov_len ? 2 : 1);
+  if (res > 0)
+    STORE(rb->tail, rb->tail + res);
+
+  return res;
+}
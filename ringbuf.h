@@ -0,0 +1,38 @@
+#ifndef _RINGBUF_H
+#define _RINGBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Byte ring buffer
+ *
+ * Size must be a power of two. Head and tail are free running counters, so
+ * head - tail is always the number of bytes in the buffer.
+ *
+ * One thread may add to the buffer while another removes from it, without
+ * locking. Clearing and skipping count as removing.
+ */
+struct ringbuf {
+  unsigned char *data;
+  size_t size;
+  size_t head; /* Next position to write */
+  size_t tail; /* Next position to read */
+};
+
+void ringbuf_init(struct ringbuf *rb, size_t size);
+void ringbuf_free(struct ringbuf *rb);
+void ringbuf_clear(struct ringbuf *rb);
+size_t ringbuf_used(const struct ringbuf *rb);
+size_t ringbuf_space(const struct ringbuf *rb);
+size_t ringbuf_put(struct ringbuf *rb, const unsigned char *data, size_t len);
+size_t ringbuf_get(struct ringbuf *rb, unsigned char *data, size_t len);
+size_t ringbuf_contig(const struct ringbuf *rb, unsigned char **ptr);
+void ringbuf_skip(struct ringbuf *rb, size_t len);
+int ringbuf_iov(const struct ringbuf *rb, size_t pos, size_t len, struct iovec iov[2]);
+ssize_t ringbuf_read_fd(struct ringbuf *rb, int fd);
+ssize_t ringbuf_read_pkt(struct ringbuf *rb, int fd, unsigned char *pkt);
+ssize_t ringbuf_write_fd(struct ringbuf *rb, int fd);
+
+#endif
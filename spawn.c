@@ -0,0 +1,194 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "microkeyer.h"
+#include "spawn.h"
+
+#define MAX_DAEMON_ARGS 32
+
+/*
+ * Names the daemon prints before each pty
+ */
+const char *client_names[CLIENT_CHANNELS] = {"Control", "Radio 1", "Radio 2", "Winkey", "Keyboard", "FSK 1", "FSK 2"};
+
+const struct model models[] = {
+  {"MK", MODEL_MK},
+  {"DK", MODEL_DK},
+  {"CK", MODEL_CK},
+  {"MK2R", MODEL_MK2R},
+  {"MK2R+", MODEL_MK2RPLUS},
+  {"MK2", MODEL_MK2},
+  {"DK2", MODEL_DK2},
+  {"U2R", MODEL_U2R},
+  {"SM", MODEL_SM}
+};
+const int nummodels = sizeof(models) / sizeof(models[0]);
+
+/*
+ * Model number from name, MODEL_UNSUPPORTED if unknown
+ */
+int model_lookup(const char *name)
+{
+  int i;
+
+  for (i = 0; i < nummodels; i++)
+    if (!strcasecmp(name, models[i].name))
+      return models[i].model;
+  return MODEL_UNSUPPORTED;
+}
+
+/*
+ * Open a raw, non-blocking pty master to act as the device
+ *
+ * The slave name is available through ptsname(). Print error message and
+ * exit on failure.
+ */
+int open_device_pty()
+{
+  struct termios tio;
+  int fd;
+
+  if ((fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1 || grantpt(fd) || unlockpt(fd)) {
+    perror("Can't open device pty");
+    exit(1);
+  }
+  if (!tcgetattr(fd, &tio)) {
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+
+  return fd;
+}
+
+/*
+ * Open a pty slave in raw, non-blocking mode
+ *
+ * Print error message and exit on failure
+ */
+int open_raw(const char *name)
+{
+  struct termios tio;
+  int fd;
+
+  if ((fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) {
+    fprintf(stderr, "Can't open %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  if (!tcgetattr(fd, &tio)) {
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+
+  return fd;
+}
+
+/*
+ * Start the daemon on the slave side of the device pty
+ *
+ * extra is a NULL terminated list of additional arguments, or NULL. The
+ * client ptys the daemon reports are opened raw and returned in ptys,
+ * indexed by CLIENT_*, -1 for channels the model doesn't have. Returns the
+ * pid of the daemon.
+ */
+pid_t spawn_daemon(const char *path, int model, const char *modelname, int device, const char *const extra[], int ptys[CLIENT_CHANNELS])
+{
+  const char *argv[MAX_DAEMON_ARGS];
+  char line[256];
+  int pipefd[2];
+  int expected = 1, seen = 0;
+  int argc = 0;
+  pid_t pid;
+  FILE *out;
+  int c;
+
+  expected += MODEL_HAS_RADIO1(model) + MODEL_HAS_RADIO2(model) + MODEL_HAS_FSK1(model) + MODEL_HAS_FSK2(model) + MODEL_HAS_WINKEY(model) + MODEL_HAS_KEYBOARD(model);
+  argv[argc++] = path;
+  argv[argc++] = "-m";
+  argv[argc++] = modelname;
+  while (extra && *extra && argc < MAX_DAEMON_ARGS - 2)
+    argv[argc++] = *extra++;
+  argv[argc++] = ptsname(device);
+  argv[argc] = NULL;
+
+  if (pipe(pipefd)) {
+    perror("Can't create pipe");
+    exit(1);
+  }
+  if ((pid = fork()) == -1) {
+    perror("Can't fork");
+    exit(1);
+  }
+  if (!pid) {
+    dup2(pipefd[1], 1);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(device);
+    execv(path, (char *const *)argv);
+    perror("Can't start daemon");
+    _exit(1);
+  }
+  close(pipefd[1]);
+
+  for (c = 0; c < CLIENT_CHANNELS; c++)
+    ptys[c] = -1;
+  out = fdopen(pipefd[0], "r");
+  while (seen < expected && fgets(line, sizeof(line), out)) {
+    line[strcspn(line, "\n")] = '\0';
+    for (c = 0; c < CLIENT_CHANNELS; c++) {
+      size_t len = strlen(client_names[c]);
+
+      if (!strncmp(line, client_names[c], len) && !strncmp(line + len, ": ", 2)) {
+	ptys[c] = open_raw(line + len + 2);
+	seen++;
+      }
+    }
+  }
+  fclose(out);
+  if (seen < expected) {
+    fprintf(stderr, "Daemon didn't report all ptys\n");
+    exit(1);
+  }
+
+  return pid;
+}
+
+/*
+ * Stop the daemon and close its client ptys
+ */
+void stop_daemon(pid_t pid, int ptys[CLIENT_CHANNELS])
+{
+  int c;
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  for (c = 0; c < CLIENT_CHANNELS; c++)
+    if (ptys[c] >= 0)
+      close(ptys[c]);
+}
@@ -0,0 +1,42 @@
+#ifndef _SPAWN_H
+#define _SPAWN_H
+
+#include <sys/types.h>
+
+/*
+ * Running a microkeyer daemon against a pty standing in for the device,
+ * for tools that test it from both ends
+ */
+
+/*
+ * Client ptys created by the daemon
+ */
+#define CLIENT_CONTROL  0
+#define CLIENT_RADIO1   1
+#define CLIENT_RADIO2   2
+#define CLIENT_WINKEY   3
+#define CLIENT_KEYBOARD 4
+#define CLIENT_FSK1     5
+#define CLIENT_FSK2     6
+#define CLIENT_CHANNELS 7
+
+/*
+ * Model names as given to the daemon's -m option
+ */
+struct model {
+  const char *name;
+  int model;
+};
+
+extern const char *client_names[CLIENT_CHANNELS];
+extern const struct model models[];
+extern const int nummodels;
+
+int model_lookup(const char *name);
+
+int open_device_pty(void);
+int open_raw(const char *name);
+pid_t spawn_daemon(const char *path, int model, const char *modelname, int device, const char *const extra[], int ptys[CLIENT_CHANNELS]);
+void stop_daemon(pid_t pid, int ptys[CLIENT_CHANNELS]);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "status.h"
+
+/*
+ * Seqlock write side, only the device thread writes
+ */
+static void seq_begin(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_end(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Create a status page file
+ *
+ * Print error message and exit on failure
+ */
+void status_open(struct status *st, const char *filename, int model)
+{
+  if ((st->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+    perror("Can't create status page");
+    exit(1);
+  }
+  if (ftruncate(st->fd, sizeof(struct status_page))) {
+    perror("Can't allocate status page");
+    exit(1);
+  }
+  if ((st->page = mmap(NULL, sizeof(struct status_page), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, st->fd, 0)) == MAP_FAILED) {
+    perror("Can't map status page");
+    exit(1);
+  }
+
+  memset(st->page, 0, sizeof(*st->page));
+  st->page->model = model;
+  memcpy(st->page->magic, STATUS_MAGIC, sizeof(st->page->magic));
+}
+
+/*
+ * Name the next channel in the counters section
+ */
+void status_add_channel(struct status *st, const char *name)
+{
+  struct status_page *p = st->page;
+
+  if (p->numchannels == STATUS_CHANNELS)
+    return;
+  strncpy(p->counters.channel[p->numchannels].name, name, sizeof(p->counters.channel[0].name) - 1);
+  p->numchannels++;
+}
+
+/*
+ * Publish flags, if they have changed
+ *
+ * rxflags are the flags from the device in decoder format, and txflags the
+ * FLAGS_* sent to the device.
+ */
+void status_flags(struct status *st, uint32_t rxflags, unsigned char txflags, uint64_t now)
+{
+  struct status_flags *f = &st->page->flags;
+  unsigned char r1 = rxflags & 0xFF;
+  unsigned char r2 = (rxflags >> 8) & 0xFF;
+
+  if (f->radio[0] == r1 && f->radio[1] == r2 && f->sent == txflags && f->changes)
+    return;
+  seq_begin(&f->seq);
+  f->radio[0] = r1;
+  f->radio[1] = r2;
+  f->sent = txflags;
+  f->changed = now;
+  f->changes++;
+  seq_end(&f->seq);
+}
+
+/*
+ * Start updating the counters section
+ *
+ * The caller fills it in and calls status_counters_end().
+ */
+struct status_counters *status_counters_begin(struct status *st)
+{
+  seq_begin(&st->page->counters.seq);
+  return &st->page->counters;
+}
+
+void status_counters_end(struct status *st)
+{
+  seq_end(&st->page->counters.seq);
+}
@@ -0,0 +1,80 @@
+#ifndef _STATUS_H
+#define _STATUS_H
+
+#include <stdint.h>
+
+/*
+ * Status page
+ *
+ * A file, typically in /dev/shm, that clients map read-only to see flag
+ * state and counters of a device without talking to the daemon. The flags
+ * and counters are separate sections in their own cache lines, each with a
+ * sequence number that is odd while the section is being written. Flags
+ * are only written when they change. To read a section consistently:
+ *
+ *   do {
+ *     seq = __atomic_load_n(&section->seq, __ATOMIC_ACQUIRE);
+ *     copy = *section;
+ *     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *   } while ((seq & 1) || seq != __atomic_load_n(&section->seq, __ATOMIC_RELAXED));
+ *
+ * All times are CLOCK_MONOTONIC in ns.
+ */
+
+#define STATUS_MAGIC    "MKSTAT1"
+#define STATUS_CHANNELS 7
+
+struct status_flags {
+  uint32_t seq;
+  uint32_t changes;      /* Times the flags have changed */
+  uint64_t changed;      /* When they last changed */
+  uint8_t radio[2];      /* FLAGS_* from the device for radio 1 and 2 */
+  uint8_t sent;          /* FLAGS_* last sent to the device */
+  uint8_t pad[45];       /* Section is 64 bytes */
+};
+
+struct status_channel {
+  char name[16];         /* Pty name, as in the counters */
+  uint64_t in;           /* Bytes read from the pty */
+  uint64_t out;          /* Bytes written to the pty */
+  uint64_t dropped;      /* Bytes dropped because the pty was full */
+};
+
+struct status_counters {
+  uint32_t seq;
+  uint32_t pad;
+  uint64_t updated;      /* When the counters were last written */
+  uint64_t lastrx;       /* When data last came from the device, 0 if never */
+  uint64_t rxbytes;
+  uint64_t rxframes;
+  uint64_t rxoverlong;   /* Sequences longer than the protocol allows */
+  uint64_t txbytes;
+  uint64_t txframes;
+  struct status_channel channel[STATUS_CHANNELS];
+  uint64_t rxresyncs;    /* Times framing was lost, last for compatibility */
+};
+
+struct status_page {
+  char magic[8];
+  uint32_t model;        /* MODEL_* */
+  uint32_t numchannels;  /* Channels in use in the counters section */
+  uint64_t pad[6];       /* Header is 64 bytes */
+  struct status_flags flags;
+  struct status_counters counters;
+};
+
+/*
+ * Open status page, written by one device thread only
+ */
+struct status {
+  int fd;
+  struct status_page *page;
+};
+
+void status_open(struct status *st, const char *filename, int model);
+void status_add_channel(struct status *st, const char *name);
+void status_flags(struct status *st, uint32_t rxflags, unsigned char txflags, uint64_t now);
+struct status_counters *status_counters_begin(struct status *st);
+void status_counters_end(struct status *st);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * microkeyer
+ *
+ * Copyright 2011 Norvald H. Ryeng
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+/*
+ * Has the byte at pos been removed from a ring with the given tail?
+ *
+ * Positions are free running, so they are compared by difference.
+ */
+int trace_passed(size_t tail, size_t pos)
+{
+  return (ptrdiff_t)(tail - pos) > 0;
+}
+
+/*
+ * Bucket of a latency in microseconds
+ *
+ * Below 4 us, each microsecond has its own bucket. Above, each power of
+ * two is split in four.
+ */
+static int bucket(uint64_t us)
+{
+  int e;
+
+  if (us < 4)
+    return us;
+  e = 63 - __builtin_clzll(us);
+  if (4 * (e - 1) + 3 >= TRACE_BUCKETS)
+    return TRACE_BUCKETS - 1;
+  return 4 * (e - 1) + ((us >> (e - 2)) & 3);
+}
+
+/*
+ * Upper bound of a bucket in microseconds
+ */
+static uint64_t bucket_limit(int i)
+{
+  int e = i / 4 + 1;
+
+  if (i < 4)
+    return i + 1;
+  return (uint64_t)(4 + i % 4 + 1) << (e - 2);
+}
+
+void trace_add(struct trace_hist *h, uint64_t ns)
+{
+  h->count[bucket(ns / 1000)]++;
+  h->samples++;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+/*
+ * Latency that a share p of the samples don't exceed, in ns
+ *
+ * Rounded up to the end of its bucket, but never above the largest seen.
+ * 0 if there are no samples.
+ */
+uint64_t trace_percentile(const struct trace_hist *h, double p)
+{
+  unsigned long seen = 0;
+  uint64_t limit;
+  int i;
+
+  if (!h->samples)
+    return 0;
+  for (i = 0; i < TRACE_BUCKETS - 1; i++)
+    if ((seen += h->count[i]) >= p * h->samples)
+      break;
+  limit = bucket_limit(i) * 1000;
+  return limit < h->max ? limit : h->max;
+}
+
+/*
+ * Remember a read that left the ring's head at head
+ */
+void trace_read(struct trace_reads *r, size_t head, uint64_t time)
+{
+  r->head[r->next % TRACE_READS] = head;
+  r->time[r->next % TRACE_READS] = time;
+  r->next++;
+}
+
+/*
+ * When the byte at pos was read
+ *
+ * If it was read before the oldest read remembered, that read's time is
+ * used, so the latency is never overestimated.
+ */
+uint64_t trace_read_time(const struct trace_reads *r, size_t pos)
+{
+  unsigned int i = r->next;
+  uint64_t time = 0;
+
+  while (i != r->next - TRACE_READS && i-- > 0) {
+    if (!trace_passed(r->head[i % TRACE_READS], pos))
+      break;
+    time = r->time[i % TRACE_READS];
+  }
+  return time;
+}
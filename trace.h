@@ -0,0 +1,64 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Latency tracing
+ *
+ * One byte at a time per channel and direction is followed through the
+ * pipeline, stamped with CLOCK_MONOTONIC at each stage, and the time each
+ * stage took is counted in a histogram with fixed buckets. Bytes are
+ * followed by their position in the ring they wait in, so nothing is added
+ * to the data itself.
+ */
+
+#define TRACE_BUCKETS 80 /* Four per power of two microseconds, up to about a second */
+#define TRACE_READS   16 /* Reads remembered to find out when a byte came */
+
+/*
+ * Where a followed byte is
+ *
+ * A probe is handed from one thread to another by setting its state with
+ * release semantics. The thread that finds it idle starts it.
+ */
+#define TRACE_IDLE    0 /* Not following a byte, a new one may be picked */
+#define TRACE_WAITING 1 /* Waiting for the first stage to take it */
+#define TRACE_PASSED  2 /* Waiting for the second stage to take it */
+
+struct trace_probe {
+  int state;                     /* TRACE_* */
+  size_t pos;                    /* Position of the byte in the ring it waits in */
+  uint64_t start;                /* When it was read, ns */
+  uint64_t mid;                  /* When it passed the first stage, ns */
+};
+
+/*
+ * Histogram of stage latencies
+ *
+ * Written by one thread and read by others without locking, so a report
+ * may be slightly behind.
+ */
+struct trace_hist {
+  unsigned long count[TRACE_BUCKETS];
+  unsigned long samples;
+  uint64_t max;                  /* ns */
+};
+
+/*
+ * Recent reads into a ring, to find out when a byte was read
+ */
+struct trace_reads {
+  size_t head[TRACE_READS];      /* Ring head after each read */
+  uint64_t time[TRACE_READS];
+  unsigned int next;             /* Free running */
+};
+
+int trace_passed(size_t tail, size_t pos);
+void trace_add(struct trace_hist *h, uint64_t ns);
+uint64_t trace_percentile(const struct trace_hist *h, double p);
+void trace_read(struct trace_reads *r, size_t head, uint64_t time);
+uint64_t trace_read_time(const struct trace_reads *r, size_t pos);
+
+#endif